@@ -0,0 +1,169 @@
+#ifndef AHO_CORASICK_HPP_
+#define AHO_CORASICK_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*
+
+  An Aho-Corasick automaton: finds every occurrence of a set of patterns
+  in a text in one pass, in time linear in the length of the text (plus
+  the number of matches), however many patterns there are.
+
+  Example usage:
+
+  aho_corasick ac;
+  ac.add("invoice", 1);
+  ac.add("invoice line", 2);
+  ac.build();
+  ac.match("total of each invoice line", [](size_t id, size_t start, size_t end) {
+    // called for id 1 at [12, 19) and for id 2 at [12, 24)
+  });
+
+  Matching is case-insensitive for ASCII letters. With whole_words set
+  (the default), only matches that begin and end at word boundaries are
+  reported, so "art" matches "art" and "the art" but not "party".
+
+ */
+
+class aho_corasick {
+public:
+  void add(std::string_view pattern, size_t id) {
+    if (pattern.empty()) {
+      return;
+    }
+    if (_nodes.empty()) {
+      _nodes.emplace_back();
+    }
+    int32_t node = 0;
+    for (unsigned char c : pattern) {
+      auto next = child(node, fold(c));
+      if (next < 0) {
+	next = static_cast<int32_t>(_nodes.size());
+	auto& edges = _nodes[node].edges;
+	edges.insert(std::upper_bound(edges.begin(), edges.end(), std::make_pair(fold(c), next)), { fold(c), next });
+	_nodes.emplace_back();
+      }
+      node = next;
+    }
+    _nodes[node].outputs.push_back(static_cast<uint32_t>(_patterns.size()));
+    _patterns.push_back({ id, pattern.size() });
+    _built = false;
+  }
+
+  // Computes the failure links; call after the last add and before matching.
+  void build() {
+    if (_nodes.empty()) {
+      _nodes.emplace_back();
+    }
+    std::queue<int32_t> queue;
+    for (auto& [c, next] : _nodes[0].edges) {
+      _nodes[next].fail = 0;
+      queue.push(next);
+    }
+    // Breadth-first, so every node's failure link is set before its children's.
+    while (!queue.empty()) {
+      auto node = queue.front();
+      queue.pop();
+      for (auto& [c, next] : _nodes[node].edges) {
+	auto fail = _nodes[node].fail;
+	while (fail > 0 && child(fail, c) < 0) {
+	  fail = _nodes[fail].fail;
+	}
+	auto target = child(fail, c);
+	_nodes[next].fail = (target >= 0 && target != next) ? target : 0;
+	auto suffix = _nodes[next].fail;
+	_nodes[next].output_link = _nodes[suffix].outputs.empty() ? _nodes[suffix].output_link : suffix;
+	queue.push(next);
+      }
+    }
+    _built = true;
+  }
+
+  bool empty() const {
+    return _patterns.empty();
+  }
+
+  size_t size() const {
+    return _patterns.size();
+  }
+
+  void clear() {
+    _nodes.clear();
+    _patterns.clear();
+    _built = false;
+  }
+
+  void set_whole_words(bool whole_words) {
+    _whole_words = whole_words;
+  }
+
+  // Calls on_match(id, start, end) for every occurrence of a pattern in text.
+  template <class F>
+  void match(std::string_view text, F&& on_match) const {
+    if (!_built || _nodes.empty()) {
+      return;
+    }
+    int32_t node = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+      auto c = fold(static_cast<unsigned char>(text[i]));
+      while (node > 0 && child(node, c) < 0) {
+	node = _nodes[node].fail;
+      }
+      node = std::max<int32_t>(child(node, c), 0);
+      for (auto out = node; out > 0; out = _nodes[out].output_link) {
+	for (auto index : _nodes[out].outputs) {
+	  auto& pattern = _patterns[index];
+	  auto start = i + 1 - pattern.length;
+	  if (!_whole_words || (boundary(text, start) && boundary(text, i + 1))) {
+	    on_match(pattern.id, start, i + 1);
+	  }
+	}
+      }
+    }
+  }
+
+private:
+  struct node {
+    std::vector<std::pair<unsigned char, int32_t>> edges; // sorted by character
+    std::vector<uint32_t> outputs; // patterns ending here
+    int32_t fail = 0;
+    int32_t output_link = 0; // the nearest node on the failure chain with outputs
+  };
+
+  struct pattern {
+    size_t id;
+    size_t length;
+  };
+
+  static unsigned char fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+  }
+
+  static bool word_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+  }
+
+  // Whether position i (between text[i - 1] and text[i]) is a word boundary.
+  static bool boundary(std::string_view text, size_t i) {
+    return i == 0 || i == text.size() || !word_char(text[i - 1]) || !word_char(text[i]);
+  }
+
+  int32_t child(int32_t node, unsigned char c) const {
+    auto& edges = _nodes[node].edges;
+    auto it = std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, INT32_MIN));
+    return (it != edges.end() && it->first == c) ? it->second : -1;
+  }
+
+  std::vector<node> _nodes;
+  std::vector<pattern> _patterns;
+  bool _whole_words = true;
+  bool _built = false;
+};
+
+#endif
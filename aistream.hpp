@@ -1,8 +1,17 @@
 #include <fmt/format.h>
+#include <climits>
+#include <fstream>
 #include <iostream>
+#include <future>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <strings.h>
+#include <unordered_map>
 #include "openai.hpp"
 #include "json.hpp"
+#include "prompt.hpp"
 
 /*
 
@@ -45,6 +54,207 @@ namespace ai {
   enum class config { GPT_3_5, GPT_4_0 };
   enum class exception_value { NO_KEY_DEFINED, INVALID_KEY, TOO_MANY_RETRIES, OTHER };
 
+  inline const char* modelName(config config) {
+    switch (config) {
+    case config::GPT_3_5:
+      return "gpt-3.5-turbo";
+    case config::GPT_4_0:
+      return "gpt-4";
+    }
+    return "";
+  }
+
+  // Counts tokens the way OpenAI's models do, so prompts can be sized
+  // before they are sent. The byte-pair ranks come from a tiktoken file
+  // ("<base64 token> <rank>" per line), e.g. cl100k_base.tiktoken, found
+  // via SQLWRITE_TIKTOKEN_DIR or in ~/.sqlwrite. Without one, we fall back
+  // to an estimate from the same pre-tokenization (one token per ~4 bytes
+  // of each word), which is usually within 10-15%.
+  class tokenizer {
+  public:
+    // The tokenizer for a model (GPT-3.5 and GPT-4 share cl100k_base).
+    static const tokenizer& forModel(const std::string& model) {
+      static std::mutex mutex;
+      static std::map<std::string, std::unique_ptr<tokenizer>> tokenizers;
+      auto encoding = (model.rfind("gpt-4o", 0) == 0) ? "o200k_base" : "cl100k_base";
+      std::lock_guard<std::mutex> lock(mutex);
+      auto& t = tokenizers[encoding];
+      if (!t) {
+	t.reset(new tokenizer(encoding));
+      }
+      return *t;
+    }
+
+    static const tokenizer& forModel(ai::config config) {
+      return forModel(modelName(config));
+    }
+
+    // Whether counts are exact (we found the encoding's ranks) or estimates.
+    bool exact() const {
+      return !_ranks.empty();
+    }
+
+    const std::string& encoding() const {
+      return _encoding;
+    }
+
+    size_t count(std::string_view text) const {
+      size_t tokens = 0;
+      split(text, [&](const char* p, size_t n) {
+	tokens += countPiece(std::string(p, n));
+      });
+      return tokens;
+    }
+
+  private:
+    explicit tokenizer(const std::string& encoding)
+      : _encoding (encoding)
+    {
+      std::string dir;
+      if (auto env = std::getenv("SQLWRITE_TIKTOKEN_DIR")) {
+	dir = env;
+      } else if (auto home = std::getenv("HOME")) {
+	dir = std::string(home) + "/.sqlwrite";
+      }
+      std::ifstream file(dir + "/" + encoding + ".tiktoken");
+      std::string token, line;
+      while (std::getline(file, line)) {
+	auto space = line.find(' ');
+	if (space != std::string::npos && decodeBase64(line.substr(0, space), token)) {
+	  _ranks.emplace(std::move(token), std::atoi(line.c_str() + space + 1));
+	}
+      }
+    }
+
+    // Tokens for one pre-token: the number of parts left after repeatedly
+    // merging the adjacent pair whose merged bytes have the lowest rank.
+    size_t countPiece(const std::string& piece) const {
+      // Without ranks, or for pathologically long runs (where merging is
+      // quadratic), estimate instead.
+      if (_ranks.empty() || piece.size() > 256) {
+	return (piece.size() + 3) / 4;
+      }
+      if (_ranks.count(piece)) {
+	return 1;
+      }
+      std::vector<std::string> parts;
+      for (auto c : piece) {
+	parts.emplace_back(1, c);
+      }
+      while (parts.size() > 1) {
+	auto best = parts.size();
+	int best_rank = INT_MAX;
+	for (size_t i = 0; i + 1 < parts.size(); i++) {
+	  auto rank = _ranks.find(parts[i] + parts[i + 1]);
+	  if (rank != _ranks.end() && rank->second < best_rank) {
+	    best = i;
+	    best_rank = rank->second;
+	  }
+	}
+	if (best == parts.size()) {
+	  break;
+	}
+	parts[best] += parts[best + 1];
+	parts.erase(parts.begin() + best + 1);
+      }
+      return parts.size();
+    }
+
+    // Splits text into pre-tokens, following the cl100k_base pattern:
+    // contractions, words (with one leading non-letter), runs of up to
+    // three digits, punctuation (with one leading space), and whitespace.
+    // All non-ASCII bytes count as letters.
+    template <typename F>
+    static void split(std::string_view text, F emit) {
+      auto letter = [](unsigned char c) { return std::isalpha(c) || c >= 0x80; };
+      auto digit = [](unsigned char c) { return std::isdigit(c) != 0; };
+      auto space = [](unsigned char c) { return std::isspace(c) != 0; };
+      auto newline = [](unsigned char c) { return c == '\r' || c == '\n'; };
+      const size_t n = text.size();
+      auto at = [&](size_t i) -> unsigned char { return i < n ? text[i] : 0; };
+      size_t i = 0;
+      while (i < n) {
+	size_t j = i;
+	unsigned char c = at(i);
+	if (c == '\'') {
+	  for (auto suffix : { "re", "ve", "ll", "s", "t", "m", "d" }) {
+	    auto len = strlen(suffix);
+	    if (i + 1 + len <= n && strncasecmp(text.data() + i + 1, suffix, len) == 0) {
+	      j = i + 1 + len;
+	      break;
+	    }
+	  }
+	}
+	if (j == i && (letter(c) || (!newline(c) && !digit(c) && letter(at(i + 1))))) {
+	  j = letter(c) ? i : i + 1;
+	  while (j < n && letter(at(j))) {
+	    j++;
+	  }
+	} else if (j == i && digit(c)) {
+	  while (j < n && j < i + 3 && digit(at(j))) {
+	    j++;
+	  }
+	} else if (j == i && ((!space(c) && !letter(c) && !digit(c)) || (c == ' ' && at(i + 1) && !space(at(i + 1)) && !letter(at(i + 1)) && !digit(at(i + 1))))) {
+	  j = (c == ' ') ? i + 1 : i;
+	  while (j < n && !space(at(j)) && !letter(at(j)) && !digit(at(j))) {
+	    j++;
+	  }
+	  while (j < n && newline(at(j))) {
+	    j++;
+	  }
+	} else if (j == i) {
+	  // Whitespace: up to the last newline if there is one; otherwise all
+	  // but the last character if more text follows.
+	  size_t end = i;
+	  while (end < n && space(at(end))) {
+	    end++;
+	  }
+	  size_t last_newline = i;
+	  for (size_t k = i; k < end; k++) {
+	    if (newline(at(k))) {
+	      last_newline = k + 1;
+	    }
+	  }
+	  if (last_newline > i) {
+	    j = last_newline;
+	  } else if (end < n && end - i > 1) {
+	    j = end - 1;
+	  } else {
+	    j = end;
+	  }
+	}
+	emit(text.data() + i, j - i);
+	i = j;
+      }
+    }
+
+    static bool decodeBase64(const std::string& in, std::string& out) {
+      static const std::string alphabet("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/");
+      out.clear();
+      unsigned int bits = 0;
+      int count = 0;
+      for (auto c : in) {
+	if (c == '=') {
+	  break;
+	}
+	auto value = alphabet.find(c);
+	if (value == std::string::npos) {
+	  return false;
+	}
+	bits = (bits << 6) | value;
+	count += 6;
+	if (count >= 8) {
+	  count -= 8;
+	  out += static_cast<char>((bits >> count) & 0xff);
+	}
+      }
+      return true;
+    }
+
+    std::string _encoding;
+    std::unordered_map<std::string, int> _ranks;
+  };
+
   class stats {
   public:
     unsigned int completion_tokens = 0;
@@ -60,6 +270,140 @@ namespace ai {
     }
     std::function<bool(const json&)> function = [](const json&){ return true; };
   };
+
+  // Called with each top-level field of a JSON response as soon as it has
+  // streamed in, while the rest of the response is still on its way. Setting
+  // one makes the aistream ask for streamed responses (and for their usage,
+  // unless the server has rejected that; see rejectsStreamOptions). Fields
+  // arrive before the response is validated, and may be from one that
+  // fails to.
+  class on_field {
+  public:
+    explicit on_field(std::function<void(const std::string&, const json&)> f)
+      : function (f)
+    {
+    }
+    std::function<void(const std::string&, const json&)> function;
+  };
+
+  // Whether the server at url has rejected a streamed request that asked
+  // for usage (with stream_options, which not every OpenAI-compatible
+  // server knows); rejected = true records that it has.
+  inline bool rejectsStreamOptions(const std::string& url, bool rejected = false) {
+    static std::mutex mutex;
+    static std::set<std::string> urls;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (rejected) {
+      urls.insert(url);
+    }
+    return urls.count(url) > 0;
+  }
+
+  // Splits server-sent events, fed in pieces as they arrive, into the data
+  // of each event.
+  class event_stream {
+  public:
+    // Calls f(data) for each event that text completes.
+    template <class F>
+    void feed(std::string_view text, F&& f) {
+      _line.append(text.data(), text.size());
+      size_t start = 0;
+      for (size_t end; (end = _line.find('\n', start)) != std::string::npos; start = end + 1) {
+	auto line = std::string_view(_line).substr(start, end - start);
+	if (!line.empty() && line.back() == '\r') {
+	  line.remove_suffix(1);
+	}
+	if (line.empty()) {
+	  // A blank line ends an event.
+	  if (!_data.empty()) {
+	    f(std::string_view(_data));
+	    _data.clear();
+	  }
+	} else if (line.substr(0, 5) == "data:") {
+	  line.remove_prefix((line.size() > 5 && line[5] == ' ') ? 6 : 5);
+	  if (!_data.empty()) {
+	    _data += '\n';
+	  }
+	  _data.append(line.data(), line.size());
+	}
+	// Other fields (event, id, retry) and comments don't matter here.
+      }
+      _line.erase(0, start);
+    }
+
+  private:
+    std::string _line; // the start of a line that hasn't fully arrived
+    std::string _data;
+  };
+
+  // Finds the members of a JSON object in text that arrives piece by
+  // piece, so each can be used as soon as its value is complete. Anything
+  // before the object (such as a markdown fence) is skipped.
+  class json_fields {
+  public:
+    // Adds text, calling f(key, value) for each member of the object it completes.
+    template <class F>
+    void feed(std::string_view text, F&& f) {
+      _text.append(text.data(), text.size());
+      for (; _scanned < _text.size() && !_done; _scanned++) {
+	char c = _text[_scanned];
+	if (_depth == 0) {
+	  _depth = (c == '{') ? 1 : 0;
+	} else if (_in_string) {
+	  if (_escaped) {
+	    _escaped = false;
+	  } else if (c == '\\') {
+	    _escaped = true;
+	  } else if (c == '"') {
+	    _in_string = false;
+	    if (_depth == 1 && !_in_value) {
+	      _key_end = _scanned + 1;
+	    }
+	  }
+	} else if (c == '"') {
+	  _in_string = true;
+	  if (_depth == 1 && !_in_value) {
+	    _key_start = _scanned;
+	  }
+	} else if (c == ':' && _depth == 1 && !_in_value) {
+	  _in_value = true;
+	  _value_start = _scanned + 1;
+	} else if (c == '{' || c == '[') {
+	  _depth++;
+	} else if (c == ',' || c == '}' || c == ']') {
+	  if (_depth == 1 && _in_value) {
+	    _in_value = false;
+	    emit(f);
+	  }
+	  if (c != ',') {
+	    _depth--;
+	    _done = (_depth == 0);
+	  }
+	}
+      }
+    }
+
+  private:
+    template <class F>
+    void emit(F&& f) {
+      auto key = json::parse(_text.begin() + _key_start, _text.begin() + _key_end, nullptr, false);
+      auto value = json::parse(_text.begin() + _value_start, _text.begin() + _scanned, nullptr, false);
+      if (key.is_string() && !value.is_discarded()) {
+	f(key.get_ref<const std::string&>(), value);
+      }
+    }
+
+    std::string _text;
+    size_t _scanned = 0;
+    int _depth = 0;
+    bool _in_string = false;
+    bool _escaped = false;
+    bool _in_value = false;
+    bool _done = false;
+    size_t _key_start = 0;
+    size_t _key_end = 0;
+    size_t _value_start = 0;
+  };
   
   
   class exception {
@@ -110,16 +454,8 @@ namespace ai {
 
     // Overload << operator for configuration
     aistream& operator<<(const ai::config& config) {
-      switch (config) {
-      case ai::config::GPT_3_5:
-	_model = "gpt-3.5-turbo";
-	// std::cout << "GPT 3.5" << std::endl;
-	break;
-      case ai::config::GPT_4_0:
-	_model = "gpt-4";
-	// std::cout << "GPT 4" << std::endl;
-	break;
-      };
+      _model = modelName(config);
+      _request.clear();
       return *this;
     }
   
@@ -129,12 +465,24 @@ namespace ai {
       return *this;
     }
   
+    // Overload << operator for streaming
+    aistream& operator<<(const on_field& f) {
+      _on_field = f.function;
+      return *this;
+    }
+
     // Overload << operator to send queries
     aistream& operator<<(const json& js) {
       _messages.push_back(js);
       return *this;
     }
 
+    // Overload << operator to send queries whose content is a prompt
+    aistream& operator<<(ai::message m) {
+      _messages.push_back(std::move(m));
+      return *this;
+    }
+
     // Overload >> operator to save stats
     aistream& operator>>(stats& stats) {
       stats = _stats;
@@ -144,32 +492,80 @@ namespace ai {
     // Overload >> operator to read responses
     aistream& operator>>(json& response_json) {
       response_json = {{}};
+      response_json = read({});
+      return *this;
+    }
+
+    // Performs the query (as >> does) in the background, so that the
+    // requests of several aistreams can be in flight at once: the request
+    // is sent right away, on openai::Engine's event loop, and the returned
+    // future reads (and validates) its response when asked for the result,
+    // sending any retries then. Leave the aistream alone until then.
+    std::future<json> async() {
+      auto first = std::make_shared<pending>(send(request()));
+      return std::async(std::launch::deferred, [this, first]() {
+	return read(std::move(*first));
+      });
+    }
+
+    // The text of the last response.
+    const std::string& response() const {
+      return _result;
+    }
+
+    // The tokenizer for the configured model.
+    const ai::tokenizer& tokenizer() const {
+      return ai::tokenizer::forModel(_model);
+    }
+
+    void reset() {
+      // Clears chat history and validator.
+      _result = "";
+      _messages.clear();
+      _request.clear();
+      _validator = [](const json&) { return true; };
+      _on_field = nullptr;
+    }
+  
+  private:
+    // A request on its way (see send).
+    struct pending {
+      std::shared_ptr<openai::BodyStream> stream; // if it is streamed
+      std::future<json> response;
+      bool usage = false;    // asked for usage with stream_options
+      bool answered = false; // the server sent a body
+    };
+
+    // Reads the response to the request for the conversation so far,
+    // retrying until one validates; first, if valid, is the first attempt,
+    // already sent.
+    json read(pending first) {
       auto retries = _maxRetries;
-      json j;
-      j["model"] = _model;
-      j["messages"] = _messages;
+      auto& body = request();
       while (true) {
 	if (retries == 0) {
 	  throw ai::exception(ai::exception_value::TOO_MANY_RETRIES,
 			     fmt::format("Maximum number of retries exceeded ({}).", _maxRetries));
 	}
+	pending attempt;
 	try {
-	  if (_debug) {
-	    std::cerr << "Sending: " << j.dump() << std::endl;
-	  }
-	  auto chat = openai::chat().create(j);
+	  attempt = first.response.valid() ? std::move(first) : send(body);
+	  auto chat = receive(attempt);
 	  _result = chat["choices"][0]["message"]["content"].get<std::string>();
 	  if (_debug) {
 	    std::cerr << "Received: " << _result << std::endl;
 	  }
-	  _stats.completion_tokens += chat["usage"]["completion_tokens"].get<unsigned int>();
-	  _stats.prompt_tokens += chat["usage"]["prompt_tokens"].get<unsigned int>();
-	  _stats.total_tokens += chat["usage"]["total_tokens"].get<unsigned int>();
-	  response_json = json::parse(_result);
+	  // Streamed responses only report usage if the server supports stream_options.
+	  if (!_on_field || chat.contains("usage")) {
+	    _stats.completion_tokens += chat["usage"]["completion_tokens"].get<unsigned int>();
+	    _stats.prompt_tokens += chat["usage"]["prompt_tokens"].get<unsigned int>();
+	    _stats.total_tokens += chat["usage"]["total_tokens"].get<unsigned int>();
+	  }
+	  auto response_json = json::parse(_result);
 	  try {
 	    bool valid = _validator(response_json);
 	    if (valid) {
-	      break;
+	      return response_json;
 	    }
 	  } catch (ai::exception& e) {
 	    if (_debug) {
@@ -181,7 +577,7 @@ namespace ai {
 		  {"role", "user"},
 		  {"content", e.what() }
 		}));
-	    j["messages"] = _messages;
+	    request();
 #endif
 	  }
 	}
@@ -204,6 +600,12 @@ namespace ai {
 	    std::cerr << "Missing API key?" << std::endl;
 	    throw ai::exception(ai::exception_value::INVALID_KEY,
 			       fmt::format("The API key ({}) was invalid.", _key.c_str()));
+	  } else if (attempt.usage && attempt.answered) {
+	    // The server turned the request down, perhaps for asking for
+	    // usage: try once more without, and don't ask it again.
+	    rejectsStreamOptions(openai::instance().getBaseUrl(), true);
+	    request();
+	    continue;
 	  } else {
 	    // Otherwise, pass up the exception.
 	    throw e;
@@ -214,28 +616,114 @@ namespace ai {
 	  std::cerr << "Retrying. Retries remaining: " << retries << std::endl;
 	}
       }
-      return *this;
     }
 
-    void reset() {
-      // Clears chat history and validator.
-      _result = "";
-      _messages.clear();
-      _validator = [](const json&) { return true; };
+    // The body of the request for the conversation so far. Messages are
+    // only ever added, so each one is serialized once and every request
+    // starts with the same bytes as the one before (letting providers
+    // cache the prefix). Options follow the messages, so they don't
+    // change the prefix either.
+    const std::string& request() {
+      if (_request.empty()) {
+	_request = chatRequest(_model, {});
+	_requested = 0;
+	_tail = 2; // "]}"
+      }
+      _request.resize(_request.size() - _tail);
+      for (auto m = std::next(_messages.begin(), _requested); m != _messages.end(); m++) {
+	if (_requested++ > 0) {
+	  _request += ',';
+	}
+	writeMessage(_request, *m);
+      }
+      auto size = _request.size();
+      _usage = _on_field && !rejectsStreamOptions(openai::instance().getBaseUrl());
+      _request += !_on_field ? "]}" : _usage ? "],\"stream\":true,\"stream_options\":{\"include_usage\":true}}" : "],\"stream\":true}";
+      _tail = _request.size() - size;
+      return _request;
     }
-  
-  private:
+
+    // Sends body (for a streamed response if there is a field handler).
+    pending send(const std::string& body) {
+      if (_debug) {
+	std::cerr << "Sending: " << body << std::endl;
+      }
+      pending request;
+      if (_on_field) {
+	request.stream = std::make_shared<openai::BodyStream>();
+	request.usage = _usage;
+      }
+      request.response = openai::instance().postAsync("chat/completions", body, "application/json", request.stream);
+      return request;
+    }
+
+    // Waits for the response to request. A streamed one has each field of
+    // the JSON object it contains passed to the field handler as soon as
+    // it arrives, and is returned as it would have been without streaming.
+    json receive(pending& request) {
+      if (!request.stream) {
+	return request.response.get();
+      }
+      auto& stream = request.stream;
+      auto& response = request.response;
+      event_stream events;
+      json_fields fields;
+      std::string content;
+      json usage;
+      bool streamed = false;
+      std::string part;
+      while (stream->next(part)) {
+	request.answered = true;
+	events.feed(part, [&](std::string_view data) {
+	  auto event = json::parse(data, nullptr, false);
+	  if (!event.is_object()) {
+	    return; // such as "[DONE]"
+	  }
+	  streamed = true;
+	  if (event.contains("usage") && event["usage"].is_object()) {
+	    usage = event["usage"];
+	  }
+	  auto& choices = event["choices"];
+	  if (!choices.is_array() || choices.empty()) {
+	    return;
+	  }
+	  auto& delta = choices[0]["delta"]["content"];
+	  if (delta.is_string()) {
+	    auto& text = delta.get_ref<const std::string&>();
+	    content += text;
+	    fields.feed(text, _on_field);
+	  }
+	});
+      }
+      // Throws on errors, as post does.
+      auto chat = response.get();
+      if (!streamed) {
+	// The server answered all at once (e.g., with an error, or because it doesn't stream).
+	return chat;
+      }
+      chat = json({ { "choices", { { { "message", { { "role", "assistant" }, { "content", content } } } } } } });
+      if (!usage.is_null()) {
+	chat["usage"] = usage;
+      }
+      return chat;
+    }
+
+
     std::string _key;
-    std::list<json> _messages;
+    std::list<ai::message> _messages;
+    std::string _request;
+    size_t _requested = 0;
+    size_t _tail = 0; // the length of what follows the messages in _request
+    bool _usage = false; // whether _request asks for usage (see rejectsStreamOptions)
     std::string _model;
     std::string _result;
-    OpenAI _ai;
     const unsigned int _maxRetries;
     const std::string _apiKey;
     const std::string _keyName;
     const bool _debug;
     stats _stats;
     std::function<bool(const json&)> _validator = [](const json&){ return true; };
+    std::function<void(const std::string&, const json&)> _on_field;
   };
 
 }
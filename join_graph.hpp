@@ -0,0 +1,97 @@
+#ifndef JOIN_GRAPH_HPP_
+#define JOIN_GRAPH_HPP_
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "schema.hpp"
+
+/*
+
+  The join graph: tables are its nodes and foreign keys (see
+  SchemaSnapshot::foreign_keys and SchemaSnapshot::joins) its edges. It
+  tells the model how to join the tables a question mentions.
+
+  Example usage:
+
+  auto keys = joinPaths(schema, { "Artist", "Track" });
+  // the keys Album.ArtistId -> Artist.ArtistId and Track.AlbumId -> Album.AlbumId
+  std::set<std::string> tables;
+  addJoinedTables(schema, keys, tables); // Album, Artist, Track
+
+ */
+
+// The foreign keys (indexes into schema.foreign_keys) along the shortest
+// join paths connecting the given tables, grown one table at a time from
+// the first: each step adds the shortest path from the tables connected so
+// far to the nearest one not yet connected. Tables with no path to those
+// start a separate group (e.g., for another attached database).
+inline std::vector<size_t> joinPaths(const SchemaSnapshot& schema, const std::set<std::string>& tables) {
+  std::vector<size_t> keys;
+  std::set<size_t> remaining;
+  for (auto& name : tables) {
+    if (auto table = schema.find(name)) {
+      remaining.insert(table - schema.tables.data());
+    }
+  }
+  if (remaining.size() < 2) {
+    return keys;
+  }
+  std::vector<bool> connected(schema.tables.size(), false);
+  connected[*remaining.begin()] = true;
+  remaining.erase(remaining.begin());
+  while (!remaining.empty()) {
+    // Breadth-first from everything connected so far; via[t] is the key we reached t by.
+    std::vector<long> via(schema.tables.size(), -1);
+    std::vector<size_t> frontier;
+    for (size_t t = 0; t < connected.size(); t++) {
+      if (connected[t]) {
+	frontier.push_back(t);
+      }
+    }
+    long reached = -1;
+    for (size_t next = 0; reached < 0 && next < frontier.size(); next++) {
+      auto t = frontier[next];
+      for (auto k : schema.joins[t]) {
+	auto& key = schema.foreign_keys[k];
+	auto other = (key.table == t) ? key.parent : key.table;
+	if (connected[other] || via[other] >= 0) {
+	  continue;
+	}
+	via[other] = k;
+	frontier.push_back(other);
+	if (remaining.count(other)) {
+	  reached = other;
+	  break;
+	}
+      }
+    }
+    if (reached < 0) {
+      // None of the rest are linked to these; start again from the next one.
+      connected[*remaining.begin()] = true;
+      remaining.erase(remaining.begin());
+      continue;
+    }
+    remaining.erase(reached);
+    for (size_t t = reached; !connected[t]; ) {
+      connected[t] = true;
+      auto& key = schema.foreign_keys[via[t]];
+      keys.push_back(via[t]);
+      t = (key.table == t) ? key.parent : key.table;
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+// Adds the tables at either end of each of the foreign keys to tables.
+inline void addJoinedTables(const SchemaSnapshot& schema, const std::vector<size_t>& keys, std::set<std::string>& tables) {
+  for (auto k : keys) {
+    tables.insert(schema.tables[schema.foreign_keys[k].table].name);
+    tables.insert(schema.tables[schema.foreign_keys[k].parent].name);
+  }
+}
+
+#endif
@@ -34,8 +34,12 @@
 #include <vector>
 #include <sstream>
 #include <mutex>
+#include <condition_variable>
 #include <cstdlib>
 #include <map>
+#include <memory>
+#include <future>
+#include <thread>
 
 #ifndef CURL_STATICLIB
 #include <curl/curl.h>
@@ -45,6 +49,18 @@
 
 #include "json.hpp"  // nlohmann/json
 
+// Limits on each request, in seconds: to connect, to go without receiving
+// anything (a stalled server), and in all (a server that trickles).
+#ifndef OPENAI_CONNECT_TIMEOUT
+#define OPENAI_CONNECT_TIMEOUT 10
+#endif
+#ifndef OPENAI_STALL_TIMEOUT
+#define OPENAI_STALL_TIMEOUT 60
+#endif
+#ifndef OPENAI_TIMEOUT
+#define OPENAI_TIMEOUT 600
+#endif
+
 namespace openai {
 
 namespace _detail {
@@ -58,23 +74,255 @@ struct Response {
     std::string error_message;
 };
 
+// Process-wide curl state: curl_global_init, done once, and a share handle
+// through which every Session (and handle) shares its DNS cache, TLS
+// sessions, and connection pool, so that connections stay open and are
+// reused across requests, Sessions, and threads.
+class Connections {
+public:
+    static Connections& instance() {
+        // Never destroyed, as other static objects may still be using it at exit.
+        static Connections* connections = new Connections;
+        return *connections;
+    }
+
+    // Prepares an easy handle to use the shared caches.
+    void attach(CURL* curl) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, share_);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    }
+
+    // Connects to url in the background (with a HEAD request), so that the
+    // first real request finds the TCP and TLS handshakes already done.
+    void preconnect(const std::string& url, const std::string& proxy = "") {
+        std::thread([this, url, proxy]() {
+            auto curl = curl_easy_init();
+            if (curl) {
+                attach(curl);
+                if (!proxy.empty()) {
+                    curl_easy_setopt(curl, CURLOPT_PROXY, proxy.c_str());
+                }
+                curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+                curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+                curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, static_cast<long>(OPENAI_CONNECT_TIMEOUT));
+                curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+                curl_easy_perform(curl);
+                curl_easy_cleanup(curl);
+            }
+        }).detach();
+    }
+
+private:
+    Connections() {
+        curl_global_init(CURL_GLOBAL_ALL);
+        share_ = curl_share_init();
+        curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, lock);
+        curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, unlock);
+        curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+
+    static void lock(CURL*, curl_lock_data data, curl_lock_access, void* self) {
+        static_cast<Connections*>(self)->mutexes_[data].lock();
+    }
+
+    static void unlock(CURL*, curl_lock_data data, void* self) {
+        static_cast<Connections*>(self)->mutexes_[data].unlock();
+    }
+
+    CURLSH*     share_;
+    std::mutex  mutexes_[CURL_LOCK_DATA_LAST];
+};
+
+// The body of a response as it arrives, for reading (e.g. server-sent
+// events) while the rest of it is still on its way.
+class BodyStream {
+public:
+    // Waits for more of the body and moves it into part; returns false once
+    // all of it has been read.
+    bool next(std::string& part) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this]() { return !pending_.empty() || closed_; });
+        part.clear();
+        part.swap(pending_);
+        return !part.empty();
+    }
+
+private:
+    friend class Engine;
+
+    void push(const char* data, size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.append(data, size);
+        }
+        ready_.notify_one();
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        ready_.notify_one();
+    }
+
+    std::mutex              mutex_;
+    std::condition_variable ready_;
+    std::string             pending_;
+    bool                    closed_ = false;
+};
+
+// Runs requests asynchronously: every one in the process goes through a
+// single curl multi handle, driven by one event loop thread, rather than
+// through a blocking curl_easy_perform on each Session. Any number can be
+// in flight at once (connections still come from the shared pool);
+// submit returns a future for the response.
+class Engine {
+public:
+    static Engine& instance() {
+        // Never destroyed, as requests may still be in flight at exit.
+        static Engine* engine = new Engine;
+        return *engine;
+    }
+
+    // Starts a POST of body to url, through proxy unless it is empty; body
+    // must stay alive until the response arrives. If given a stream, the
+    // body of the response is also passed to it as it arrives (and it is
+    // closed once the future is ready).
+    std::future<Response> submit(const std::string& url, const std::string& body, const std::vector<std::string>& headers, const std::string& proxy = "", std::shared_ptr<BodyStream> stream = nullptr) {
+        auto transfer = new Transfer;
+        transfer->curl = curl_easy_init();
+        transfer->stream = std::move(stream);
+        auto future = transfer->promise.get_future();
+        if (!transfer->curl) {
+            transfer->promise.set_value({ "", true, "OpenAI curl_easy_init() failed" });
+            if (transfer->stream) {
+                transfer->stream->close();
+            }
+            delete transfer;
+            return future;
+        }
+        Connections::instance().attach(transfer->curl);
+        for (auto& header : headers) {
+            transfer->headers = curl_slist_append(transfer->headers, header.c_str());
+        }
+        if (!proxy.empty()) {
+            curl_easy_setopt(transfer->curl, CURLOPT_PROXY, proxy.c_str());
+        }
+        curl_easy_setopt(transfer->curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, transfer->headers);
+        curl_easy_setopt(transfer->curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(body.size()));
+        curl_easy_setopt(transfer->curl, CURLOPT_POSTFIELDS, body.data());
+        curl_easy_setopt(transfer->curl, CURLOPT_WRITEFUNCTION, writeFunction);
+        curl_easy_setopt(transfer->curl, CURLOPT_WRITEDATA, transfer);
+        curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, transfer);
+        // A transfer that hangs would otherwise leave its future waiting forever.
+        curl_easy_setopt(transfer->curl, CURLOPT_CONNECTTIMEOUT, static_cast<long>(OPENAI_CONNECT_TIMEOUT));
+        curl_easy_setopt(transfer->curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(transfer->curl, CURLOPT_LOW_SPEED_TIME, static_cast<long>(OPENAI_STALL_TIMEOUT));
+        curl_easy_setopt(transfer->curl, CURLOPT_TIMEOUT, static_cast<long>(OPENAI_TIMEOUT));
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(transfer);
+        }
+        curl_multi_wakeup(multi_);
+        return future;
+    }
+
+private:
+    struct Transfer {
+        CURL*                   curl = nullptr;
+        curl_slist*             headers = nullptr;
+        std::string             response;
+        std::promise<Response>  promise;
+        std::shared_ptr<BodyStream> stream;
+    };
+
+    Engine() {
+        Connections::instance();
+        multi_ = curl_multi_init();
+        std::thread([this]() { run(); }).detach();
+    }
+
+    void run() {
+        while (true) {
+            std::vector<Transfer*> added;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                added.swap(pending_);
+            }
+            for (auto transfer : added) {
+                curl_multi_add_handle(multi_, transfer->curl);
+            }
+            int running = 0;
+            curl_multi_perform(multi_, &running);
+            int queued = 0;
+            while (auto message = curl_multi_info_read(multi_, &queued)) {
+                if (message->msg == CURLMSG_DONE) {
+                    finish(message->easy_handle, message->data.result);
+                }
+            }
+            // Until there is activity on a transfer, one of curl's timers
+            // (such as for a timeout) is due, or submit wakes us.
+            long timeout = -1;
+            curl_multi_timeout(multi_, &timeout);
+            if (timeout < 0 || timeout > 1000) {
+                timeout = 1000;
+            }
+            curl_multi_poll(multi_, nullptr, 0, static_cast<int>(timeout), nullptr);
+        }
+    }
+
+    void finish(CURL* curl, CURLcode result) {
+        Transfer* transfer = nullptr;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &transfer);
+        curl_multi_remove_handle(multi_, curl);
+        curl_easy_cleanup(curl);
+        curl_slist_free_all(transfer->headers);
+        if (result != CURLE_OK) {
+            transfer->promise.set_value({ "", true, "OpenAI curl_easy_perform() failed: " + std::string{curl_easy_strerror(result)} });
+        } else {
+            transfer->promise.set_value({ std::move(transfer->response), false, "" });
+        }
+        if (transfer->stream) {
+            transfer->stream->close();
+        }
+        delete transfer;
+    }
+
+    static size_t writeFunction(void* ptr, size_t size, size_t nmemb, Transfer* transfer) {
+        transfer->response.append((char*) ptr, size * nmemb);
+        if (transfer->stream) {
+            transfer->stream->push((char*) ptr, size * nmemb);
+        }
+        return size * nmemb;
+    }
+
+    CURLM*                  multi_;
+    std::mutex              mutex_;
+    std::vector<Transfer*>  pending_;
+};
+
 // Simple curl Session inspired by CPR
 class Session {
 public:
     Session(bool throw_exception) : throw_exception_{throw_exception} {
-        curl_global_init(CURL_GLOBAL_ALL);
         curl_ = curl_easy_init();
+        Connections::instance().attach(curl_);
     }
 
     Session(bool throw_exception, std::string proxy_url) : throw_exception_{ throw_exception } {
-        curl_global_init(CURL_GLOBAL_ALL);
         curl_ = curl_easy_init();
+        Connections::instance().attach(curl_);
         setProxyUrl(proxy_url);
     }
 
     ~Session() { 
         curl_easy_cleanup(curl_); 
-        curl_global_cleanup();
         if (mime_form_ != nullptr) {
             curl_mime_free(mime_form_);
         }
@@ -94,6 +342,8 @@ public:
         }
     }
 
+    const std::string& proxyUrl() const { return proxy_url_; }
+
     void setBody(const std::string& data);
     void setMultiformPart(const std::string& filepath, const std::map<std::string, std::string>& fields);
     
@@ -201,6 +451,8 @@ inline Response Session::makeRequest(const std::string& contentType) {
     curl_easy_setopt(curl_, CURLOPT_HEADERDATA, &header_string);
 
     res_ = curl_easy_perform(curl_);
+    curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, nullptr);
+    curl_slist_free_all(headers);
 
     bool is_error = false;
     std::string error_msg{};
@@ -384,26 +636,35 @@ public:
     void setMultiformPart(const std::string& filepath, const std::map<std::string, std::string>& fields) { session_.setMultiformPart(filepath, fields); }
 
     Json post(const std::string& suffix, const std::string& data, const std::string& contentType) {
-        setParameters(suffix, data, contentType);
-        auto response = session_.postPrepare(contentType);
-        if (response.is_error){ 
-            trigger_error(response.error_message);
+        if (contentType != "multipart/form-data") {
+            return postAsync(suffix, data, contentType).get();
         }
+        setParameters(suffix, data, contentType);
+        return parse(session_.postPrepare(contentType));
+    }
 
-        Json json{};
-        if (isJson(response.text)){
-
-            json = Json::parse(response.text); 
-            checkResponse(json);
+    // Sends a POST without waiting for it: the returned future parses the
+    // response (throwing on errors, as post does) when it is asked for it.
+    // Requests from any thread run concurrently, on Engine's event loop.
+    // data must stay alive until then. A stream, if given, receives the
+    // body of the response as it arrives; a body that isn't JSON (such as
+    // server-sent events) then parses as an empty Json.
+    std::future<Json> postAsync(const std::string& suffix, const std::string& data, const std::string& contentType = "application/json", std::shared_ptr<BodyStream> stream = nullptr) {
+        #if OPENAI_VERBOSE_OUTPUT
+            std::cout << "<< request: "<< base_url + suffix << "  " << data << '\n';
+        #endif
+        std::vector<std::string> headers;
+        if (!contentType.empty()) {
+            headers.push_back("Content-Type: " + contentType);
         }
-        else{
-          #if OPENAI_VERBOSE_OUTPUT
-            std::cerr << "Response is not a valid JSON";
-            std::cout << "<< " << response.text << "\n";
-          #endif
+        headers.push_back("Authorization: Bearer " + token_);
+        if (!organization_.empty()) {
+            headers.push_back("OpenAI-Organization: " + organization_);
         }
-       
-        return json;
+        auto response = Engine::instance().submit(base_url + suffix, data, headers, session_.proxyUrl(), std::move(stream));
+        return std::async(std::launch::deferred, [this, response = std::move(response)]() mutable {
+            return parse(response.get());
+        });
     }
 
     Json get(const std::string& suffix, const std::string& data = "") {
@@ -456,6 +717,11 @@ public:
         base_url = url;
     }
 
+    // Opens a connection to the API in the background, ready for the first request.
+    void preconnect() {
+        Connections::instance().preconnect(base_url, session_.proxyUrl());
+    }
+
     std::string getBaseUrl() const {
         return base_url;
     }
@@ -476,6 +742,22 @@ private:
         #endif
     }
 
+    Json parse(const Response& response) {
+        if (response.is_error) {
+            trigger_error(response.error_message);
+        }
+        auto json = Json::parse(response.text, nullptr, false);
+        if (json.is_discarded()) {
+          #if OPENAI_VERBOSE_OUTPUT
+            std::cerr << "Response is not a valid JSON";
+            std::cout << "<< " << response.text << "\n";
+          #endif
+            return Json{};
+        }
+        checkResponse(json);
+        return json;
+    }
+
     void checkResponse(const Json& json) {
         if (json.count("error")) {
             auto reason = json["error"].dump();
@@ -728,6 +1010,7 @@ inline Json CategoryModeration::create(Json input) {
 // Public interface
 
 using _detail::OpenAI;
+using _detail::BodyStream;
 
 // instance
 using _detail::start;
@@ -0,0 +1,273 @@
+#ifndef PROFILE_HPP_
+#define PROFILE_HPP_
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "json.hpp"
+
+/*
+
+  Column profiles: what we learn about a column from the values we read,
+  summarized as the JSON that is cached and shown to the model.
+
+  Example usage:
+
+  ColumnProfile profile;
+  profile.addText("Rock", 4, 4, 5);
+  profile.addNumber(std::hash<sqlite3_int64>{}(42));
+  profile.addNull();
+  auto summary = profile.summary(); // { "kind": "text", "null_ratio": 0.33, "samples": ["Rock"], ... }
+
+ */
+
+using json = nlohmann::json;
+
+// True if text is entirely an integer or decimal literal (surrounding blanks allowed).
+inline bool looksNumeric(const char* p, size_t n) {
+  while (n > 0 && std::isspace(static_cast<unsigned char>(*p))) {
+    p++;
+    n--;
+  }
+  while (n > 0 && std::isspace(static_cast<unsigned char>(p[n - 1]))) {
+    n--;
+  }
+  if (n == 0) {
+    return false;
+  }
+  // Most numbers are integers; from_chars handles those without allocating or throwing.
+  long long value;
+  auto [end, ec] = std::from_chars(p, p + n, value);
+  if (ec == std::errc() && end == p + n) {
+    return true;
+  }
+  // Otherwise, scan for [+-]digits[.digits][e[+-]digits].
+  size_t i = 0;
+  size_t digits = 0;
+  auto skipDigits = [&]() {
+    size_t start = i;
+    while (i < n && std::isdigit(static_cast<unsigned char>(p[i]))) {
+      i++;
+    }
+    return i - start;
+  };
+  if (p[i] == '+' || p[i] == '-') {
+    i++;
+  }
+  digits += skipDigits();
+  if (i < n && p[i] == '.') {
+    i++;
+    digits += skipDigits();
+  }
+  if (digits == 0) {
+    return false;
+  }
+  if (i < n && (p[i] == 'e' || p[i] == 'E')) {
+    i++;
+    if (i < n && (p[i] == '+' || p[i] == '-')) {
+      i++;
+    }
+    if (skipDigits() == 0) {
+      return false;
+    }
+  }
+  return i == n;
+}
+
+// True if text starts with an ISO-8601-style date (YYYY-MM-DD or YYYY/MM/DD) or a time (HH:MM).
+inline bool looksLikeDate(const char* p, size_t n) {
+  auto digits = [&](size_t from, size_t count) {
+    for (size_t i = from; i < from + count; i++) {
+      if (i >= n || !std::isdigit(static_cast<unsigned char>(p[i]))) {
+	return false;
+      }
+    }
+    return true;
+  };
+  if (digits(0, 4) && n >= 10 && (p[4] == '-' || p[4] == '/') && p[7] == p[4] && digits(5, 2) && digits(8, 2)) {
+    return n == 10 || p[10] == ' ' || p[10] == 'T';
+  }
+  return digits(0, 2) && n >= 5 && p[2] == ':' && digits(3, 2);
+}
+
+// Shortens text to at most max_chars UTF-8 characters.
+inline std::string truncateUTF8(const char* p, size_t n, size_t max_chars) {
+  size_t chars = 0;
+  size_t i = 0;
+  for (; i < n; i++) {
+    // Count lead bytes only; continuation bytes look like 10xxxxxx.
+    if ((static_cast<unsigned char>(p[i]) & 0xC0) != 0x80 && chars++ == max_chars) {
+      break;
+    }
+  }
+  return std::string(p, i);
+}
+
+// A HyperLogLog sketch (Flajolet et al.), for estimating how many distinct
+// values a column has from a single pass in 4KB of memory.
+class HyperLogLog {
+public:
+  void add(uint64_t hash) {
+    // Our hashes (std::hash) may be the identity, so mix the bits first (splitmix64's finalizer).
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    auto index = hash >> (64 - precision);
+    // Leading zeros in the remaining bits, plus one; the sentinel bit bounds it.
+    uint8_t rank = 1;
+    for (auto rest = (hash << precision) | (1ULL << (precision - 1)); !(rest & (1ULL << 63)); rest <<= 1) {
+      rank++;
+    }
+    _registers[index] = std::max(_registers[index], rank);
+  }
+
+  double estimate() const {
+    const double m = registers;
+    double sum = 0;
+    int zeros = 0;
+    for (auto r : _registers) {
+      sum += std::ldexp(1.0, -r);
+      zeros += (r == 0);
+    }
+    auto estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    // Small cardinalities: linear counting is more accurate.
+    if (estimate <= 2.5 * m && zeros > 0) {
+      estimate = m * std::log(m / zeros);
+    }
+    return estimate;
+  }
+
+private:
+  static constexpr int precision = 12;
+  static constexpr int registers = 1 << precision;
+  std::array<uint8_t, registers> _registers {};
+};
+
+// What we learn about one column from the rows we sample.
+struct ColumnProfile {
+  // Distinct values we keep track of; a column with fewer may be an enum.
+  static constexpr size_t maxDistinct = 64;
+
+  std::vector<std::string> samples; // distinct non-numeric values, truncated
+  unsigned int rows = 0;
+  unsigned int nulls = 0;
+  unsigned int numbers = 0;
+  unsigned int dates = 0;
+  size_t text_values = 0;
+  size_t text_bytes = 0;
+  std::vector<size_t> distinct; // hashes of distinct values seen (capped)
+  bool cut_short = false;       // sampling ran out of budget before this column was complete
+  // Read from an index instead of sampled: the range of a numeric or date
+  // column, or every value of a column with only a few.
+  json min, max;
+  json enum_values;
+  bool from_index = false;
+  // Estimated distinct values among the distinct_counted non-null values
+  // read (see estimateDistinct); a lower bound if we didn't read them all.
+  sqlite3_int64 distinct_estimate = -1;
+  size_t distinct_counted = 0;
+  bool distinct_lower_bound = false;
+
+  void addNull() {
+    rows++;
+    nulls++;
+  }
+
+  void addNumber(size_t hash) {
+    rows++;
+    numbers++;
+    noteDistinct(hash);
+  }
+
+  void addBlob() {
+    rows++;
+  }
+
+  // Records a text value of total_bytes bytes, of which we have only read
+  // the first length; keeps at most N samples.
+  void addText(const char* data, size_t length, size_t total_bytes, size_t N) {
+    rows++;
+    text_values++;
+    text_bytes += total_bytes;
+    noteDistinct(std::hash<std::string_view>{}(std::string_view(data, length)) ^ total_bytes);
+    // Only show the model non-numeric data, and limit the size of what we include. This is a magic number.
+    if (length == total_bytes && looksNumeric(data, length)) {
+      numbers++;
+      return;
+    }
+    if (looksLikeDate(data, length)) {
+      dates++;
+    }
+    if (samples.size() < N) {
+      auto truncated_data = truncateUTF8(data, length, 10);
+      if (std::find(samples.begin(), samples.end(), truncated_data) == samples.end()) {
+	samples.push_back(std::move(truncated_data));
+      }
+    }
+  }
+
+  // Whether sampling further rows could still add anything: we have N
+  // samples, or N values that were all numbers (which we never show).
+  bool complete(size_t N) const {
+    return from_index || samples.size() >= N || (rows >= N && numbers + nulls == rows);
+  }
+
+  // A compact JSON description of the column, as cached and shown to the model.
+  json summary() const {
+    auto values = rows - nulls;
+    const char* kind = "text";
+    if (values > 0 && numbers * 10 >= values * 9) {
+      kind = "numeric";
+    } else if (values > 0 && dates * 10 >= values * 9) {
+      kind = "date";
+    }
+    json j = {
+      { "kind", kind },
+      { "null_ratio", rows ? std::round(100.0 * nulls / rows) / 100 : 0.0 },
+      { "avg_length", text_values ? std::round(10.0 * text_bytes / text_values) / 10 : 0.0 },
+      // Many repeats among the values we saw: probably a small set of categories.
+      { "enum", values >= 6 && distinct.size() < maxDistinct && distinct.size() * 3 <= values }
+    };
+    if (!samples.empty()) {
+      j["samples"] = samples;
+    }
+    if (distinct_estimate >= 0) {
+      j["distinct"] = distinct_estimate;
+      if (distinct_lower_bound) {
+	j["distinct_lower_bound"] = true;
+      }
+      // Far more values than we sample, so a better guess than repeats among samples.
+      j["enum"] = distinct_estimate < static_cast<sqlite3_int64>(maxDistinct) && static_cast<size_t>(distinct_estimate) * 3 <= distinct_counted;
+    }
+    if (!enum_values.is_null()) {
+      j["values"] = enum_values;
+      j["enum"] = true;
+    }
+    if (!min.is_null()) {
+      j["min"] = min;
+      j["max"] = max;
+    }
+    if (cut_short) {
+      j["cut_short"] = true;
+    }
+    return j;
+  }
+
+private:
+  void noteDistinct(size_t hash) {
+    if (distinct.size() < maxDistinct && std::find(distinct.begin(), distinct.end(), hash) == distinct.end()) {
+      distinct.push_back(hash);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef PROMPT_HPP_
+#define PROMPT_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/compile.h>
+#include <fmt/format.h>
+
+#include "json.hpp"
+
+/*
+
+  A prompt is a rope: a list of pieces of text, each either copied into an
+  arena the prompt owns or referring to text that outlives it (such as a
+  cached schema). Appending never moves what is already there, and the
+  whole prompt is written once, escaped, straight into the body of a
+  request, rather than being concatenated into a string, copied into a
+  json value, and dumped again for every retry.
+
+  Example usage:
+
+  auto p = std::make_shared<ai::prompt>();
+  p->format(FMT_COMPILE("Answer this question: '{}'.\n"), question);
+  p->append_ref(schema_text);  // not copied; must outlive p (see keep)
+  p->keep(schema_owner);       // ...so keep its owner alive with p
+  std::list<ai::message> messages { ai::message("user", p) };
+  auto body = ai::chatRequest("gpt-4", messages);
+
+ */
+
+namespace ai {
+
+  // A bump allocator: hands out memory from large blocks, all freed at once.
+  class arena {
+  public:
+    explicit arena(size_t block_size = 64 * 1024)
+      : _block_size (block_size)
+    {
+    }
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+    arena(arena&&) = default;
+    arena& operator=(arena&&) = default;
+
+    char* allocate(size_t n) {
+      if (n > _available) {
+	if (n > _block_size / 4) {
+	  // Too big to share a block; give it its own, keeping the current one.
+	  _blocks.emplace_back(new char[n]);
+	  return _blocks.back().get();
+	}
+	_blocks.emplace_back(new char[_block_size]);
+	_next = _blocks.back().get();
+	_available = _block_size;
+      }
+      auto p = _next;
+      _next += n;
+      _available -= n;
+      return p;
+    }
+
+  private:
+    std::vector<std::unique_ptr<char[]>> _blocks;
+    char* _next = nullptr;
+    size_t _available = 0;
+    size_t _block_size;
+  };
+
+  class prompt {
+  public:
+    prompt() = default;
+    prompt(const prompt&) = delete;
+    prompt& operator=(const prompt&) = delete;
+    prompt(prompt&&) = default;
+    prompt& operator=(prompt&&) = default;
+
+    // Appends a copy of text.
+    prompt& append(std::string_view text) {
+      if (!text.empty()) {
+	auto p = _arena.allocate(text.size());
+	std::memcpy(p, text.data(), text.size());
+	push(p, text.size());
+      }
+      return *this;
+    }
+
+    // Appends text without copying it; it must outlive the prompt.
+    prompt& append_ref(std::string_view text) {
+      if (!text.empty()) {
+	_pieces.push_back(text);
+	_size += text.size();
+	_last_owned = false;
+      }
+      return *this;
+    }
+
+    // Appends formatted text, formatting it directly into the arena (use
+    // FMT_COMPILE format strings to skip parsing them at run time).
+    template <typename S, typename... Args>
+    prompt& format(const S& format_string, const Args&... args) {
+      auto n = fmt::formatted_size(format_string, args...);
+      if (n > 0) {
+	auto p = _arena.allocate(n);
+	fmt::format_to(p, format_string, args...);
+	push(p, n);
+      }
+      return *this;
+    }
+
+    // Keeps owner (e.g., whatever holds text given to append_ref) alive as long as the prompt.
+    void keep(std::shared_ptr<const void> owner) {
+      _owners.push_back(std::move(owner));
+    }
+
+    size_t size() const {
+      return _size;
+    }
+
+    bool empty() const {
+      return _size == 0;
+    }
+
+    // Calls f(piece) for each piece, in order.
+    template <class F>
+    void for_each(F&& f) const {
+      for (auto piece : _pieces) {
+	f(piece);
+      }
+    }
+
+    std::string str() const {
+      std::string text;
+      text.reserve(_size);
+      for (auto piece : _pieces) {
+	text.append(piece.data(), piece.size());
+      }
+      return text;
+    }
+
+    // Appends the prompt to out as a JSON string, replacing invalid UTF-8
+    // with U+FFFD, as json::error_handler_t::replace does. Pieces always
+    // break between characters, so each is escaped on its own.
+    void write_json(std::string& out) const {
+      out += '"';
+      for (auto piece : _pieces) {
+	escape(piece, out);
+      }
+      out += '"';
+    }
+
+  private:
+    // Adds a piece from the arena, merging it into the last one if it directly follows it.
+    void push(const char* p, size_t n) {
+      if (_last_owned && _pieces.back().data() + _pieces.back().size() == p) {
+	_pieces.back() = std::string_view(_pieces.back().data(), _pieces.back().size() + n);
+      } else {
+	_pieces.emplace_back(p, n);
+      }
+      _size += n;
+      _last_owned = true;
+    }
+
+    static void escape(std::string_view text, std::string& out) {
+      static const char hex[] = "0123456789abcdef";
+      size_t run = 0; // the start of the bytes not yet written, which need no escaping
+      for (size_t i = 0; i < text.size(); ) {
+	unsigned char c = text[i];
+	size_t length = 1;
+	const char* replacement = nullptr;
+	char control[] = "\\u00XX";
+	switch (c) {
+	case '"': replacement = "\\\""; break;
+	case '\\': replacement = "\\\\"; break;
+	case '\n': replacement = "\\n"; break;
+	case '\r': replacement = "\\r"; break;
+	case '\t': replacement = "\\t"; break;
+	case '\b': replacement = "\\b"; break;
+	case '\f': replacement = "\\f"; break;
+	default:
+	  if (c < 0x20) {
+	    control[4] = hex[c >> 4];
+	    control[5] = hex[c & 0xf];
+	    replacement = control;
+	  } else if (c >= 0x80 && !utf8_sequence(text, i, length)) {
+	    replacement = "\xef\xbf\xbd";
+	  }
+	}
+	if (replacement) {
+	  out.append(text.data() + run, i - run);
+	  out += replacement;
+	  run = i + length;
+	}
+	i += length;
+      }
+      out.append(text.data() + run, text.size() - run);
+    }
+
+    // Whether a well-formed UTF-8 sequence starts at text[i]; sets length
+    // to its length or, if it isn't one, to that of its longest valid
+    // prefix (at least 1), which is replaced as a whole.
+    static bool utf8_sequence(std::string_view text, size_t i, size_t& length) {
+      unsigned char c = text[i];
+      length = 1;
+      if (c < 0xc2 || c > 0xf4) {
+	return false;
+      }
+      size_t expected = (c >= 0xf0) ? 4 : (c >= 0xe0) ? 3 : 2;
+      // The second byte's range excludes overlong forms, surrogates, and code points past U+10FFFF.
+      unsigned char low = (c == 0xe0) ? 0xa0 : (c == 0xf0) ? 0x90 : 0x80;
+      unsigned char high = (c == 0xed) ? 0x9f : (c == 0xf4) ? 0x8f : 0xbf;
+      for (; length < expected; length++) {
+	if (i + length == text.size()) {
+	  return false;
+	}
+	unsigned char b = text[i + length];
+	if (b < (length == 1 ? low : 0x80) || b > (length == 1 ? high : 0xbf)) {
+	  return false;
+	}
+      }
+      return true;
+    }
+
+    arena _arena;
+    std::vector<std::string_view> _pieces;
+    std::vector<std::shared_ptr<const void>> _owners;
+    size_t _size = 0;
+    bool _last_owned = false;
+  };
+
+  // A chat message: either any json message, or one whose content is a
+  // prompt (the json then holds the other fields, such as the role).
+  struct message {
+    message(nlohmann::json js)
+      : js (std::move(js))
+    {
+    }
+
+    message(const std::string& role, std::shared_ptr<const prompt> content)
+      : js ({ { "role", role } }),
+	content (std::move(content))
+    {
+    }
+
+    nlohmann::json js;
+    std::shared_ptr<const prompt> content;
+  };
+
+  // Appends a chat message to the body of a request.
+  inline void writeMessage(std::string& body, const message& m) {
+    auto fields = m.js.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+    if (!m.content) {
+      body += fields;
+      return;
+    }
+    // Room for some escaping.
+    body.reserve(body.size() + fields.size() + m.content->size() + m.content->size() / 16 + 16);
+    // Splice "content" in before the closing brace.
+    fields.pop_back();
+    body += fields;
+    body += (fields.size() > 1) ? ",\"content\":" : "\"content\":";
+    m.content->write_json(body);
+    body += '}';
+  }
+
+  // The body of a chat completion request, written into a single buffer.
+  inline std::string chatRequest(const std::string& model, const std::list<message>& messages) {
+    std::string body;
+    body += "{\"model\":";
+    body += nlohmann::json(model).dump();
+    body += ",\"messages\":[";
+    bool first = true;
+    for (auto& m : messages) {
+      if (!first) {
+	body += ',';
+      }
+      first = false;
+      writeMessage(body, m);
+    }
+    body += "]}";
+    return body;
+  }
+
+}
+
+#endif
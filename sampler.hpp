@@ -0,0 +1,772 @@
+#ifndef SAMPLER_HPP_
+#define SAMPLER_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include <fmt/format.h>
+
+#include "json.hpp"
+#include "profile.hpp"
+#include "schema.hpp"
+
+/*
+
+  Column sampling: profiles a table's columns from a bounded number of
+  rows, index seeks, and ANALYZE's statistics, within a time budget.
+
+  Example usage:
+
+  SamplingBudget budget(std::chrono::steady_clock::now() + std::chrono::seconds(1));
+  auto stats = readSQLiteStats(db, schema, 5);
+  auto& table = schema.tables[0];
+  auto found = stats.find(table.name);
+  auto stats_for_table = found != stats.end() ? &found->second : nullptr;
+  auto names = columnsToSample(table, stats_for_table);
+  std::vector<ColumnProfile> profiles;
+  bool complete = sampleTable(db, table, stats_for_table, names, 5, budget, profiles);
+
+  In a loadable extension, include this after SQLITE_EXTENSION_INIT1, so
+  that its calls go through the extension's API table.
+
+ */
+
+#if !defined(SAMPLE_PROBES_PER_VALUE)
+// Random rows read per requested sample value before we give up on a table.
+#define SAMPLE_PROBES_PER_VALUE 4
+#endif
+#if !defined(SAMPLE_BUDGET_STEPS_PER_COLUMN)
+// SQLite VM instructions each profiled column may cost while sampling its table.
+#define SAMPLE_BUDGET_STEPS_PER_COLUMN 100000
+#endif
+#if !defined(MAX_ENUM_VALUES)
+// Indexed columns with at most this many distinct values are listed in full.
+#define MAX_ENUM_VALUES 16
+#endif
+#if !defined(DISTINCT_ESTIMATE_ROWS)
+// Rows read to estimate the number of distinct values in each column (0 to disable).
+#define DISTINCT_ESTIMATE_ROWS 10000
+#endif
+#if !defined(USE_SQLITE_STATS)
+// Take samples and cardinalities from sqlite_stat1/sqlite_stat4 (written by ANALYZE) where available.
+#define USE_SQLITE_STATS 1
+#endif
+
+// Column samples and profiles for each table, tagged with the table's row
+// count and largest rowid when they were taken. A table is resampled after
+// anything is written to the database, or, for samples from an earlier
+// session, when that signature changes.
+struct SampleCache {
+  struct Entry {
+    // The table's row count and largest rowid when it was sampled: a
+    // signature that changes with inserts and deletes (though not updates).
+    sqlite3_int64 row_count = -1;
+    sqlite3_int64 max_rowid = -1;
+    json columns; // column name -> ColumnProfile::summary()
+    // Loaded from an earlier session, and not checked since. Entries made
+    // or checked in this one are current only until anything is written.
+    bool earlier_session = false;
+  };
+  std::map<std::string, Entry> tables;
+  // Tables whose sampling ran out of budget; they are sampled again next time.
+  std::set<std::string> partial;
+  // Tables left unchecked since the cache was last validated, because the
+  // question wasn't about them; they are checked before being trusted.
+  std::set<std::string> unverified;
+  // Tables relevant to the last question (see relevantTables).
+  std::set<std::string> relevant;
+  // How far the value index has got through each table (see updateValueIndex).
+  struct IndexedValues {
+    sqlite3_int64 next_rowid = std::numeric_limits<sqlite3_int64>::min(); // rows before it are indexed
+    sqlite3_int64 marker = -1; // rowid of the table's marker row in the index
+    bool done = false;
+    bool failed = false;       // writing to the index failed; retried once the table is resampled
+    bool stale = false;        // failed before the rows of an earlier pass were removed
+    bool resumed = false;      // seen holds what an earlier session indexed
+    std::map<std::string, std::unordered_set<size_t>> seen; // column -> hashes of its indexed values
+    std::set<std::string> too_many; // columns left out for having too many values
+  };
+  std::map<std::string, IndexedValues> values_indexed;
+  bool values_available = false;
+  // Columns ("table.column") cut short during the last translation.
+  std::vector<std::string> cut_short;
+  // Connections used to sample during the last translation.
+  size_t threads = 0;
+  bool loaded = false;
+  // Entries are known to be current as long as neither this connection
+  // (total_changes) nor any other one (data_version) has written anything.
+  bool validated = false;
+  sqlite3_int64 data_version = -1;
+  int total_changes = -1;
+  unsigned long hits = 0;
+  unsigned long misses = 0;
+};
+
+// Whether a column leads some index, so its range and distinct values can
+// be read with a few seeks. Partial indexes, and ones that order the column
+// by another collation, don't count: SQLite can't use them for that.
+inline bool isIndexed(const SchemaSnapshot::Table& table, const std::string& column) {
+  return std::any_of(table.index_columns.begin(), table.index_columns.end(), [&](auto& index) {
+    return !index.second.empty() && index.second[0] == column && !table.restricted_indexes.count(index.first);
+  });
+}
+
+// Declared numeric and BLOB columns have nothing to offer as text samples,
+// so we don't sample them, though an index lets us describe numeric ones
+// cheaply. Untyped columns may hold anything.
+inline bool shouldProfile(const SchemaSnapshot::Table& table, const SchemaSnapshot::Column& column) {
+  switch (column.affinity) {
+  case Affinity::INTEGER:
+  case Affinity::REAL:
+    return isIndexed(table, column.name);
+  case Affinity::BLOB:
+    return column.type.empty();
+  default:
+    return true;
+  }
+}
+
+// What ANALYZE recorded about a table's indexed columns: sqlite_stat1 holds
+// row counts and the average number of rows per distinct key prefix, and
+// sqlite_stat4 (only in SQLITE_ENABLE_STAT4 builds) holds sampled keys.
+struct TableStats {
+  struct Column {
+    sqlite3_int64 distinct = -1; // estimated number of distinct values
+    ColumnProfile profile;       // from sqlite_stat4 samples, if any
+  };
+  sqlite3_int64 row_count = -1;
+  std::map<std::string, Column> columns; // leading columns of analyzed indexes
+
+  // Whether stat4 samples stand in for sampling this column.
+  bool covers(const std::string& column) const {
+    auto it = columns.find(column);
+    return it != columns.end() && it->second.profile.rows > 0;
+  }
+};
+
+// Reads a SQLite varint (big-endian, seven bits per byte, nine bytes at most).
+inline size_t readVarint(const unsigned char* p, const unsigned char* end, sqlite3_uint64& value) {
+  value = 0;
+  for (size_t i = 0; i < 9 && p + i < end; i++) {
+    if (i == 8) {
+      value = (value << 8) | p[i];
+      return 9;
+    }
+    value = (value << 7) | (p[i] & 0x7f);
+    if (!(p[i] & 0x80)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Adds the first field of a record (the format of sqlite_stat4.sample) to a profile.
+inline void addRecordKey(const unsigned char* p, size_t n, ColumnProfile& profile, size_t N) {
+  auto end = p + n;
+  sqlite3_uint64 header_size, serial_type;
+  auto length = readVarint(p, end, header_size);
+  if (!length || header_size > n || !readVarint(p + length, p + header_size, serial_type)) {
+    return;
+  }
+  auto body = p + header_size;
+  if (serial_type == 0) {
+    profile.addNull();
+  } else if (serial_type <= 6) {
+    static const int widths[] = { 0, 1, 2, 3, 4, 6, 8 };
+    auto width = widths[serial_type];
+    if (body + width > end) {
+      return;
+    }
+    // Sign-extend from the first byte.
+    sqlite3_int64 value = static_cast<signed char>(body[0]);
+    for (int i = 1; i < width; i++) {
+      value = static_cast<sqlite3_int64>(static_cast<sqlite3_uint64>(value) << 8 | body[i]);
+    }
+    profile.addNumber(std::hash<sqlite3_int64>{}(value));
+  } else if (serial_type == 7) {
+    if (body + 8 > end) {
+      return;
+    }
+    sqlite3_uint64 bits = 0;
+    for (int i = 0; i < 8; i++) {
+      bits = (bits << 8) | body[i];
+    }
+    double value;
+    memcpy(&value, &bits, sizeof value);
+    profile.addNumber(std::hash<double>{}(value));
+  } else if (serial_type == 8 || serial_type == 9) {
+    profile.addNumber(std::hash<sqlite3_int64>{}(serial_type - 8));
+  } else if (serial_type >= 12 && serial_type % 2 == 0) {
+    profile.addBlob();
+  } else if (serial_type >= 13) {
+    auto bytes = (serial_type - 13) / 2;
+    if (bytes <= static_cast<size_t>(end - body)) {
+      profile.addText(reinterpret_cast<const char*>(body), bytes, bytes, N);
+    }
+  }
+}
+
+// Collects what sqlite_stat1 and sqlite_stat4 say about each table, for
+// the leading column of every analyzed index. These tables are small, so
+// this reads no table data at all. Returns nothing if the database has
+// never been analyzed.
+inline std::map<std::string, TableStats> readSQLiteStats(sqlite3* DB, const SchemaSnapshot& schema, size_t N) {
+  std::map<std::string, TableStats> stats;
+#if USE_SQLITE_STATS
+  // Each database has its own statistics tables.
+  std::vector<const SchemaSnapshot::Table*> stat1_tables, stat4_tables;
+  std::map<std::pair<std::string, std::string>, std::string> leading_columns; // (table, index) -> column
+  for (auto& table : schema.tables) {
+    if (table.base_name == "sqlite_stat1") {
+      stat1_tables.push_back(&table);
+    } else if (table.base_name == "sqlite_stat4") {
+      stat4_tables.push_back(&table);
+    }
+    for (auto& [index, columns] : table.index_columns) {
+      if (!columns.empty() && !columns[0].empty()) {
+	leading_columns[{ table.name, index }] = columns[0];
+      }
+    }
+  }
+
+  sqlite3_stmt* stmt;
+  for (auto stat1 : stat1_tables) {
+    auto stat1_query = fmt::format("SELECT tbl, idx, stat FROM {};", stat1->quoted());
+    sqlite3_prepare_v2(DB, stat1_query.c_str(), -1, &stmt, nullptr);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto tbl_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+      auto idx = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+      auto stat = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+      if (!tbl_name || !stat) {
+	continue;
+      }
+      auto tbl = qualifiedName(stat1->schema, tbl_name);
+      // "nrow avg1 avg2 ...", possibly followed by keywords like "unordered".
+      sqlite3_int64 nrow = -1, avg1 = -1;
+      auto end = stat + strlen(stat);
+      auto p = std::from_chars(stat, end, nrow).ptr;
+      if (p < end && *p == ' ') {
+	std::from_chars(p + 1, end, avg1);
+      }
+      auto& table = stats[tbl];
+      table.row_count = std::max(table.row_count, nrow);
+      auto leading = idx ? leading_columns.find({ tbl, idx }) : leading_columns.end();
+      if (leading != leading_columns.end() && nrow >= 0 && avg1 > 0) {
+	table.columns[leading->second].distinct = (nrow + avg1 - 1) / avg1;
+      }
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  for (auto stat4 : stat4_tables) {
+    auto stat4_query = fmt::format("SELECT tbl, idx, sample FROM {};", stat4->quoted());
+    sqlite3_prepare_v2(DB, stat4_query.c_str(), -1, &stmt, nullptr);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto tbl_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+      auto idx = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+      auto tbl = qualifiedName(stat4->schema, tbl_name ? tbl_name : "");
+      auto leading = (tbl_name && idx) ? leading_columns.find({ tbl, idx }) : leading_columns.end();
+      if (leading == leading_columns.end()) {
+	continue;
+      }
+      auto sample = static_cast<const unsigned char*>(sqlite3_column_blob(stmt, 2));
+      auto& profile = stats[tbl].columns[leading->second].profile;
+      // Several indexes may lead with the same column; one set of samples is enough.
+      if (sample && profile.rows < N * SAMPLE_PROBES_PER_VALUE) {
+	addRecordKey(sample, sqlite3_column_bytes(stmt, 2), profile, N);
+      }
+    }
+    sqlite3_finalize(stmt);
+  }
+#endif
+  return stats;
+}
+
+// Finds the smallest and largest rowid in a table with two index seeks.
+// Returns false for empty tables and for tables without a rowid.
+inline bool getRowidRange(sqlite3* DB, const std::string& table, sqlite3_int64& min_rowid, sqlite3_int64& max_rowid) {
+  auto range_query = fmt::format("SELECT (SELECT min(rowid) FROM {0}), (SELECT max(rowid) FROM {0});", table);
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(DB, range_query.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    // WITHOUT ROWID table.
+    sqlite3_finalize(stmt);
+    return false;
+  }
+  bool found = false;
+  if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+    min_rowid = sqlite3_column_int64(stmt, 0);
+    max_rowid = sqlite3_column_int64(stmt, 1);
+    found = true;
+  }
+  sqlite3_finalize(stmt);
+  return found;
+}
+
+// Bounds the time spent sampling. On connections of our own, SQLite calls
+// our progress handler every thousand VM instructions; once the per-table
+// step allowance or the overall deadline is exhausted, the handler
+// interrupts the running query and we keep whatever was sampled so far.
+//
+// The host's connection may have a progress handler of its own, which
+// SQLite has no way to chain to, so with own_connection false we leave it
+// alone: our queries are then bounded only by their LIMITs, and the loops
+// reading them check the deadline between rows (see stop).
+class SamplingBudget {
+public:
+  static constexpr int interval = 1000;
+
+  explicit SamplingBudget(std::chrono::steady_clock::time_point deadline, bool own_connection = true)
+    : _deadline (deadline),
+      _own_connection (own_connection)
+  {
+  }
+
+  bool expired() const {
+    return std::chrono::steady_clock::now() >= _deadline;
+  }
+
+  // Installs the handler for sampling one table with the given step allowance.
+  void begin(sqlite3* db, long long steps) {
+    _steps_left = steps;
+    _interrupted = false;
+    if (_own_connection) {
+      sqlite3_progress_handler(db, interval, progress, this);
+    }
+  }
+
+  // Removes the handler; returns true if it had to interrupt anything
+  // (or a SamplingWatchdog may have).
+  bool end(sqlite3* db) {
+    if (_own_connection) {
+      sqlite3_progress_handler(db, 0, nullptr, nullptr);
+      _interrupted = _interrupted || expired();
+    }
+    return _interrupted;
+  }
+
+  // Whether to stop reading rows: the handler has interrupted the query,
+  // or (without a handler) the deadline has passed.
+  bool stop() {
+    if (!_own_connection && !_interrupted && expired()) {
+      _interrupted = true;
+    }
+    return _interrupted;
+  }
+
+private:
+  static int progress(void* p) {
+    auto& budget = *static_cast<SamplingBudget*>(p);
+    budget._steps_left -= interval;
+    if (budget._steps_left < 0 || budget.expired()) {
+      budget._interrupted = true;
+    }
+    return budget._interrupted;
+  }
+
+  std::chrono::steady_clock::time_point _deadline;
+  bool _own_connection;
+  long long _steps_left = 0;
+  bool _interrupted = false;
+};
+
+// Interrupts connections that are still busy at a deadline. The progress
+// handler (see SamplingBudget) only runs between VDBE steps, and a single
+// step, such as counting the rows of a table, takes as long as the table
+// is large. Only for connections of our own: sqlite3_interrupt stops every
+// statement on a connection, including the host's.
+class SamplingWatchdog {
+public:
+  SamplingWatchdog(std::vector<sqlite3*> connections, std::chrono::steady_clock::time_point deadline)
+    : _connections (std::move(connections)),
+      _deadline (deadline),
+      _thread ([this]() {
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (!_wake.wait_until(lock, _deadline, [this]() { return _done; })) {
+	  for (auto connection : _connections) {
+	    sqlite3_interrupt(connection);
+	  }
+	}
+      })
+  {
+  }
+
+  // Call once the connections are idle again.
+  ~SamplingWatchdog() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _done = true;
+    }
+    _wake.notify_all();
+    _thread.join();
+  }
+
+private:
+  std::vector<sqlite3*> _connections;
+  std::chrono::steady_clock::time_point _deadline;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  bool _done = false;
+  std::thread _thread; // last, so that everything it uses exists first
+};
+
+// How much of each text value we read. Enough for a 10-character sample
+// (in any UTF-8) and to tell numbers and dates from text.
+const int samplePrefixBytes = 64;
+
+// Reads at most max_bytes from the start of a TEXT value with incremental
+// BLOB I/O, which only touches the pages holding those bytes; selecting the
+// column instead would pull in its entire overflow chain. Reuses blob for
+// successive rows of the same column. Returns the value's full length in
+// bytes, or -1 if it could not be read.
+inline int readTextPrefix(sqlite3* DB, sqlite3_blob*& blob, const SchemaSnapshot::Table& table, const std::string& column, sqlite3_int64 rowid, char* buffer, int max_bytes, int& length) {
+  if (blob && sqlite3_blob_reopen(blob, rowid) != SQLITE_OK) {
+    sqlite3_blob_close(blob);
+    blob = nullptr;
+  }
+  if (!blob && sqlite3_blob_open(DB, table.schema.c_str(), table.base_name.c_str(), column.c_str(), rowid, 0, &blob) != SQLITE_OK) {
+    blob = nullptr;
+    return -1;
+  }
+  auto total = sqlite3_blob_bytes(blob);
+  length = std::min(total, max_bytes);
+  if (sqlite3_blob_read(blob, buffer, length, 0) != SQLITE_OK) {
+    return -1;
+  }
+  return total;
+}
+
+// Converts a result column to JSON, or null if it is NULL, a BLOB, or
+// text too long to be worth showing.
+inline json valueToJSON(sqlite3_stmt* stmt, int i) {
+  switch (sqlite3_column_type(stmt, i)) {
+  case SQLITE_INTEGER:
+    return sqlite3_column_int64(stmt, i);
+  case SQLITE_FLOAT:
+    return sqlite3_column_double(stmt, i);
+  case SQLITE_TEXT:
+    if (sqlite3_column_bytes(stmt, i) <= samplePrefixBytes) {
+      return std::string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, i)), sqlite3_column_bytes(stmt, i));
+    }
+  }
+  return nullptr;
+}
+
+// Describes an indexed column with a handful of index seeks rather than
+// samples. If it has at most MAX_ENUM_VALUES distinct values, we list them
+// all by stepping through the index with "min(c) WHERE c > previous";
+// otherwise, if it holds numbers or dates, we read its range. Leaves the
+// profile untouched (to be sampled) if neither applies.
+inline void summarizeFromIndex(sqlite3* DB, const std::string& table, const std::string& column, sqlite3_int64 distinct_estimate, size_t N, ColumnProfile& profile) {
+  auto addValue = [&](const json& value) {
+    if (value.is_number()) {
+      profile.addNumber(std::hash<std::string>{}(value.dump()));
+    } else {
+      auto& text = value.get_ref<const std::string&>();
+      profile.addText(text.data(), text.size(), text.size(), N);
+    }
+  };
+
+  sqlite3_stmt* stmt;
+  json values = json::array();
+  bool listed = false;
+  if (distinct_estimate < 0 || distinct_estimate <= MAX_ENUM_VALUES) {
+    auto next_query = fmt::format("SELECT min({0}) FROM {1} WHERE {0} > ?;", column, table);
+    sqlite3_prepare_v2(DB, fmt::format("SELECT min({0}) FROM {1};", column, table).c_str(), -1, &stmt, nullptr);
+    while (values.size() <= MAX_ENUM_VALUES && sqlite3_step(stmt) == SQLITE_ROW) {
+      if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+	// Walked off the end of the index.
+	listed = true;
+	break;
+      }
+      auto value = valueToJSON(stmt, 0);
+      if (value.is_null()) {
+	break;
+      }
+      values.push_back(std::move(value));
+      // Bind the value itself, not a copy in some other type, so the comparison matches the index order.
+      auto previous = sqlite3_value_dup(sqlite3_column_value(stmt, 0));
+      sqlite3_finalize(stmt);
+      sqlite3_prepare_v2(DB, next_query.c_str(), -1, &stmt, nullptr);
+      sqlite3_bind_value(stmt, 1, previous);
+      sqlite3_value_free(previous);
+    }
+    sqlite3_finalize(stmt);
+  }
+  if (listed && !values.empty()) {
+    for (auto& value : values) {
+      addValue(value);
+    }
+    profile.enum_values = std::move(values);
+    profile.from_index = true;
+    return;
+  }
+
+  // Two seeks, one at each end of the index.
+  auto range_query = fmt::format("SELECT (SELECT min({0}) FROM {1}), (SELECT max({0}) FROM {1});", column, table);
+  sqlite3_prepare_v2(DB, range_query.c_str(), -1, &stmt, nullptr);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    auto min = valueToJSON(stmt, 0);
+    auto max = valueToJSON(stmt, 1);
+    auto isDate = [](const json& value) {
+      return value.is_string() && looksLikeDate(value.get_ref<const std::string&>().data(), value.get_ref<const std::string&>().size());
+    };
+    if ((min.is_number() && max.is_number()) || (isDate(min) && isDate(max))) {
+      addValue(min);
+      addValue(max);
+      profile.min = std::move(min);
+      profile.max = std::move(max);
+      profile.from_index = true;
+    }
+  }
+  sqlite3_finalize(stmt);
+}
+
+// The columns of a table we sample: those worth profiling that ANALYZE
+// hasn't already sampled for us.
+inline std::vector<std::string> columnsToSample(const SchemaSnapshot::Table& table, const TableStats* stats) {
+  std::vector<std::string> names;
+  for (auto& column : table.columns) {
+    if (shouldProfile(table, column) && !(stats && stats->covers(column.name))) {
+      names.push_back(column.name);
+    }
+  }
+  return names;
+}
+
+// Estimates how many distinct values each profiled column has, with a
+// HyperLogLog over its first DISTINCT_ESTIMATE_ROWS rows. Columns we
+// already know exactly (from an index) or whose values are long (and so
+// probably all distinct, and costly to read) are skipped. If the pass
+// stops before the end of the table, the estimates are lower bounds.
+inline void estimateDistinct(sqlite3* DB, const std::string& table, const TableStats* stats, const std::vector<std::string>& names, SamplingBudget& budget, std::vector<ColumnProfile>& profiles) {
+  std::vector<size_t> counted;
+  std::string column_list;
+  for (size_t i = 0; i < names.size(); i++) {
+    auto& profile = profiles[i];
+    bool known = !profile.enum_values.is_null()
+      || (stats && stats->columns.count(names[i]) && stats->columns.at(names[i]).distinct >= 0);
+    if (known || profile.rows == profile.nulls
+	|| (profile.text_values && profile.text_bytes > profile.text_values * samplePrefixBytes)) {
+      continue;
+    }
+    counted.push_back(i);
+    column_list += fmt::format("{}{}", column_list.empty() ? "" : ", ", quoteIdentifier(names[i]));
+  }
+  if (counted.empty()) {
+    return;
+  }
+
+  std::vector<HyperLogLog> sketches(counted.size());
+  std::vector<size_t> values(counted.size(), 0);
+  auto count_query = fmt::format("SELECT {} FROM {} LIMIT {};", column_list, table, DISTINCT_ESTIMATE_ROWS);
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(DB, count_query.c_str(), -1, &stmt, nullptr);
+  budget.begin(DB, static_cast<long long>(counted.size()) * SAMPLE_BUDGET_STEPS_PER_COLUMN);
+  int rows = 0, rc = SQLITE_ROW;
+  while (!budget.stop() && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    rows++;
+    for (size_t j = 0; j < counted.size(); j++) {
+      size_t hash;
+      switch (sqlite3_column_type(stmt, j)) {
+      case SQLITE_INTEGER:
+	hash = std::hash<sqlite3_int64>{}(sqlite3_column_int64(stmt, j));
+	break;
+      case SQLITE_FLOAT:
+	hash = std::hash<double>{}(sqlite3_column_double(stmt, j));
+	break;
+      case SQLITE_TEXT:
+	hash = std::hash<std::string_view>{}(std::string_view(reinterpret_cast<const char*>(sqlite3_column_text(stmt, j)), sqlite3_column_bytes(stmt, j)));
+	break;
+      default:
+	// NULLs don't count, and BLOBs aren't worth reading.
+	continue;
+      }
+      sketches[j].add(hash);
+      values[j]++;
+    }
+  }
+  sqlite3_finalize(stmt);
+  budget.end(DB);
+
+  bool whole_table = rc == SQLITE_DONE && rows < DISTINCT_ESTIMATE_ROWS;
+  for (size_t j = 0; j < counted.size(); j++) {
+    auto& profile = profiles[counted[j]];
+    // The sketch can't count more values than there were.
+    profile.distinct_estimate = std::min<sqlite3_int64>(std::llround(sketches[j].estimate()), values[j]);
+    profile.distinct_counted = values[j];
+    profile.distinct_lower_bound = !whole_table;
+  }
+}
+
+// Profiles the named columns of a table, collecting up to N distinct sample
+// values for each. Indexed columns are summarized from the index where
+// possible (see summarizeFromIndex) and only sampled otherwise.
+//
+// Rather than sorting the whole table by RANDOM(), we seek to random rowids
+// and read one row per probe, so the cost depends on N rather than on the
+// size of the table. Probes only fetch each value's type (and small numeric
+// values); text is read a bounded prefix at a time and BLOBs not at all, so
+// I/O is proportional to what we show the model.
+//
+// Tables without a rowid (and views) fall back to reading a bounded number
+// of rows from the start, truncating text with substr(). There SQLite
+// loads each text value in full (SQL has no way to read just a prefix),
+// though still not BLOBs, whose length() it takes from the record header;
+// text lengths are then counted in characters. Returns false if
+// the budget ran out first, in which case incomplete columns are marked as
+// cut short.
+inline bool sampleTable(sqlite3* DB, const SchemaSnapshot::Table& table, const TableStats* stats, const std::vector<std::string>& names, int N, SamplingBudget& budget, std::vector<ColumnProfile>& profiles) {
+  thread_local std::mt19937_64 rng { std::random_device{}() };
+
+  profiles.assign(names.size(), {});
+  if (names.empty()) {
+    return true;
+  }
+  auto table_name = table.quoted();
+  const int max_rows = N * SAMPLE_PROBES_PER_VALUE;
+
+  // Records a numeric value, or a null or BLOB, from the current row; returns false for text.
+  auto addNonText = [](ColumnProfile& profile, sqlite3_stmt* stmt, int i) {
+    switch (sqlite3_column_type(stmt, i)) {
+    case SQLITE_NULL:
+      profile.addNull();
+      return true;
+    case SQLITE_INTEGER:
+      profile.addNumber(std::hash<sqlite3_int64>{}(sqlite3_column_int64(stmt, i)));
+      return true;
+    case SQLITE_FLOAT:
+      profile.addNumber(std::hash<double>{}(sqlite3_column_double(stmt, i)));
+      return true;
+    case SQLITE_BLOB:
+      profile.addBlob();
+      return true;
+    }
+    return false;
+  };
+  auto complete = [&]() {
+    return std::all_of(profiles.begin(), profiles.end(), [&](const ColumnProfile& p) { return p.complete(N); });
+  };
+
+  budget.begin(DB, static_cast<long long>(names.size()) * SAMPLE_BUDGET_STEPS_PER_COLUMN);
+  for (size_t i = 0; i < names.size(); i++) {
+    if (isIndexed(table, names[i])) {
+      sqlite3_int64 distinct_estimate = -1;
+      if (stats && stats->columns.count(names[i])) {
+	distinct_estimate = stats->columns.at(names[i]).distinct;
+      }
+      summarizeFromIndex(DB, table_name, quoteIdentifier(names[i]), distinct_estimate, N, profiles[i]);
+    }
+  }
+  sqlite3_stmt* stmt = nullptr;
+  sqlite3_int64 min_rowid = 0, max_rowid = 0;
+  if (complete()) {
+    // Everything came from indexes.
+  } else if (table.type == "table" && getRowidRange(DB, table_name, min_rowid, max_rowid)) {
+    // typeof() doesn't load the value; numbers are small enough to fetch directly.
+    std::string column_list;
+    for (auto& name : names) {
+      auto column = quoteIdentifier(name);
+      column_list += fmt::format(", typeof({0}), CASE WHEN typeof({0}) IN ('integer', 'real') THEN {0} END", column);
+    }
+    auto probe_query = fmt::format("SELECT rowid{} FROM {} WHERE rowid >= ? ORDER BY rowid LIMIT 1;", column_list, table_name);
+    sqlite3_prepare_v2(DB, probe_query.c_str(), -1, &stmt, nullptr);
+    std::vector<sqlite3_blob*> blobs(names.size(), nullptr);
+    char buffer[samplePrefixBytes];
+    std::uniform_int_distribution<sqlite3_int64> rowids(min_rowid, max_rowid);
+    // A random rowid lands on the row after it, so rows that follow a gap
+    // are hit far more often than the rest; on landing on a row read
+    // before, step forward to the next unread rowid instead.
+    std::set<sqlite3_int64> visited;
+    auto unvisited = [&](sqlite3_int64 rowid) {
+      while (rowid < max_rowid && visited.count(rowid)) {
+	rowid++;
+      }
+      return rowid;
+    };
+    auto target = rowids(rng);
+    for (int probe = 0; probe < max_rows && !complete() && !budget.stop(); probe++) {
+      sqlite3_bind_int64(stmt, 1, target);
+      target = rowids(rng);
+      if (sqlite3_step(stmt) == SQLITE_ROW) {
+	auto rowid = sqlite3_column_int64(stmt, 0);
+	if (!visited.insert(rowid).second) {
+	  target = unvisited(rowid);
+	  if (visited.count(target)) {
+	    target = unvisited(min_rowid);
+	  }
+	  sqlite3_reset(stmt);
+	  if (visited.count(target)) {
+	    break; // read every row
+	  }
+	  continue;
+	}
+	for (size_t i = 0; i < names.size(); i++) {
+	  auto type = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1 + 2 * i));
+	  if (profiles[i].complete(N) || !type) {
+	    continue;
+	  }
+	  if (strcmp(type, "text") != 0) {
+	    addNonText(profiles[i], stmt, 2 + 2 * i);
+	    continue;
+	  }
+	  int length;
+	  auto total = readTextPrefix(DB, blobs[i], table, names[i], rowid, buffer, samplePrefixBytes, length);
+	  if (total >= 0) {
+	    profiles[i].addText(buffer, length, total, N);
+	  }
+	}
+      }
+      sqlite3_reset(stmt);
+    }
+    for (auto blob : blobs) {
+      sqlite3_blob_close(blob);
+    }
+  } else {
+    std::string column_list;
+    for (auto& name : names) {
+      auto column = quoteIdentifier(name);
+      column_list += fmt::format("{0}CASE WHEN typeof({1}) = 'text' THEN substr({1}, 1, {2}) WHEN typeof({1}) = 'blob' THEN x'' ELSE {1} END, length({1})",
+				 column_list.empty() ? "" : ", ", column, samplePrefixBytes);
+    }
+    auto scan_query = fmt::format("SELECT {} FROM {} LIMIT {};", column_list, table_name, max_rows);
+    sqlite3_prepare_v2(DB, scan_query.c_str(), -1, &stmt, nullptr);
+    while (!complete() && !budget.stop() && sqlite3_step(stmt) == SQLITE_ROW) {
+      for (size_t i = 0; i < names.size(); i++) {
+	if (profiles[i].complete(N)) {
+	  continue;
+	}
+	if (!addNonText(profiles[i], stmt, 2 * i)) {
+	  auto data = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2 * i));
+	  profiles[i].addText(data, sqlite3_column_bytes(stmt, 2 * i), sqlite3_column_int64(stmt, 2 * i + 1), N);
+	}
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  if (!budget.end(DB)) {
+#if DISTINCT_ESTIMATE_ROWS
+    estimateDistinct(DB, table_name, stats, names, budget, profiles);
+#endif
+    return true;
+  }
+  for (auto& profile : profiles) {
+    profile.cut_short = !profile.complete(N);
+  }
+  return false;
+}
+
+#endif
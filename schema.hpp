@@ -0,0 +1,280 @@
+#ifndef SCHEMA_HPP_
+#define SCHEMA_HPP_
+
+#include <algorithm>
+#include <cctype>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "aho_corasick.hpp"
+
+/*
+
+  The schema as SQLwrite sees it: a snapshot of every table's columns,
+  keys, and indexes, plus the helpers for naming and quoting them in SQL.
+
+  Example usage:
+
+  SchemaSnapshot schema;
+  ... // filled in by introspectSchema()
+  if (auto table = schema.find("invoice")) {
+    auto sql = fmt::format("SELECT count(*) FROM {};", table->quoted());
+  }
+
+ */
+
+// Quotes an identifier so it can be safely pasted into a SQL statement.
+inline std::string quoteIdentifier(const std::string& name) {
+  std::string quoted("\"");
+  for (auto c : name) {
+    if (c == '"') {
+      quoted += '"';
+    }
+    quoted += c;
+  }
+  quoted += '"';
+  return quoted;
+}
+
+// SQLite's type affinity, derived from a column's declared type by the rules
+// in https://www.sqlite.org/datatype3.html#determination_of_column_affinity.
+enum class Affinity { INTEGER, TEXT, BLOB, REAL, NUMERIC };
+
+inline Affinity columnAffinity(const std::string& declared_type) {
+  std::string type(declared_type);
+  std::transform(type.begin(), type.end(), type.begin(), [](unsigned char c) { return std::toupper(c); });
+  auto contains = [&](const char* s) { return type.find(s) != std::string::npos; };
+  if (contains("INT")) {
+    return Affinity::INTEGER;
+  }
+  if (contains("CHAR") || contains("CLOB") || contains("TEXT")) {
+    return Affinity::TEXT;
+  }
+  if (contains("BLOB") || type.empty()) {
+    return Affinity::BLOB;
+  }
+  if (contains("REAL") || contains("FLOA") || contains("DOUB")) {
+    return Affinity::REAL;
+  }
+  return Affinity::NUMERIC;
+}
+
+// The collating sequence a column is declared with (COLLATE name) in a
+// CREATE TABLE statement, upper-cased; BINARY, SQLite's default, if none.
+inline std::string declaredCollation(const std::string& create_sql, const std::string& column) {
+  auto upper = [](std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::toupper(c); });
+    return text;
+  };
+  auto name = upper(column);
+  // Walk the tokens inside the outermost parentheses, one column definition
+  // (or table constraint) between each pair of commas.
+  int depth = 0;
+  bool first = false, ours = false, collate = false;
+  for (size_t i = 0; i < create_sql.size(); ) {
+    unsigned char c = create_sql[i];
+    std::string token;
+    bool quoted = false;
+    if (std::isspace(c)) {
+      i++;
+      continue;
+    } else if (create_sql.compare(i, 2, "--") == 0) {
+      i = create_sql.find('\n', i);
+      continue;
+    } else if (create_sql.compare(i, 2, "/*") == 0) {
+      i = create_sql.find("*/", i + 2);
+      i = i == std::string::npos ? i : i + 2;
+      continue;
+    } else if (c == '\'' || c == '"' || c == '`' || c == '[') {
+      // Quotes are escaped by doubling them.
+      char close = c == '[' ? ']' : c;
+      for (i++; i < create_sql.size(); i++) {
+	if (create_sql[i] == close && (close == ']' || create_sql.compare(i, 2, std::string(2, close)) != 0)) {
+	  break;
+	}
+	token += create_sql[i];
+	i += create_sql[i] == close;
+      }
+      i++;
+      quoted = c != '\'';
+      if (!quoted) {
+	token.clear(); // a string, which is never a name
+      }
+    } else if (std::isalnum(c) || c == '_' || c >= 0x80) {
+      for (; i < create_sql.size() && (std::isalnum(static_cast<unsigned char>(create_sql[i])) || create_sql[i] == '_' || static_cast<unsigned char>(create_sql[i]) >= 0x80); i++) {
+	token += create_sql[i];
+      }
+    } else {
+      i++;
+      if (c == '(' && ++depth == 1) {
+	first = true;
+      } else if (c == ')' && --depth == 0) {
+	break;
+      } else if (c == ',' && depth == 1) {
+	if (ours) {
+	  break;
+	}
+	first = true;
+      }
+      continue;
+    }
+    if (depth != 1) {
+      continue;
+    }
+    if (first) {
+      ours = upper(token) == name;
+      first = false;
+    } else if (ours && collate) {
+      return upper(token);
+    } else if (ours) {
+      collate = !quoted && upper(token) == "COLLATE";
+    }
+  }
+  return "BINARY";
+}
+
+// Quotes a string as a SQL literal.
+inline std::string quoteString(const std::string& str) {
+  std::string quoted("'");
+  for (auto c : str) {
+    if (c == '\'') {
+      quoted += '\'';
+    }
+    quoted += c;
+  }
+  quoted += '\'';
+  return quoted;
+}
+
+// A snapshot of the schema-derived parts of the prompt for one database,
+// or for all of a connection's databases together. Rebuilding it means
+// scanning sqlite_master and re-formatting every table, so we keep it
+// around until PRAGMA schema_version says the schema changed.
+struct SchemaSnapshot {
+  struct Column {
+    std::string name;
+    std::string type; // declared type, possibly empty
+    Affinity affinity = Affinity::BLOB;
+    int pk = 0;             // position in the primary key, or 0
+    std::string references; // "table.column" for foreign keys
+  };
+  struct Table {
+    std::string name; // qualified with the database name, unless it's in main
+    std::string type; // "table" or "view"
+    std::string sql;  // DDL with quote characters stripped
+    std::vector<Column> columns;
+    // Index name -> indexed columns, in order ("" for expressions and the rowid).
+    std::map<std::string, std::vector<std::string>> index_columns;
+    // Indexes that don't hold their leading column's values in the order
+    // the column compares them: partial indexes, and ones that sort it
+    // with a collation other than the column's.
+    std::set<std::string> restricted_indexes;
+    std::string schema = "main"; // the database it is in
+    std::string base_name;       // its name within that database
+
+    // The name, quoted (and qualified) for use in SQL.
+    std::string quoted() const {
+      return schema == "main" ? quoteIdentifier(base_name) : quoteIdentifier(schema) + "." + quoteIdentifier(base_name);
+    }
+
+    // SQLite's own tables (sqlite_sequence, sqlite_stat1, ...).
+    bool internal() const {
+      return base_name.rfind("sqlite_", 0) == 0;
+    }
+  };
+  struct Index {
+    std::string name;
+    std::string tbl_name;
+    std::string sql;
+  };
+  // A foreign key, i.e., an edge of the join graph.
+  struct ForeignKey {
+    size_t table;  // the referencing table (index into tables)
+    size_t parent; // the referenced table
+    std::vector<std::string> columns;        // in table
+    std::vector<std::string> parent_columns; // in parent, in the same order
+  };
+  // PRAGMA schema_version for the snapshot of one database; for the
+  // combined snapshot, a count that changes whenever any part does.
+  int schema_version = -1;
+  // A hash of sqlite_master for the snapshot of one database, leaving out
+  // our own tables, whose creation changes schema_version but not the prompt.
+  size_t fingerprint = 0;
+  std::vector<Table> tables;
+  std::vector<Index> indexes;
+  std::vector<ForeignKey> foreign_keys;
+  // Table index -> the foreign keys (indexes into foreign_keys) it is at either end of.
+  std::vector<std::vector<size_t>> joins;
+  // Lowercase table name -> index into tables (SQLite names are case-insensitive).
+  std::map<std::string, size_t> table_index;
+
+  const Table* find(const std::string& name) const {
+    std::string lower(name);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+    auto found = table_index.find(lower);
+    return found == table_index.end() ? nullptr : &tables[found->second];
+  }
+  // The schema (and index) section of the translation prompt in one
+  // format, in pieces so that the prompt can be assembled from whichever
+  // tables fit in its token budget.
+  struct Section {
+    std::string header;
+    std::vector<std::string> tables;  // parallel to tables ("" if not shown)
+    std::string index_header;
+    std::vector<std::string> indexes; // parallel to indexes
+    // Tokens in the header and in each table, counted once per snapshot.
+    size_t header_tokens = 0;
+    std::vector<size_t> table_tokens; // parallel to tables
+
+    std::string text() const {
+      std::string text(header);
+      for (auto& table : tables) {
+	text += table;
+      }
+      if (!indexes.empty()) {
+	text += index_header;
+      }
+      for (auto& index : indexes) {
+	text += index;
+      }
+      return text;
+    }
+  };
+  Section raw;     // the CREATE statements
+  Section compact; // see buildCompactSchema
+  // Table and column names, and their variants, each with the index of
+  // its table as the id; see buildLexicon.
+  aho_corasick lexicon;
+};
+
+// Tables SQLwrite creates for its own bookkeeping; these are never shown to
+// the model or sampled.
+const std::string sampleCacheTable("sqlwrite_samples");
+const std::string valueIndexTable("sqlwrite_values");
+const std::string embeddingTable("sqlwrite_embeddings");
+
+// Whether name is one of those tables, or one that FTS5 keeps for the
+// value index. Users' own tables may have names starting with sqlwrite_ too.
+inline bool isShadowTable(const std::string& name) {
+  if (name == sampleCacheTable || name == valueIndexTable || name == embeddingTable) {
+    return true;
+  }
+  for (auto suffix : { "_data", "_idx", "_content", "_docsize", "_config" }) {
+    if (name == valueIndexTable + suffix) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Common words in questions that say nothing about which data they concern.
+const std::set<std::string> questionStopwords { "all", "and", "are", "each", "for", "from", "how", "list", "many", "number", "show", "that", "the", "what", "which", "who", "with" };
+
+// How the model sees a table in a database: qualified unless it's in main.
+inline std::string qualifiedName(const std::string& schema, const std::string& name) {
+  return schema == "main" ? name : schema + "." + name;
+}
+
+#endif
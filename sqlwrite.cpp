@@ -31,6 +31,114 @@
 #define MAX_RETRIES_VALIDITY 5
 #endif
 
+// The settings of the sampler itself (SAMPLE_PROBES_PER_VALUE, ...) are in
+// sampler.hpp, and those of the value index (INDEX_VALUES, ...) in value_index.hpp.
+#if !defined(SAMPLE_BUDGET_MS)
+// Wall-clock limit on sampling during one translation; cached samples are used past it.
+#define SAMPLE_BUDGET_MS 1000
+#endif
+#if !defined(MAX_SAMPLE_THREADS)
+// Upper bound on the read-only connections (and threads) used to sample tables in parallel.
+#define MAX_SAMPLE_THREADS 16
+#endif
+
+#if !defined(QUESTION_DIRECTED_SAMPLING)
+// Only sample tables that the question mentions (by name, column, or value), if any.
+#define QUESTION_DIRECTED_SAMPLING 1
+#endif
+#if !defined(ALWAYS_SAMPLE_ROWS)
+// Tables with at most this many rows (lookup tables, typically) are sampled
+// whatever the question, since they cost next to nothing to sample.
+#define ALWAYS_SAMPLE_ROWS 1000
+#endif
+
+#if !defined(SCHEMA_FORMAT)
+// How schemas are shown to the model: "compact" (one line per table, from
+// PRAGMA table_xinfo), "raw" (the CREATE statements), or "auto" (whichever
+// takes fewer tokens for the tables shown). Can be changed at runtime with
+// sqlwrite_config('schema_format', ...).
+#define SCHEMA_FORMAT "auto"
+#endif
+
+#if !defined(PROMPT_TOKEN_BUDGET)
+// The most tokens a translation request may take up, counting its system
+// message, the chat framing and REPLY_TOKENS for the reply (GPT-4 has 8192,
+// and retries add to the conversation). Can be changed at runtime with
+// sqlwrite_config('token_budget', ...).
+#define PROMPT_TOKEN_BUDGET 6000
+#endif
+#if !defined(REPLY_TOKENS)
+// Tokens of the budget kept for the model's reply: the query and its
+// indexing suggestions.
+#define REPLY_TOKENS 400
+#endif
+#if !defined(ESTIMATED_TOKEN_BUDGET_PERCENT)
+// Without the tokenizer's ranks, token counts are estimates (usually within
+// 10-15%, but not always), so prompts are only allowed this share of the budget.
+#define ESTIMATED_TOKEN_BUDGET_PERCENT 80
+#endif
+
+#if !defined(EMBEDDING_RETRIEVAL_MIN_TABLES)
+// Schemas with at least this many tables are narrowed down to the
+// EMBEDDING_TOP_K tables most similar to the question (0 to disable).
+#define EMBEDDING_RETRIEVAL_MIN_TABLES 100
+#endif
+#if !defined(EMBEDDING_TOP_K)
+#define EMBEDDING_TOP_K 20
+#endif
+#if !defined(EMBEDDING_MODEL)
+#define EMBEDDING_MODEL "text-embedding-ada-002"
+#endif
+
+#if !defined(SCHEMA_PRUNING)
+// Only show the model the tables a question mentions by name (and the
+// tables they are linked to by foreign keys), or every table if it
+// mentions none.
+#define SCHEMA_PRUNING 1
+#endif
+
+#if !defined(INCLUDE_ROW_COUNTS)
+// Show each table's approximate row count with its schema, so the model
+// knows which tables are large.
+#define INCLUDE_ROW_COUNTS 1
+#endif
+
+#if !defined(JOIN_PATH_HINTS)
+// Tell the model how (by foreign keys) to join the tables a question mentions.
+#define JOIN_PATH_HINTS 1
+#endif
+
+#if !defined(SCHEMA_LINKING_MIN_TABLES)
+// For schemas with at least this many tables (0 to disable), first ask
+// SCHEMA_LINKING_MODEL, which is faster and cheaper, which tables the
+// question needs, showing it only their names and columns; the
+// translation prompt then only includes those. Can be changed at runtime
+// with sqlwrite_config('schema_linking_min_tables', ...).
+#define SCHEMA_LINKING_MIN_TABLES 0
+#endif
+#if !defined(SCHEMA_LINKING_MODEL)
+#define SCHEMA_LINKING_MODEL ai::config::GPT_3_5
+#endif
+
+#if !defined(PERSIST_SAMPLES)
+// Keep column samples in the sqlwrite_samples table across sessions.
+#define PERSIST_SAMPLES 1
+#endif
+
+#if !defined(PRECONNECT)
+// Open a connection to the API (in the background) when the extension is
+// loaded, so that the first question doesn't wait for the TCP and TLS
+// handshakes; every request then reuses it.
+#define PRECONNECT 1
+#endif
+
+#if !defined(STREAM_RESPONSES)
+// Stream translations in, running each query that only reads as soon as
+// its "SQL" field has arrived, while the indexing suggestions are still
+// being generated.
+#define STREAM_RESPONSES 1
+#endif
+
 #define LARGE_QUERY_THRESHOLD 10
 
 #include <stdio.h>
@@ -39,12 +147,26 @@
 
 #include <sqlite3.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 
+#include <fmt/compile.h>
 #include <fmt/core.h>
 #include <fmt/format.h>
 
@@ -52,9 +174,18 @@
 #include "sqlite3ext.h"
 
 #include "aistream.hpp"
+#include "aho_corasick.hpp"
+#include "join_graph.hpp"
+#include "profile.hpp"
+#include "prompt.hpp"
+#include "schema.hpp"
 
 SQLITE_EXTENSION_INIT1;
 
+// These call SQLite, so they come after SQLITE_EXTENSION_INIT1.
+#include "sampler.hpp"
+#include "value_index.hpp"
+
 std::string prompt("[SQLwrite] ");
 
 const bool DEBUG = false;
@@ -98,156 +229,1907 @@ std::string calculateSHA256Hash(const std::string& input) {
     EVP_DigestFinal_ex(mdctx, hash, nullptr);
 
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-    EVP_MD_CTX_destroy(mdctx);
-#else
-    EVP_MD_CTX_free(mdctx);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    EVP_MD_CTX_destroy(mdctx);
+#else
+    EVP_MD_CTX_free(mdctx);
+#endif
+
+    std::string hashString;
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        hashString += fmt::format("{:02x}", hash[i]);
+    }
+
+    return hashString;
+}
+
+// SQLite callback function to retrieve query results
+int callback(void* data, int argc, char** argv, char** /* azColName */) {
+    std::list<std::string>& resultList = *static_cast<std::list<std::string>*>(data);
+
+    for (int i = 0; i < argc; i++) {
+        if (argv[i]) {
+            resultList.push_back(argv[i]);
+        }
+    }
+
+    return 0;
+}
+
+int lines_printed = 0;
+
+int print_em(void*, int c_num, char** c_vals, char**) {
+    for (int i = 0; i < c_num; i++) {
+      std::cout << (c_vals[i] ? c_vals[i] : "");
+      if ((i < c_num-1) && (c_num > 1)) {
+	std::cout << "|";
+      }
+    }
+    std::cout << std::endl;
+    return 0;
+}
+
+std::string query_result;
+
+int count_em(void*, int c_num, char** c_vals, char**) {
+  for (int i = 0; i < c_num; i++) {
+    query_result += (c_vals[i] ? c_vals[i] : "");
+    if ((i < c_num - 1) && (c_num > 1)) {
+      query_result += "|";
+    }
+  }
+  query_result += "\n";
+  lines_printed++;
+  return 0;
+}
+
+// A candidate query and what running it produced (see count_em), so that
+// it runs only once however many times it is checked: when it streams in,
+// when the response is validated, and when its results are counted.
+struct Execution {
+  std::string sql;
+  int rc = SQLITE_OK;
+  std::string error;
+  int lines = 0;
+  std::string result;
+
+  // Runs query, unless it is the one that ran last.
+  void run(sqlite3* db, const std::string& query) {
+    if (ran && query == sql) {
+      return;
+    }
+    ran = true;
+    sql = query;
+    lines_printed = 0;
+    query_result = "";
+    rc = sqlite3_exec(db, sql.c_str(), count_em, nullptr, nullptr);
+    error = (rc == SQLITE_OK) ? "" : sqlite3_errmsg(db);
+    lines = lines_printed;
+    result = query_result;
+  }
+
+private:
+  bool ran = false;
+};
+
+// Whether every statement in sql only reads the database (so running it
+// before we know we want it does no harm).
+static bool readOnly(sqlite3* db, const std::string& sql) {
+  const char* tail = sql.c_str();
+  while (*tail) {
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, tail, -1, &stmt, &tail) != SQLITE_OK) {
+      return false;
+    }
+    bool reads = !stmt || sqlite3_stmt_readonly(stmt);
+    sqlite3_finalize(stmt);
+    if (!reads) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#include <iostream>
+#include <string>
+
+std::string removeEscapedCharacters(const std::string& s) {
+    std::string result = s;
+    std::size_t pos = result.find("\\");
+    while (pos != std::string::npos) {
+        if (result[pos+1] == 'n') { // Check if escaped newline
+            result.replace(pos, 2, " "); // Replace with single space
+        } else if (result[pos+1] == '"') { // Check if escaped quote
+            result.erase(pos, 1); // Remove backslash
+        }
+        pos = result.find("\\", pos+1); // Find next escaped character
+    }
+    return result;
+}
+
+
+std::string removeEscapedNewlines(const std::string& s) {
+    std::string result = s;
+    std::size_t pos = result.find("\\n");
+    while (pos != std::string::npos) {
+      result.replace(pos, 2, " ");
+        pos = result.find("\\n", pos);
+    }
+    return result;
+}
+
+
+// The model that translates questions to SQL.
+const ai::config translationModel = ai::config::GPT_4_0;
+
+// Bump whenever the format of the cached column summaries changes.
+const int sampleCacheVersion = 5;
+
+// Embeddings of each table's compact description, for finding the tables
+// a question is about in very large schemas. Kept in the
+// sqlwrite_embeddings table across sessions.
+struct TableEmbeddings {
+  struct Entry {
+    std::string description; // what was embedded
+    std::vector<float> vector;
+  };
+  std::map<std::string, Entry> tables;
+  int schema_version = -1; // when we last checked for changed descriptions
+  bool loaded = false;
+  unsigned long embedded = 0;  // tables embedded this session
+  size_t retrieved = 0;        // tables retrieved for the last question
+};
+
+// A database on a connection (main or ATTACHed), from PRAGMA database_list.
+struct Database {
+  std::string name;
+  std::string file; // "" for in-memory databases
+
+  bool operator==(const Database& other) const {
+    return name == other.name && file == other.file;
+  }
+  bool operator!=(const Database& other) const {
+    return !(*this == other);
+  }
+};
+
+// Extra read-only connections to the same database file (with the same
+// databases attached), so that tables can be sampled in parallel. Opened
+// on demand and kept for later asks.
+struct SamplerPool {
+  std::string filename;
+  std::vector<Database> databases;
+  std::vector<sqlite3*> connections;
+
+  ~SamplerPool() {
+    close();
+  }
+
+  void close() {
+    for (auto connection : connections) {
+      sqlite3_close(connection);
+    }
+    connections.clear();
+  }
+};
+
+// What went into the last prompt, for sqlwrite_stats().
+struct PromptStats {
+  size_t tokens = 0;
+  size_t tables_mentioned = 0; // by name or by value, if the schema was pruned
+  size_t tables_linked = 0;    // chosen by the schema-linking model
+  size_t tables_omitted = 0;
+  size_t joins = 0; // join hints
+  size_t indexes_omitted = 0;
+  bool profiles_omitted = false;
+  std::string schema_format; // "raw" or "compact"
+  size_t budget = 0;         // what the prompt was kept within (see promptBudget)
+};
+
+// State shared by every SQL function registered on one connection. It is
+// passed as the functions' user data and freed when the last one goes away.
+struct ConnectionState {
+  int refcount = 0;
+  // Settings changed with sqlwrite_config().
+  struct {
+    std::string schema_format = SCHEMA_FORMAT;
+    sqlite3_int64 token_budget = PROMPT_TOKEN_BUDGET;
+    sqlite3_int64 schema_linking_min_tables = SCHEMA_LINKING_MIN_TABLES;
+  } config;
+  PromptStats prompt;
+  // The databases on the connection, each one's snapshot, and all of them
+  // together (shared, so prompts can refer to its text after it is replaced).
+  std::vector<Database> databases;
+  std::map<std::string, SchemaSnapshot> schemas;
+  std::shared_ptr<const SchemaSnapshot> schema;
+  struct {
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+  } schema_cache;
+  SampleCache samples;
+  SamplerPool pool;
+  TableEmbeddings embeddings;
+};
+
+// The number of tokens text takes up in a prompt to the translation model.
+static size_t countTokens(std::string_view text) {
+  return ai::tokenizer::forModel(translationModel).count(text);
+}
+
+// The same for a prompt, counted piece by piece (pieces break between words).
+static size_t countTokens(const ai::prompt& prompt) {
+  size_t tokens = 0;
+  prompt.for_each([&](std::string_view piece) {
+    tokens += countTokens(piece);
+  });
+  return tokens;
+}
+
+// What a chat request adds to the tokens of its messages' content: each
+// message's role and delimiters, and the start of the reply (as OpenAI
+// counts them for its chat models).
+const size_t messageOverheadTokens = 3;
+const size_t replyPrimingTokens = 3;
+
+// The instructions sent ahead of each translation prompt.
+const char* const translationInstructions = "You are a programming assistant who is an expert in generating SQL queries from natural language. You ONLY respond with JSON objects.";
+
+// The tokens a translation request takes besides its user message: the
+// system message, the framing of both messages, and room for the reply.
+static size_t requestOverhead() {
+  return countTokens(translationInstructions) + 2 * messageOverheadTokens + replyPrimingTokens + REPLY_TOKENS;
+}
+
+// The budget to keep a translation prompt within: the configured one, less
+// a safety margin if we can only estimate token counts (which we say once).
+static size_t promptBudget(size_t budget) {
+  auto& tokenizer = ai::tokenizer::forModel(translationModel);
+  if (tokenizer.exact()) {
+    return budget;
+  }
+  static std::once_flag warned;
+  std::call_once(warned, [&]() {
+    std::cerr << fmt::format("{}{}.tiktoken not found (in ~/.sqlwrite or SQLWRITE_TIKTOKEN_DIR), so token counts are estimates; prompts are kept to {}% of the token budget.\n",
+			     prompt, tokenizer.encoding(), ESTIMATED_TOKEN_BUDGET_PERCENT);
+  });
+  return budget * ESTIMATED_TOKEN_BUDGET_PERCENT / 100;
+}
+
+// Runs a query that produces a single integer (e.g., a PRAGMA or count(*)); returns -1 on failure.
+static sqlite3_int64 queryInteger(sqlite3* db, const std::string& sql) {
+  sqlite3_int64 value = -1;
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+      value = sqlite3_column_int64(stmt, 0);
+    }
+  }
+  sqlite3_finalize(stmt);
+  return value;
+}
+
+static int getSchemaVersion(sqlite3* db, const std::string& schema) {
+  return static_cast<int>(queryInteger(db, fmt::format("PRAGMA {}.schema_version", quoteIdentifier(schema))));
+}
+
+// A hash of the definitions in sqlite_master of database, other than our own tables'.
+static size_t getSchemaFingerprint(sqlite3* db, const std::string& database) {
+  std::string definitions;
+  sqlite3_stmt* stmt;
+  auto query = fmt::format("SELECT type, name, tbl_name, sql FROM {}.sqlite_master ORDER BY rowid;", quoteIdentifier(database));
+  if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    return 0;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    auto tbl_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+    if (tbl_name && isShadowTable(tbl_name)) {
+      continue;
+    }
+    for (int i = 0; i < 4; i++) {
+      auto text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, i));
+      definitions += text ? text : "";
+      definitions += '\0';
+    }
+  }
+  sqlite3_finalize(stmt);
+  return std::hash<std::string>()(definitions);
+}
+
+// Changes whenever another connection writes to any of the databases.
+static sqlite3_int64 getDataVersion(sqlite3* db, const std::vector<Database>& databases) {
+  sqlite3_int64 version = 0;
+  for (auto& database : databases) {
+    version += queryInteger(db, fmt::format("PRAGMA {}.data_version", quoteIdentifier(database.name)));
+  }
+  return version;
+}
+
+// The databases on a connection: main and any attached ones, in order.
+static std::vector<Database> listDatabases(sqlite3* db) {
+  std::vector<Database> databases;
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(db, "PRAGMA database_list", -1, &stmt, nullptr) == SQLITE_OK) {
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+      auto file = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+      // The temp database only holds this connection's temporary tables.
+      if (name && strcmp(name, "temp") != 0) {
+	databases.push_back({ name, file ? file : "" });
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+  return databases;
+}
+
+// Short names for column affinities in the compact schema.
+static const char* affinityName(const SchemaSnapshot::Column& column) {
+  switch (column.affinity) {
+  case Affinity::INTEGER:
+    return "int";
+  case Affinity::TEXT:
+    return "text";
+  case Affinity::BLOB:
+    return column.type.empty() ? "" : "blob";
+  case Affinity::REAL:
+    return "real";
+  default:
+    return "num";
+  }
+}
+
+// The declared type, lowercased and without any size (e.g., "decimal" for
+// DECIMAL(10,2)); for NUMERIC affinity it says more than the affinity
+// (DATE, BOOLEAN, ...).
+static std::string compactType(const SchemaSnapshot::Column& column) {
+  if (column.affinity != Affinity::NUMERIC || column.type.empty()) {
+    return affinityName(column);
+  }
+  auto type = column.type.substr(0, column.type.find('('));
+  type.erase(type.find_last_not_of(' ') + 1);
+  std::transform(type.begin(), type.end(), type.begin(), [](unsigned char c) { return std::tolower(c); });
+  return type;
+}
+
+// Formats the schema as one line per table and per index: each column
+// with its affinity and primary and foreign key markers. This says what the
+// model needs in far fewer tokens than the CREATE statements, which carry
+// comments, constraint boilerplate, and whitespace.
+static void buildCompactSchema(SchemaSnapshot& snapshot) {
+  auto& section = snapshot.compact;
+  section.header = "Schema, as table(column type [PK] [FK referenced table.column] [indexed], ...):\n";
+  for (auto& table : snapshot.tables) {
+    std::string prompt;
+    // SQLite's internal tables are of no interest to the model.
+    if (table.internal()) {
+      section.tables.push_back(prompt);
+      continue;
+    }
+    prompt += table.type == "view" ? "view " : "";
+    prompt += table.name + "(";
+    for (size_t i = 0; i < table.columns.size(); i++) {
+      auto& column = table.columns[i];
+      prompt += i ? ", " : "";
+      prompt += column.name;
+      if (auto type = compactType(column); !type.empty()) {
+	prompt += fmt::format(" {}", type);
+      }
+      if (column.pk) {
+	prompt += " PK";
+      }
+      if (!column.references.empty()) {
+	prompt += fmt::format(" FK {}", column.references);
+      }
+      // Columns an index can look up (the first primary key column always can).
+      bool indexed = column.pk != 1 && std::any_of(table.index_columns.begin(), table.index_columns.end(), [&](auto& index) {
+	return !index.second.empty() && index.second[0] == column.name;
+      });
+      if (indexed) {
+	prompt += " indexed";
+      }
+    }
+    prompt += ")\n";
+    section.tables.push_back(std::move(prompt));
+  }
+  section.index_header = "Existing indexes:\n";
+  for (auto& index : snapshot.indexes) {
+    const std::vector<std::string>* columns = nullptr;
+    for (auto& table : snapshot.tables) {
+      if (table.name == index.tbl_name && table.index_columns.count(index.name)) {
+	columns = &table.index_columns.at(index.name);
+      }
+    }
+    bool simple = columns
+      && std::none_of(columns->begin(), columns->end(), [](const std::string& c) { return c.empty(); })
+      && index.sql.find(" WHERE ") == std::string::npos;
+    if (simple) {
+      std::string column_list;
+      for (auto& column : *columns) {
+	column_list += (column_list.empty() ? "" : ", ") + column;
+      }
+      section.indexes.push_back(fmt::format("{} ON {}({})\n", index.name, index.tbl_name, column_list));
+    } else {
+      // Expression and partial indexes need their full definition.
+      section.indexes.push_back(index.sql + "\n");
+    }
+  }
+}
+
+// The lowercase words of an identifier, split at underscores and other
+// punctuation and where the case changes ("InvoiceLine_id" gives
+// "invoice", "line", and "id").
+static std::vector<std::string> identifierWords(const std::string& name) {
+  std::vector<std::string> words;
+  size_t start = 0;
+  for (size_t i = 0; i <= name.size(); i++) {
+    unsigned char c = i < name.size() ? name[i] : ' ';
+    bool split = !std::isalnum(c) || (std::isupper(c) && i > start && std::islower(static_cast<unsigned char>(name[i - 1])));
+    if (split && start < i) {
+      words.push_back(name.substr(start, i - start));
+      std::transform(words.back().begin(), words.back().end(), words.back().begin(), [](unsigned char c) { return std::tolower(c); });
+    }
+    if (!std::isalnum(c)) {
+      start = i + 1;
+    } else if (split) {
+      start = i;
+    }
+  }
+  return words;
+}
+
+// A lowercase word and its plural (or singular, if it looks plural).
+static std::vector<std::string> inflections(const std::string& word) {
+  std::vector<std::string> forms { word };
+  auto n = word.size();
+  auto vowel = [](char c) { return std::strchr("aeiou", c) != nullptr; };
+  if (n > 3 && word.compare(n - 3, 3, "ies") == 0) {
+    forms.push_back(word.substr(0, n - 3) + "y");
+  } else if (n > 3 && word[n - 1] == 's' && word[n - 2] != 's') {
+    forms.push_back(word.substr(0, n - 1));
+  } else if (n > 1 && word[n - 1] == 'y' && !vowel(word[n - 2])) {
+    forms.push_back(word.substr(0, n - 1) + "ies");
+  } else if (word[n - 1] == 's' || word[n - 1] == 'x' || (n > 1 && word[n - 1] == 'h' && (word[n - 2] == 'c' || word[n - 2] == 's'))) {
+    forms.push_back(word + "es");
+  } else {
+    forms.push_back(word + "s");
+  }
+  return forms;
+}
+
+// Builds the automaton that finds the tables a question mentions. A table
+// is mentioned by its name, by its name split into words ("invoice line"
+// or "invoiceline" for InvoiceLine), or by any word of it, each in the
+// singular or plural; and likewise by its column names, except those
+// (like "name" or "description") found in too many tables to say much.
+// Rebuilt only with the rest of the snapshot, i.e., when the schema changes.
+static void buildLexicon(SchemaSnapshot& snapshot) {
+  std::map<std::string, std::set<size_t>> table_names, column_names;
+  auto addVariants = [](const std::string& name, bool parts, size_t table, std::map<std::string, std::set<size_t>>& names) {
+    auto words = identifierWords(name);
+    if (words.empty()) {
+      return;
+    }
+    std::string spaced, joined;
+    for (size_t i = 0; i + 1 < words.size(); i++) {
+      spaced += words[i] + " ";
+      joined += words[i];
+    }
+    for (auto& form : inflections(words.back())) {
+      names[spaced + form].insert(table);
+      names[joined + form].insert(table);
+    }
+    for (size_t i = 0; parts && words.size() > 1 && i < words.size(); i++) {
+      if (words[i].size() >= 3 && !questionStopwords.count(words[i])) {
+	for (auto& form : inflections(words[i])) {
+	  names[form].insert(table);
+	}
+      }
+    }
+  };
+  for (size_t i = 0; i < snapshot.tables.size(); i++) {
+    addVariants(snapshot.tables[i].base_name, true, i, table_names);
+    for (auto& column : snapshot.tables[i].columns) {
+      addVariants(column.name, true, i, column_names);
+    }
+  }
+  auto max_tables = std::max<size_t>(2, snapshot.tables.size() / 10);
+  snapshot.lexicon.clear();
+  for (auto names : { &table_names, &column_names }) {
+    for (auto& [name, tables] : *names) {
+      if (name.size() < 3 || questionStopwords.count(name) || (names == &column_names && tables.size() > max_tables)) {
+	continue;
+      }
+      for (auto table : tables) {
+	snapshot.lexicon.add(name, table);
+      }
+    }
+  }
+  snapshot.lexicon.build();
+}
+
+// The tables whose names, or specific enough column names, the question
+// mentions (see buildLexicon).
+static std::set<std::string> mentionedTables(const SchemaSnapshot& schema, const std::string& question) {
+  std::set<std::string> mentioned;
+  schema.lexicon.match(question, [&](size_t table, size_t, size_t) {
+    mentioned.insert(schema.tables[table].name);
+  });
+  return mentioned;
+}
+
+// Reads the schema of one database (db_schema, as db sees it) into
+// snapshot, qualifying its tables' names with alias (the name the main
+// connection knows it by). The join graph, table index, and lexicon are
+// left to indexSchemaSnapshot. Returns false if sqlite_master couldn't be
+// read (e.g., because the database was locked).
+static bool introspectSchema(sqlite3* db, const std::string& db_schema, const std::string& alias, SchemaSnapshot& snapshot) {
+  snapshot.tables.clear();
+  snapshot.indexes.clear();
+  snapshot.foreign_keys.clear();
+  snapshot.joins.clear();
+  snapshot.table_index.clear();
+  snapshot.raw = {};
+  snapshot.compact = {};
+  auto db_name = quoteIdentifier(db_schema);
+
+  sqlite3_stmt* stmt;
+  std::vector<std::string> definitions; // each table's CREATE statement, as written
+  auto tables_query = fmt::format("SELECT name, type, sql FROM {}.sqlite_master WHERE type='table' OR type='view'", db_name);
+  sqlite3_prepare_v2(db, tables_query.c_str(), -1, &stmt, nullptr);
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    auto name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    auto type = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+    auto sql = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+    if (!name || !sql) {
+      continue;
+    }
+    // Hide our own tables.
+    if (isShadowTable(name)) {
+      continue;
+    }
+    definitions.push_back(sql);
+    // Strip any quote characters.
+    std::string sql_str(sql);
+    sql_str.erase(std::remove_if(sql_str.begin(), sql_str.end(), [](char c) { return c == '\'' || c == '\"' || c == '`'; }), sql_str.end());
+    auto qualified = qualifiedName(alias, name);
+    snapshot.raw.tables.push_back(fmt::format("Schema for {}: {}\n", qualified, sql_str));
+    std::string lower(qualified);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+    snapshot.table_index[lower] = snapshot.tables.size();
+    SchemaSnapshot::Table entry;
+    entry.name = qualified;
+    entry.type = type;
+    entry.sql = std::move(sql_str);
+    entry.schema = alias;
+    entry.base_name = name;
+    snapshot.tables.push_back(std::move(entry));
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    return false;
+  }
+
+  // Foreign keys by table and id, until every table's primary key is known.
+  struct PendingKey {
+    std::string parent;
+    std::vector<std::string> columns, parent_columns;
+  };
+  std::vector<std::map<int, PendingKey>> pending_keys(snapshot.tables.size());
+  for (auto& table : snapshot.tables) {
+    // table_xinfo also lists generated columns.
+    auto columns_query = fmt::format("PRAGMA {}.table_xinfo({});", db_name, quoteIdentifier(table.base_name));
+    sqlite3_prepare_v2(db, columns_query.c_str(), -1, &stmt, nullptr);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+      auto type = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+      // Skip the hidden columns of virtual tables.
+      if (sqlite3_column_int(stmt, 6) == 1) {
+	continue;
+      }
+      std::string declared_type(type ? type : "");
+      SchemaSnapshot::Column column;
+      column.name = name;
+      column.type = declared_type;
+      column.affinity = columnAffinity(declared_type);
+      column.pk = sqlite3_column_int(stmt, 5);
+      table.columns.push_back(std::move(column));
+    }
+    sqlite3_finalize(stmt);
+
+    // Foreign keys always refer to tables in the same database.
+    auto fk_query = fmt::format("PRAGMA {}.foreign_key_list({});", db_name, quoteIdentifier(table.base_name));
+    sqlite3_prepare_v2(db, fk_query.c_str(), -1, &stmt, nullptr);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto parent_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+      auto from = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+      auto to = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4));
+      if (!parent_name || !from) {
+	continue;
+      }
+      auto parent = qualifiedName(alias, parent_name);
+      for (auto& column : table.columns) {
+	if (column.name == from) {
+	  // Without a column, the key refers to the parent's primary key.
+	  column.references = to ? fmt::format("{}.{}", parent, to) : parent;
+	}
+      }
+      // Rows come in order of each key's columns.
+      auto& key = pending_keys[&table - snapshot.tables.data()][sqlite3_column_int(stmt, 0)];
+      key.parent = parent;
+      key.columns.push_back(from);
+      key.parent_columns.push_back(to ? to : "");
+    }
+    sqlite3_finalize(stmt);
+
+    // Include automatic indexes (for UNIQUE and PRIMARY KEY constraints), which have no SQL.
+    auto index_query = fmt::format("SELECT il.name, ii.name, il.partial, ii.coll FROM pragma_index_list({0}, {1}) AS il, pragma_index_xinfo(il.name, {1}) AS ii"
+				   " WHERE ii.key ORDER BY il.name, ii.seqno;",
+				   quoteString(table.base_name), quoteString(db_schema));
+    sqlite3_prepare_v2(db, index_query.c_str(), -1, &stmt, nullptr);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto index = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+      auto column = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+      auto collation = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+      auto& columns = table.index_columns[index];
+      if (columns.empty() && column && (sqlite3_column_int(stmt, 2)
+	  || strcasecmp(collation ? collation : "BINARY", declaredCollation(definitions[&table - snapshot.tables.data()], column).c_str()) != 0)) {
+	table.restricted_indexes.insert(index);
+      }
+      columns.push_back(column ? column : "");
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  // The edges of the join graph. Keys to tables we can't see (or not to
+  // every column of the parent's primary key) are left out.
+  for (size_t i = 0; i < pending_keys.size(); i++) {
+    for (auto& [id, key] : pending_keys[i]) {
+      auto parent = snapshot.find(key.parent);
+      if (!parent) {
+	continue;
+      }
+      std::vector<std::string> primary_key;
+      for (auto& column : parent->columns) {
+	if (column.pk > 0) {
+	  primary_key.resize(std::max<size_t>(primary_key.size(), column.pk));
+	  primary_key[column.pk - 1] = column.name;
+	}
+      }
+      for (size_t c = 0; c < key.parent_columns.size(); c++) {
+	if (key.parent_columns[c].empty()) {
+	  key.parent_columns[c] = c < primary_key.size() ? primary_key[c] : "";
+	}
+      }
+      if (std::find(key.parent_columns.begin(), key.parent_columns.end(), "") != key.parent_columns.end()) {
+	continue;
+      }
+      size_t p = parent - snapshot.tables.data();
+      snapshot.foreign_keys.push_back({ i, p, std::move(key.columns), std::move(key.parent_columns) });
+    }
+  }
+
+  // Add indexes, if any.
+#if INCLUDE_INDEXES
+  auto indexes_query = fmt::format("SELECT tbl_name, sql, name FROM {}.sqlite_master WHERE type='index'", db_name);
+  sqlite3_prepare_v2(db, indexes_query.c_str(), -1, &stmt, nullptr);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    auto tbl_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    auto sql = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+    auto name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+    // Automatic indexes (e.g., for UNIQUE constraints) have no SQL.
+    if (!tbl_name || !sql || isShadowTable(tbl_name)) {
+      continue;
+    }
+    auto qualified = qualifiedName(alias, tbl_name);
+    snapshot.raw.index_header = "\n\nExisting indexes:\n";
+    snapshot.raw.indexes.push_back(fmt::format("Index for {}: {}\n", qualified, sql));
+    snapshot.indexes.push_back({ name, qualified, sql });
+  }
+  sqlite3_finalize(stmt);
+#endif
+
+  buildCompactSchema(snapshot);
+  return true;
+}
+
+// Builds what is derived from the whole snapshot: the table index, the
+// join graph's adjacency lists, and the lexicon.
+static void indexSchemaSnapshot(SchemaSnapshot& snapshot) {
+  snapshot.table_index.clear();
+  for (size_t i = 0; i < snapshot.tables.size(); i++) {
+    std::string lower(snapshot.tables[i].name);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+    snapshot.table_index[lower] = i;
+  }
+  snapshot.joins.assign(snapshot.tables.size(), {});
+  for (size_t k = 0; k < snapshot.foreign_keys.size(); k++) {
+    auto& key = snapshot.foreign_keys[k];
+    snapshot.joins[key.table].push_back(k);
+    if (key.parent != key.table) {
+      snapshot.joins[key.parent].push_back(k);
+    }
+  }
+  buildLexicon(snapshot);
+}
+
+// Puts the snapshots of each database together, in the order of the databases.
+static void mergeSchemaSnapshots(const std::vector<Database>& databases, const std::map<std::string, SchemaSnapshot>& parts, SchemaSnapshot& merged) {
+  merged.tables.clear();
+  merged.indexes.clear();
+  merged.foreign_keys.clear();
+  merged.raw = {};
+  merged.compact = {};
+  for (auto& database : databases) {
+    auto& part = parts.at(database.name);
+    auto offset = merged.tables.size();
+    merged.tables.insert(merged.tables.end(), part.tables.begin(), part.tables.end());
+    merged.indexes.insert(merged.indexes.end(), part.indexes.begin(), part.indexes.end());
+    for (auto key : part.foreign_keys) {
+      key.table += offset;
+      key.parent += offset;
+      merged.foreign_keys.push_back(std::move(key));
+    }
+    for (auto [section, from] : { std::make_pair(&merged.raw, &part.raw), std::make_pair(&merged.compact, &part.compact) }) {
+      section->header = from->header;
+      if (!from->index_header.empty()) {
+	section->index_header = from->index_header;
+      }
+      section->tables.insert(section->tables.end(), from->tables.begin(), from->tables.end());
+      section->indexes.insert(section->indexes.end(), from->indexes.begin(), from->indexes.end());
+    }
+  }
+  if (databases.size() > 1) {
+    for (auto section : { &merged.raw, &merged.compact }) {
+      section->header += "Tables in attached databases are qualified with the database name, as database.table.\n";
+    }
+  }
+  indexSchemaSnapshot(merged);
+  for (auto section : { &merged.raw, &merged.compact }) {
+    section->header_tokens = countTokens(section->header);
+    section->table_tokens.clear();
+    for (auto& table : section->tables) {
+      section->table_tokens.push_back(countTokens(table));
+    }
+  }
+}
+
+// The schema section to show the candidate tables (all, if none are
+// given) in: the configured format, or for "auto" whichever costs fewer
+// tokens. The compact format's legend only pays for itself once there are
+// enough columns to describe.
+static const SchemaSnapshot::Section& schemaSection(const SchemaSnapshot& schema, const std::string& format, const std::set<std::string>& candidates) {
+  if (format != "auto") {
+    return format == "raw" ? schema.raw : schema.compact;
+  }
+  auto cost = [&](const SchemaSnapshot::Section& section) {
+    auto tokens = section.header_tokens;
+    for (size_t i = 0; i < schema.tables.size(); i++) {
+      if (candidates.empty() || candidates.count(schema.tables[i].name)) {
+	tokens += section.table_tokens[i];
+      }
+    }
+    return tokens;
+  };
+  return cost(schema.raw) < cost(schema.compact) ? schema.raw : schema.compact;
+}
+
+// Returns the schema snapshot for this connection, covering main and every
+// attached database. Each database's part is kept separately and rebuilt
+// only if its own schema changed; when several changed, they are read in
+// parallel, each on a read-only connection of its own.
+static std::shared_ptr<const SchemaSnapshot> getSchemaSnapshot(sqlite3* db, ConnectionState& state) {
+  auto databases = listDatabases(db);
+  bool rebuild = databases != state.databases;
+  for (auto it = state.schemas.begin(); it != state.schemas.end(); ) {
+    bool attached = std::any_of(databases.begin(), databases.end(), [&](const Database& database) { return database.name == it->first; });
+    it = attached ? std::next(it) : state.schemas.erase(it);
+  }
+  std::vector<const Database*> changed;
+  for (auto& database : databases) {
+    auto version = getSchemaVersion(db, database.name);
+    auto& part = state.schemas[database.name];
+    if (version == -1 || version != part.schema_version) {
+      // Creating our own tables (for samples, values, and embeddings) doesn't change the schema we show.
+      auto fingerprint = getSchemaFingerprint(db, database.name);
+      bool ours = version != -1 && part.schema_version != -1 && fingerprint == part.fingerprint;
+      part.schema_version = version;
+      part.fingerprint = fingerprint;
+      if (!ours) {
+	changed.push_back(&database);
+      }
+    }
+  }
+  if (!rebuild && changed.empty()) {
+    state.schema_cache.hits++;
+    return state.schema;
+  }
+  state.schema_cache.misses++;
+
+  // Other connections can't see changes that this one hasn't committed yet, nor its in-memory databases.
+  std::vector<char> done(changed.size(), false);
+  if (changed.size() > 1 && sqlite3_get_autocommit(db) && sqlite3_threadsafe()) {
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < changed.size(); i++) {
+      if (changed[i]->file.empty()) {
+	continue;
+      }
+      readers.emplace_back([&, i]() {
+	sqlite3* connection = nullptr;
+	if (sqlite3_open_v2(changed[i]->file.c_str(), &connection, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) == SQLITE_OK) {
+	  sqlite3_busy_timeout(connection, SAMPLE_BUDGET_MS);
+	  auto& part = state.schemas.at(changed[i]->name);
+	  done[i] = getSchemaVersion(connection, "main") == part.schema_version && introspectSchema(connection, "main", changed[i]->name, part);
+	}
+	sqlite3_close(connection);
+      });
+    }
+    for (auto& reader : readers) {
+      reader.join();
+    }
+  }
+  for (size_t i = 0; i < changed.size(); i++) {
+    if (!done[i]) {
+      introspectSchema(db, changed[i]->name, changed[i]->name, state.schemas.at(changed[i]->name));
+    }
+  }
+
+  state.databases = databases;
+  auto merged = std::make_shared<SchemaSnapshot>();
+  mergeSchemaSnapshots(databases, state.schemas, *merged);
+  merged->schema_version = static_cast<int>(state.schema_cache.misses);
+  state.schema = merged;
+  return state.schema;
+}
+
+static void loadSampleCache(sqlite3* DB, SampleCache& cache) {
+  cache.loaded = true;
+#if PERSIST_SAMPLES
+  auto load_query = fmt::format("SELECT tbl, row_count, max_rowid, samples FROM {} WHERE version = {};", sampleCacheTable, sampleCacheVersion);
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(DB, load_query.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto tbl = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+      auto columns = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+      auto parsed = json::parse(columns ? columns : "", nullptr, false);
+      if (tbl && parsed.is_object()) {
+	cache.tables[tbl] = { sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2), std::move(parsed), true };
+      }
+    }
+  }
+  // The table won't exist until the first samples have been saved (nor
+  // have a max_rowid column, if saved by an older version).
+  sqlite3_finalize(stmt);
+#endif
+}
+
+// Writes updated entries back to the shadow table. Failures (e.g., a
+// read-only database) are ignored: the in-memory cache still works.
+static void saveSampleCache(sqlite3* DB, const SampleCache& cache, const std::vector<std::string>& updated) {
+#if PERSIST_SAMPLES
+  if (updated.empty() || sqlite3_db_readonly(DB, "main") != 0) {
+    return;
+  }
+  auto create_query = fmt::format("CREATE TABLE IF NOT EXISTS {}(tbl TEXT PRIMARY KEY, version INTEGER NOT NULL, row_count INTEGER NOT NULL, samples TEXT NOT NULL, max_rowid INTEGER NOT NULL DEFAULT -1);", sampleCacheTable);
+  // Added to tables made by older versions.
+  auto alter_query = fmt::format("ALTER TABLE {} ADD COLUMN max_rowid INTEGER NOT NULL DEFAULT -1;", sampleCacheTable);
+  if (sqlite3_exec(DB, "SAVEPOINT sqlwrite_samples;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    return;
+  }
+  sqlite3_stmt* stmt = nullptr;
+  auto insert_query = fmt::format("INSERT OR REPLACE INTO {}(tbl, version, row_count, max_rowid, samples) VALUES (?, {}, ?, ?, ?);", sampleCacheTable, sampleCacheVersion);
+  auto rc = sqlite3_exec(DB, create_query.c_str(), nullptr, nullptr, nullptr);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(DB, insert_query.c_str(), -1, &stmt, nullptr);
+  }
+  if (rc != SQLITE_OK && sqlite3_exec(DB, alter_query.c_str(), nullptr, nullptr, nullptr) == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(DB, insert_query.c_str(), -1, &stmt, nullptr);
+  }
+  for (auto it = updated.begin(); rc == SQLITE_OK && it != updated.end(); it++) {
+    auto& entry = cache.tables.at(*it);
+    auto columns = entry.columns.dump(-1, ' ', false, json::error_handler_t::replace);
+    sqlite3_bind_text(stmt, 1, it->c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 2, entry.row_count);
+    sqlite3_bind_int64(stmt, 3, entry.max_rowid);
+    sqlite3_bind_text(stmt, 4, columns.c_str(), -1, SQLITE_TRANSIENT);
+    rc = (sqlite3_step(stmt) == SQLITE_DONE) ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(DB, "ROLLBACK TO sqlwrite_samples;", nullptr, nullptr, nullptr);
+  }
+  sqlite3_exec(DB, "RELEASE sqlwrite_samples;", nullptr, nullptr, nullptr);
+#endif
+}
+
+// The outcome of checking one table against the sample cache, and of
+// resampling it if the cached entry turned out to be stale.
+struct TableSample {
+  const SchemaSnapshot::Table* table = nullptr;
+  const TableStats* stats = nullptr;
+  bool relevant = true;  // the question may be about this table; if not, use only what we have
+  bool current = false;  // the cached entry can be used as is
+  bool skipped = false;  // out of time, with nothing cached to fall back on
+  bool stale = false;    // out of time, so using cached samples unchecked
+  bool complete = true;  // sampling finished within its budget
+  sqlite3_int64 row_count = -1;
+  sqlite3_int64 max_rowid = -1;
+  std::vector<std::string> names; // columns sampled live
+  std::vector<ColumnProfile> profiles;
+};
+
+// Decides whether a table's cached samples are current and resamples it if
+// not. Only reads the cache, so several tables can be refreshed at once,
+// each on its own connection.
+static bool cachedSamplesCover(const SampleCache& cache, const std::string& table, const std::vector<std::string>& columns) {
+  auto cached = cache.tables.find(table);
+  return cached != cache.tables.end() && !cache.partial.count(table)
+    && std::all_of(columns.begin(), columns.end(), [&](const std::string& name) { return cached->second.columns.contains(name); });
+}
+
+// Whether refreshTable has nothing to read for sample.
+static bool samplesCurrent(const SampleCache& cache, bool unchanged, const TableSample& sample) {
+  auto names = columnsToSample(*sample.table, sample.stats);
+  return names.empty() || (unchanged && !cache.unverified.count(sample.table->name) && cachedSamplesCover(cache, sample.table->name, names));
+}
+
+static void refreshTable(sqlite3* DB, const SampleCache& cache, bool unchanged, int N, SamplingBudget& budget, TableSample& sample) {
+  auto& table = *sample.table;
+  sample.names = columnsToSample(table, sample.stats);
+  if (sample.names.empty()) {
+    // Nothing to read (e.g., ANALYZE sampled every column we'd profile).
+    sample.current = true;
+    return;
+  }
+  auto cached = cache.tables.find(table.name);
+  auto found = cachedSamplesCover(cache, table.name, sample.names);
+  sample.current = found && unchanged && !cache.unverified.count(table.name);
+  if (!sample.current && budget.expired()) {
+    // Out of time: use what we have, even if it may be stale.
+    sample.current = cached != cache.tables.end();
+    sample.skipped = !sample.current;
+    sample.stale = sample.current;
+    return;
+  }
+  if (!sample.current && table.type == "table") {
+    // Counting views could mean evaluating a join, so those are resampled whenever the data changes.
+    budget.begin(DB, std::numeric_limits<long long>::max());
+    sample.row_count = queryInteger(DB, fmt::format("SELECT count(*) FROM {};", table.quoted()));
+    sample.max_rowid = queryInteger(DB, fmt::format("SELECT max(rowid) FROM {};", table.quoted()));
+    if (budget.end(DB) && found) {
+      // Counting a huge table took the rest of our time; keep the old samples.
+      sample.current = true;
+      sample.stale = true;
+    } else {
+      // Anything written since this session sampled (or checked) the table
+      // may have changed it. Samples from an earlier session are kept if the
+      // table's signature is the same, which misses updates made in between.
+      sample.current = found && cached->second.earlier_session && sample.row_count != -1
+	&& sample.row_count == cached->second.row_count && sample.max_rowid == cached->second.max_rowid;
+    }
+  }
+  if (!sample.current) {
+    sample.complete = sampleTable(DB, table, sample.stats, sample.names, N, budget, sample.profiles);
+  }
+}
+
+// A URI that opens a database file read-only (special characters escaped).
+static std::string readOnlyURI(const std::string& file) {
+  std::string uri("file:");
+  for (unsigned char c : file) {
+    if (c == '%' || c == '?' || c == '#') {
+      uri += fmt::format("%{:02X}", c);
+    } else {
+      uri += c;
+    }
+  }
+  return uri + "?mode=ro";
+}
+
+// Returns up to count read-only connections to the database behind DB
+// (with the same databases attached), or none if any of them has no file
+// (e.g., ":memory:") or SQLite is single-threaded.
+static std::vector<sqlite3*> getSamplerConnections(sqlite3* DB, const std::vector<Database>& databases, SamplerPool& pool, size_t count) {
+  auto filename = sqlite3_db_filename(DB, "main");
+  if (!filename || !*filename || !sqlite3_threadsafe()) {
+    return {};
+  }
+  // Other connections can't see in-memory databases.
+  if (std::any_of(databases.begin(), databases.end(), [](const Database& database) { return database.file.empty(); })) {
+    return {};
+  }
+  if (pool.filename != filename || pool.databases != databases) {
+    pool.close();
+    pool.filename = filename;
+    pool.databases = databases;
+  }
+  while (pool.connections.size() < count) {
+    sqlite3* connection = nullptr;
+    auto rc = sqlite3_open_v2(filename, &connection, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI, nullptr);
+    // Attach the same databases, under the same names, so that qualified names work.
+    for (auto& database : databases) {
+      if (rc == SQLITE_OK && database.name != "main") {
+	auto attach = fmt::format("ATTACH {} AS {};", quoteString(readOnlyURI(database.file)), quoteIdentifier(database.name));
+	rc = sqlite3_exec(connection, attach.c_str(), nullptr, nullptr, nullptr);
+      }
+    }
+    if (rc != SQLITE_OK) {
+      sqlite3_close(connection);
+      break;
+    }
+    sqlite3_busy_timeout(connection, SAMPLE_BUDGET_MS);
+    pool.connections.push_back(connection);
+  }
+  return std::vector<sqlite3*>(pool.connections.begin(), pool.connections.begin() + std::min(count, pool.connections.size()));
+}
+
+// Lowercase words of three or more letters and digits in text. Identifiers
+// are also split where the case changes ("InvoiceDate" gives "invoicedate",
+// "invoice", and "date"), and plurals are also matched in the singular.
+static std::set<std::string> lexicalTokens(const std::string& text) {
+  std::set<std::string> tokens;
+  auto add = [&](std::string word) {
+    if (word.size() < 3) {
+      return;
+    }
+    std::transform(word.begin(), word.end(), word.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (word.size() > 3 && word.back() == 's') {
+      tokens.insert(word.substr(0, word.size() - 1));
+    }
+    tokens.insert(std::move(word));
+  };
+  size_t word = 0, part = 0;
+  for (size_t i = 0; i <= text.size(); i++) {
+    unsigned char c = i < text.size() ? text[i] : ' ';
+    if (!std::isalnum(c)) {
+      if (word < i) {
+	add(text.substr(word, i - word));
+	if (part > word) {
+	  add(text.substr(part, i - part));
+	}
+      }
+      word = part = i + 1;
+    } else if (std::isupper(c) && i > word && std::islower(static_cast<unsigned char>(text[i - 1]))) {
+      add(text.substr(part, i - part));
+      part = i;
+    }
+  }
+  return tokens;
+}
+
+// The tables a question seems to be about: those it mentions (see
+// mentionedTables), those whose cached sample values share a word with
+// it, and those holding values that matched it in the value index. Returns every
+// table if none do, since then we have no idea. Only candidates (if
+// given) are considered.
+static std::set<std::string> relevantTables(const SchemaSnapshot& schema, const SampleCache& cache, const std::string& question, const json& matches,
+					    const std::set<std::string>& candidates) {
+  auto words = lexicalTokens(question);
+  for (auto& word : questionStopwords) {
+    words.erase(word);
+  }
+  auto mentioned = [&](const std::string& text) {
+    auto tokens = lexicalTokens(text);
+    return std::any_of(tokens.begin(), tokens.end(), [&](const std::string& token) { return words.count(token); });
+  };
+
+  auto candidate = [&](const std::string& table) { return candidates.empty() || candidates.count(table) > 0; };
+  auto by_name = mentionedTables(schema, question);
+  std::set<std::string> relevant;
+  for (auto& match : matches) {
+    if (candidate(match["table"].get<std::string>())) {
+      relevant.insert(match["table"].get<std::string>());
+    }
+  }
+  for (auto& table : schema.tables) {
+    if (!candidate(table.name)) {
+      continue;
+    }
+    bool match = by_name.count(table.name) > 0;
+    auto cached = cache.tables.find(table.name);
+    if (!match && cached != cache.tables.end()) {
+      // The value lexicon: samples and listed values we already have.
+      for (auto& [column, summary] : cached->second.columns.items()) {
+	for (auto key : { "samples", "values" }) {
+	  for (auto& value : summary.value(key, json::array())) {
+	    match = match || (value.is_string() && mentioned(value.get<std::string>()));
+	  }
+	}
+      }
+    }
+    if (match) {
+      relevant.insert(table.name);
+    }
+  }
+  if (relevant.empty()) {
+    for (auto& table : schema.tables) {
+      if (candidate(table.name)) {
+	relevant.insert(table.name);
+      }
+    }
+  }
+  return relevant;
+}
+
+// Tables to sample for a question besides the relevant ones, so that
+// their values can tie it to them (see relevantTables): those that tables
+// it mentions by name have a foreign key to or from (a question about
+// "jazz tracks" mentions a value of Genre, not Genre), and tiny tables.
+// Only candidates (if given) are considered.
+static std::set<std::string> nearbyTables(sqlite3* DB, const SchemaSnapshot& schema, const SampleCache& cache, const std::string& question,
+					  const std::set<std::string>& candidates) {
+  auto candidate = [&](const std::string& table) { return candidates.empty() || candidates.count(table) > 0; };
+  auto by_name = mentionedTables(schema, question);
+  std::set<std::string> nearby;
+  for (size_t i = 0; i < schema.tables.size(); i++) {
+    auto& table = schema.tables[i];
+    if (table.internal() || !candidate(table.name)) {
+      continue;
+    }
+    if (by_name.count(table.name) && i < schema.joins.size()) {
+      for (auto fk : schema.joins[i]) {
+	auto& key = schema.foreign_keys[fk];
+	auto& other = schema.tables[key.table == i ? key.parent : key.table];
+	if (candidate(other.name)) {
+	  nearby.insert(other.name);
+	}
+      }
+    }
+    auto cached = cache.tables.find(table.name);
+    sqlite3_int64 min_rowid = 0, max_rowid = -1;
+    if (cached != cache.tables.end() && cached->second.row_count >= 0) {
+      if (cached->second.row_count <= ALWAYS_SAMPLE_ROWS) {
+	nearby.insert(table.name);
+      }
+    } else if (table.type == "table" && getRowidRange(DB, table.quoted(), min_rowid, max_rowid) && max_rowid - min_rowid < ALWAYS_SAMPLE_ROWS) {
+      nearby.insert(table.name);
+    }
+  }
+  return nearby;
+}
+
+// Returns column profiles for every table as a JSON object ({ table: { column: summary } }).
+// Samples are cached per connection and in the sqlwrite_samples table.
+// Tables are sampled again after anything is written to the database, or,
+// for samples from an earlier session, if their row count or largest rowid
+// changed since.
+//
+// If the database has been analyzed, indexed columns are described from
+// sqlite_stat1/sqlite_stat4 instead, and only the rest are sampled.
+//
+// Only candidate tables (all, if none are given) relevant to the question,
+// or near it (see nearbyTables), are checked and sampled; the rest are
+// described from whatever is already cached. Relevance is worked out again
+// from what sampling found. Values in the value index that match the
+// question are returned in matches.
+//
+// Tables are checked and sampled in parallel on a pool of read-only
+// connections. Results are merged in schema order, so the output does not
+// depend on which thread finished first.
+nlohmann::json sampleSQLiteDistinct(sqlite3* DB, ConnectionState& state, const SchemaSnapshot& schema, const std::set<std::string>& candidates,
+				    const std::string& question, int N, json& matches) {
+  auto& cache = state.samples;
+  if (!cache.loaded) {
+    loadSampleCache(DB, cache);
+    loadValueIndex(DB, cache);
+  }
+  // Matches outside the candidate tables would refer to tables the model
+  // won't see. Until sampling has checked a table, its values may be
+  // stale: they can tie the question to the table, but aren't reported.
+  auto candidateMatches = [&](bool checked) {
+    json kept = json::array();
+    for (auto& match : matchValues(DB, cache, question)) {
+      auto table = match["table"].get<std::string>();
+      if ((candidates.empty() || candidates.count(table)) && !(checked && cache.unverified.count(table))) {
+	kept.push_back(match);
+      }
+    }
+    return kept;
+  };
+  matches = candidateMatches(false);
+
+  // If nothing has been written since we last checked, every cached entry is still current.
+  auto data_version = getDataVersion(DB, state.databases);
+  auto unchanged = cache.validated
+    && data_version == cache.data_version
+    && sqlite3_total_changes(DB) == cache.total_changes;
+
+  auto stats = readSQLiteStats(DB, schema, N);
+#if QUESTION_DIRECTED_SAMPLING
+  auto& relevant = cache.relevant;
+  relevant = relevantTables(schema, cache, question, matches, candidates);
+  auto to_sample = relevant;
+  auto nearby = nearbyTables(DB, schema, cache, question, candidates);
+  to_sample.insert(nearby.begin(), nearby.end());
+#endif
+  std::vector<TableSample> work;
+  for (auto& table : schema.tables) {
+    // Skip SQLite's internal tables (sqlite_sequence, sqlite_stat1, ...).
+    if (!table.internal()) {
+      auto table_stats = stats.find(table.name);
+      TableSample sample;
+      sample.table = &table;
+      sample.stats = table_stats != stats.end() ? &table_stats->second : nullptr;
+      work.push_back(std::move(sample));
+      work.back().relevant = candidates.empty() || candidates.count(table.name) > 0;
+#if QUESTION_DIRECTED_SAMPLING
+      work.back().relevant = to_sample.count(table.name) > 0;
+#endif
+    }
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SAMPLE_BUDGET_MS);
+  std::atomic<size_t> next { 0 };
+  auto worker = [&](sqlite3* connection) {
+    SamplingBudget budget(deadline, connection != DB);
+    for (size_t i; (i = next++) < work.size(); ) {
+      if (work[i].relevant) {
+	refreshTable(connection, cache, unchanged, N, budget, work[i]);
+      }
+    }
+  };
+
+  // Other connections can't see changes that this one hasn't committed yet.
+  // Otherwise, if any table has to be read (even one, and even if the data
+  // hasn't changed), it is read on a connection of our own, so that the
+  // budget can interrupt it (see SamplingBudget and SamplingWatchdog).
+  auto relevant_tables = static_cast<size_t>(std::count_if(work.begin(), work.end(), [](auto& sample) { return sample.relevant; }));
+  auto to_read = std::any_of(work.begin(), work.end(), [&](auto& sample) { return sample.relevant && !samplesCurrent(cache, unchanged, sample); });
+  size_t threads = std::min<size_t>({ relevant_tables, std::max(1u, std::thread::hardware_concurrency()), MAX_SAMPLE_THREADS });
+  std::vector<sqlite3*> connections;
+  if (threads >= 1 && to_read && sqlite3_get_autocommit(DB)) {
+    connections = getSamplerConnections(DB, state.databases, state.pool, threads);
+  }
+  if (!connections.empty()) {
+    SamplingWatchdog watchdog(connections, deadline);
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < connections.size(); i++) {
+      workers.emplace_back(worker, connections[i]);
+    }
+    worker(connections[0]);
+    for (auto& w : workers) {
+      w.join();
+    }
+  } else {
+    worker(DB);
+  }
+
+  nlohmann::json result = json::object();
+  std::vector<std::string> updated;
+  cache.cut_short.clear();
+  for (auto& sample : work) {
+    auto& name = sample.table->name;
+    if (sample.skipped) {
+      cache.cut_short.push_back(name);
+      continue;
+    }
+    if (!sample.relevant) {
+      // Whatever we have may be stale by the time the question is about this table.
+      if (!unchanged) {
+	cache.unverified.insert(name);
+      }
+    } else if (sample.current) {
+      cache.hits++;
+      if (!sample.stale) {
+	cache.unverified.erase(name);
+	if (cache.tables.count(name)) {
+	  cache.tables[name].earlier_session = false;
+	}
+      }
+    } else {
+      cache.misses++;
+      cache.unverified.erase(name);
+      // The values indexed so far may be gone, even if sampling didn't finish.
+      cache.values_indexed.erase(name);
+      auto& entry = cache.tables[name];
+      entry.row_count = sample.row_count;
+      entry.max_rowid = sample.max_rowid;
+      entry.earlier_session = false;
+      entry.columns = json::object();
+      for (size_t i = 0; i < sample.names.size(); i++) {
+	entry.columns[sample.names[i]] = sample.profiles[i].summary();
+	if (sample.profiles[i].cut_short) {
+	  cache.cut_short.push_back(name + "." + sample.names[i]);
+	}
+      }
+      // Keep partial samples for this translation, but don't save them.
+      if (sample.complete) {
+	cache.partial.erase(name);
+	updated.push_back(name);
+      } else {
+	cache.partial.insert(name);
+      }
+    }
+    auto cached = cache.tables.find(name);
+    auto columns = cached != cache.tables.end() ? cached->second.columns : json::object();
+    if (sample.stats) {
+      for (auto& column : sample.table->columns) {
+	auto column_stats = sample.stats->columns.find(column.name);
+	if (!shouldProfile(*sample.table, column) || column_stats == sample.stats->columns.end()) {
+	  continue;
+	}
+	auto& [distinct, profile] = column_stats->second;
+	if (profile.rows > 0) {
+	  columns[column.name] = profile.summary();
+	}
+	if (distinct >= 0 && columns.contains(column.name)) {
+	  auto& summary = columns[column.name];
+	  summary["distinct"] = distinct;
+	  summary.erase("distinct_lower_bound");
+	  // A better guess than repeats among a few samples.
+	  summary["enum"] = distinct < static_cast<sqlite3_int64>(ColumnProfile::maxDistinct) && distinct * 3 <= sample.stats->row_count;
+	}
+      }
+    }
+    if (!columns.empty()) {
+      result[name] = std::move(columns);
+    }
+  }
+
+  saveSampleCache(DB, cache, updated);
+  // Index the values of tables we just sampled (their data changed, so
+  // from the start), and go on with tables we are asked about but haven't
+  // finished indexing.
+  auto to_index = updated;
+  for (auto& sample : work) {
+    auto& name = sample.table->name;
+    if (sample.relevant && valuesPending(cache, name) && cache.tables.count(name) && !cache.partial.count(name)
+	&& std::find(to_index.begin(), to_index.end(), name) == to_index.end()) {
+      to_index.push_back(name);
+    }
+  }
+  SamplingBudget budget(deadline, false);
+  updateValueIndex(DB, schema, cache, to_index, budget);
+  matches = candidateMatches(true);
+#if QUESTION_DIRECTED_SAMPLING
+  // The samples and values we just found may tie the question to other tables.
+  relevant = relevantTables(schema, cache, question, matches, candidates);
+#endif
+  // Note the versions after saving, so our own writes don't invalidate the cache.
+  cache.validated = true;
+  cache.data_version = data_version;
+  cache.total_changes = sqlite3_total_changes(DB);
+  cache.threads = std::max<size_t>(connections.size(), 1);
+
+  return result;
+}
+
+// Formats column profiles for the prompt: the samples themselves, then a
+// one-line description of each profiled column. If the value index found
+// values matching the question, those replace the random samples, and are
+// formatted separately (into matched), as they go after the schema.
+static std::string formatColumnProfiles(const json& profiles, const json& matches, std::string& matched) {
+  json samples = json::object();
+  json descriptions = json::object();
+  for (auto& [table, columns] : profiles.items()) {
+    for (auto& [column, summary] : columns.items()) {
+      // Columns with a full list of values or a range don't need samples as well.
+      if (summary.contains("samples") && summary["samples"].size() > 1 && !summary.contains("values") && !summary.contains("min")) {
+	samples[table][column] = summary["samples"];
+      }
+      auto description = summary["kind"].get<std::string>();
+      if (summary["enum"].get<bool>()) {
+	description += ", enum-like";
+      }
+      if (summary.contains("distinct")) {
+	auto lower_bound = summary.value("distinct_lower_bound", false);
+	description += fmt::format(", {}{}{} distinct", lower_bound ? "" : "~", summary["distinct"].get<long long>(), lower_bound ? "+" : "");
+      }
+      if (summary.contains("values")) {
+	description += fmt::format(", one of {}", summary["values"].dump(-1, ' ', false, json::error_handler_t::replace));
+      }
+      if (summary.contains("min")) {
+	description += fmt::format(", from {} to {}", summary["min"].dump(-1, ' ', false, json::error_handler_t::replace),
+				   summary["max"].dump(-1, ' ', false, json::error_handler_t::replace));
+      }
+      if (auto null_ratio = summary["null_ratio"].get<double>(); null_ratio > 0) {
+	description += fmt::format(", {:.0f}% null", 100 * null_ratio);
+      }
+      if (summary["kind"] == "text") {
+	description += fmt::format(", avg length {:.0f}", summary["avg_length"].get<double>());
+      }
+      descriptions[table][column] = description;
+    }
+  }
+  if (!matches.empty()) {
+    matched = fmt::format("Values in the database that match the question (use these exact values): {}\n",
+			  matches.dump(-1, ' ', false, json::error_handler_t::replace));
+    return fmt::format("\nColumn profiles: {}\n",
+		       descriptions.dump(-1, ' ', false, json::error_handler_t::replace));
+  }
+  matched.clear();
+  return fmt::format("\nSample values for columns: {}\nColumn profiles: {}\n",
+		     samples.dump(-1, ' ', false, json::error_handler_t::replace),
+		     descriptions.dump(-1, ' ', false, json::error_handler_t::replace));
+}
+
+
+// A table's number of rows, or only an upper bound on it.
+struct RowCount {
+  sqlite3_int64 rows = 0;
+  bool upper_bound = false;
+};
+
+// A row count to two significant digits ("~280", "~3.5K", "~120M"); the
+// model only needs the magnitude, and rounding keeps the prompt the same
+// as tables grow a little. Upper bounds are rounded up instead ("≤1.3K").
+static std::string approximateRows(const RowCount& count) {
+  const char* suffixes[] = { "", "K", "M", "B", "T" };
+  double value = count.rows;
+  size_t suffix = 0;
+  while (value >= (count.upper_bound ? 1000 : 999.5) && suffix + 1 < sizeof(suffixes) / sizeof(suffixes[0])) {
+    value /= 1000;
+    suffix++;
+  }
+  // To a multiple of 1 / scale (less a little, so that 1.1 * 10 doesn't round up to 12).
+  auto round = [&](double value, double scale) {
+    return (count.upper_bound ? std::ceil(value * scale - 1e-9) : std::round(value * scale)) / scale;
+  };
+  auto digits = 0;
+  if (value >= 100) {
+    value = round(value, 0.1);
+  } else if (suffix && round(value, 10) < 10) {
+    value = round(value, 10);
+    digits = 1;
+  } else {
+    value = round(value, 1);
+  }
+  return fmt::format("{}{:.{}f}{}", count.upper_bound ? "≤" : "~", value, digits, suffixes[suffix]);
+}
+
+// Row counts for the candidate tables (all, if none are given), as cheaply
+// as we can get them: from the sample cache (counted when the table was
+// last checked), else from sqlite_stat1, else from the span of rowids
+// (only an upper bound, since rowids can have gaps, found with two index
+// seeks). Tables we can't estimate (views and WITHOUT ROWID tables,
+// mostly) are left out.
+static std::map<std::string, RowCount> estimateRowCounts(sqlite3* DB, const SchemaSnapshot& schema, const SampleCache& cache,
+							 const std::set<std::string>& candidates) {
+  std::map<std::string, RowCount> rows;
+#if INCLUDE_ROW_COUNTS
+  std::map<std::string, sqlite3_int64> stat1;
+  for (auto& stat_table : schema.tables) {
+    if (stat_table.base_name != "sqlite_stat1") {
+      continue;
+    }
+    sqlite3_stmt* stmt;
+    auto stat1_query = fmt::format("SELECT tbl, max(CAST(stat AS INTEGER)) FROM {} GROUP BY tbl;", stat_table.quoted());
+    if (sqlite3_prepare_v2(DB, stat1_query.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+	if (auto tbl = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0))) {
+	  stat1[qualifiedName(stat_table.schema, tbl)] = sqlite3_column_int64(stmt, 1);
+	}
+      }
+    }
+    sqlite3_finalize(stmt);
+  }
+  for (auto& table : schema.tables) {
+    if (table.type != "table" || table.internal() || (!candidates.empty() && !candidates.count(table.name))) {
+      continue;
+    }
+    auto cached = cache.tables.find(table.name);
+    sqlite3_int64 min_rowid = 0, max_rowid = -1;
+    if (cached != cache.tables.end() && cached->second.row_count >= 0) {
+      rows[table.name] = { cached->second.row_count };
+    } else if (stat1.count(table.name)) {
+      rows[table.name] = { stat1[table.name] };
+    } else if (getRowidRange(DB, table.quoted(), min_rowid, max_rowid)) {
+      rows[table.name] = { max_rowid - min_rowid + 1, true };
+    } else if (queryInteger(DB, fmt::format("SELECT EXISTS (SELECT 1 FROM {});", table.quoted())) == 0) {
+      rows[table.name] = { 0 };
+    }
+  }
 #endif
+  return rows;
+}
 
-    std::string hashString;
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        hashString += fmt::format("{:02x}", hash[i]);
+// Assembles the translation prompt within a token budget, which also has
+// to hold the rest of the request (see requestOverhead). Appends to the
+// instructions and question (always included) the other parts in
+// order of priority: the schemas of tables relevant to the question, the
+// other schemas, the joins between them (foreign keys, indexes into
+// schema.foreign_keys), their indexes, and finally column profiles and
+// samples (all of them if they fit, else only those for relevant tables).
+// Anything that doesn't fit is left out, as are tables other than the
+// candidates, if any are given. Schemas are annotated with the row counts
+// given. The schema's text is referred to, not copied, so the prompt must
+// keep the snapshot alive.
+//
+// The parts that depend on the question (the joins, values matching it,
+// and the question itself) come last, so that prompts about the same
+// tables start with the same text, which providers can cache.
+static void assemblePrompt(ai::prompt& prompt, const SchemaSnapshot& schema, const SchemaSnapshot::Section& section,
+			   const std::set<std::string>& candidates, const std::set<std::string>& relevant,
+			   const std::map<std::string, RowCount>& row_counts, const std::vector<size_t>& joins, const json& profiles, const json& matches,
+			   std::string_view question, size_t budget, PromptStats& stats) {
+  size_t tokens = requestOverhead() + countTokens(prompt) + countTokens(question);
+  auto fits = [&](std::string_view text) {
+    auto cost = countTokens(text);
+    if (tokens + cost > budget) {
+      return false;
+    }
+    tokens += cost;
+    return true;
+  };
+  auto add = [&](std::string_view text, bool copy) {
+    if (!fits(text)) {
+      return false;
+    }
+    copy ? prompt.append(text) : prompt.append_ref(text);
+    return true;
+  };
+  fmt::memory_buffer joined;
+  std::string matched;
+
+  // Tables, relevant ones first; the prompt lists them in schema order.
+  add(section.header, false);
+  std::vector<bool> shown(schema.tables.size(), false);
+  std::vector<std::string> annotations(schema.tables.size());
+  for (size_t i = 0; i < schema.tables.size(); i++) {
+    auto rows = row_counts.find(schema.tables[i].name);
+    if (!section.tables[i].empty() && rows != row_counts.end()) {
+      annotations[i] = fmt::format(FMT_COMPILE(" -- {} rows\n"), approximateRows(rows->second));
+    }
+  }
+  for (auto relevant_pass : { true, false }) {
+    for (size_t i = 0; i < schema.tables.size(); i++) {
+      auto& text = section.tables[i];
+      auto& name = schema.tables[i].name;
+      if (text.empty() || (!candidates.empty() && !candidates.count(name)) || relevant.count(name) != relevant_pass) {
+	continue;
+      }
+      // The annotation replaces the table's newline.
+      auto cost = annotations[i].empty() ? countTokens(text) : countTokens(std::string_view(text).substr(0, text.size() - 1)) + countTokens(annotations[i]);
+      if (tokens + cost <= budget) {
+	tokens += cost;
+	shown[i] = true;
+      } else {
+	stats.tables_omitted++;
+      }
+    }
+  }
+  for (size_t i = 0; i < schema.tables.size(); i++) {
+    if (shown[i] && annotations[i].empty()) {
+      prompt.append_ref(section.tables[i]);
+    } else if (shown[i]) {
+      prompt.append_ref(std::string_view(section.tables[i]).substr(0, section.tables[i].size() - 1));
+      prompt.append(annotations[i]);
     }
+  }
+  std::set<std::string> shown_tables;
+  for (size_t i = 0; i < schema.tables.size(); i++) {
+    if (shown[i]) {
+      shown_tables.insert(schema.tables[i].name);
+    }
+  }
 
-    return hashString;
-}
+  // How to join the tables shown, one foreign key per line.
+  bool join_header = false;
+  for (auto k : joins) {
+    auto& key = schema.foreign_keys[k];
+    auto& table = schema.tables[key.table].name;
+    auto& parent = schema.tables[key.parent].name;
+    if (!shown_tables.count(table) || !shown_tables.count(parent)) {
+      continue;
+    }
+    fmt::memory_buffer condition;
+    for (size_t c = 0; c < key.columns.size(); c++) {
+      fmt::format_to(std::back_inserter(condition), FMT_COMPILE("{}{}.{} = {}.{}"), c ? " AND " : "", table, key.columns[c], parent, key.parent_columns[c]);
+    }
+    condition.push_back('\n');
+    if (!join_header) {
+      std::string_view header("Join the tables the question is about on:\n");
+      join_header = fits(header);
+      if (join_header) {
+	joined.append(header);
+      }
+    }
+    if (join_header && fits(std::string_view(condition.data(), condition.size()))) {
+      joined.append(condition);
+      stats.joins++;
+    }
+  }
 
-// SQLite callback function to retrieve query results
-int callback(void* data, int argc, char** argv, char** /* azColName */) {
-    std::list<std::string>& resultList = *static_cast<std::list<std::string>*>(data);
+  // Indexes on the tables shown.
+  bool index_header = false;
+  for (size_t i = 0; i < schema.indexes.size(); i++) {
+    if (!shown_tables.count(schema.indexes[i].tbl_name)) {
+      continue;
+    }
+    if (!index_header) {
+      index_header = add(section.index_header, false);
+    }
+    if (!index_header || !add(section.indexes[i], false)) {
+      stats.indexes_omitted++;
+    }
+  }
 
-    for (int i = 0; i < argc; i++) {
-        if (argv[i]) {
-            resultList.push_back(argv[i]);
-        }
+  // Profiles for the tables shown, or failing that, for the relevant ones.
+  if (!profiles.empty() || !matches.empty()) {
+    stats.profiles_omitted = true;
+    for (auto& keep : { shown_tables, relevant }) {
+      json kept = json::object();
+      for (auto& [table, columns] : profiles.items()) {
+	if (keep.count(table) && shown_tables.count(table)) {
+	  kept[table] = columns;
+	}
+      }
+      auto text = formatColumnProfiles(kept, matches, matched);
+      if (fits(text + matched)) {
+	prompt.append(text);
+	stats.profiles_omitted = kept.size() < profiles.size();
+	break;
+      }
+      matched.clear();
     }
+  }
 
-    return 0;
+  prompt.append(std::string_view(joined.data(), joined.size()));
+  prompt.append(matched);
+  prompt.append(question);
+  stats.tokens = tokens;
 }
 
-int lines_printed = 0;
-
-int print_em(void* data, int c_num, char** c_vals, char** c_names) {
-    for (int i = 0; i < c_num; i++) {
-      std::cout << (c_vals[i] ? c_vals[i] : "");
-      if ((i < c_num-1) && (c_num > 1)) {
-	std::cout << "|";
+static void loadEmbeddings(sqlite3* DB, TableEmbeddings& embeddings) {
+  embeddings.loaded = true;
+  auto load_query = fmt::format("SELECT tbl, description, vector FROM {} WHERE model = {};", embeddingTable, quoteString(EMBEDDING_MODEL));
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(DB, load_query.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto tbl = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+      auto description = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+      auto vector = static_cast<const float*>(sqlite3_column_blob(stmt, 2));
+      if (tbl && description && vector) {
+	auto& entry = embeddings.tables[tbl];
+	entry.description = description;
+	entry.vector.assign(vector, vector + sqlite3_column_bytes(stmt, 2) / sizeof(float));
       }
     }
-    std::cout << std::endl;
-    return 0;
+  }
+  // The table won't exist until the first embeddings have been saved.
+  sqlite3_finalize(stmt);
 }
 
-std::string query_result;
+// Writes updated embeddings back to the shadow table; failures (e.g., a
+// read-only database) just mean we'll embed those tables again next session.
+static void saveEmbeddings(sqlite3* DB, const TableEmbeddings& embeddings, const std::vector<std::string>& updated) {
+  if (updated.empty() || sqlite3_db_readonly(DB, "main") != 0) {
+    return;
+  }
+  auto create_query = fmt::format("CREATE TABLE IF NOT EXISTS {}(tbl TEXT PRIMARY KEY, model TEXT NOT NULL, description TEXT NOT NULL, vector BLOB NOT NULL);", embeddingTable);
+  if (sqlite3_exec(DB, "SAVEPOINT sqlwrite_embeddings;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    return;
+  }
+  sqlite3_stmt* stmt = nullptr;
+  auto insert_query = fmt::format("INSERT OR REPLACE INTO {}(tbl, model, description, vector) VALUES (?, {}, ?, ?);", embeddingTable, quoteString(EMBEDDING_MODEL));
+  auto rc = sqlite3_exec(DB, create_query.c_str(), nullptr, nullptr, nullptr);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(DB, insert_query.c_str(), -1, &stmt, nullptr);
+  }
+  for (auto it = updated.begin(); rc == SQLITE_OK && it != updated.end(); it++) {
+    auto& entry = embeddings.tables.at(*it);
+    sqlite3_bind_text(stmt, 1, it->c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, entry.description.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_blob(stmt, 3, entry.vector.data(), entry.vector.size() * sizeof(float), SQLITE_TRANSIENT);
+    rc = (sqlite3_step(stmt) == SQLITE_DONE) ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(DB, "ROLLBACK TO sqlwrite_embeddings;", nullptr, nullptr, nullptr);
+  }
+  sqlite3_exec(DB, "RELEASE sqlwrite_embeddings;", nullptr, nullptr, nullptr);
+}
 
-int count_em(void* data, int c_num, char** c_vals, char** c_names) {
-  for (int i = 0; i < c_num; i++) {
-    query_result += (c_vals[i] ? c_vals[i] : "");
-    if ((i < c_num - 1) && (c_num > 1)) {
-      query_result += "|";
+// Embeds each input, with one request per batch, all in flight at once;
+// returns nothing if any request fails.
+static std::vector<std::vector<float>> embed(const std::vector<std::string>& inputs) {
+  const size_t batch_size = 512;
+  std::vector<std::vector<float>> vectors(inputs.size());
+  // Every batch is requested at once; the bodies must outlive the requests.
+  std::vector<std::string> bodies;
+  for (size_t start = 0; start < inputs.size(); start += batch_size) {
+    auto end = std::min(inputs.size(), start + batch_size);
+    bodies.push_back(json({
+	  { "model", EMBEDDING_MODEL },
+	  { "input", std::vector<std::string>(inputs.begin() + start, inputs.begin() + end) }
+	}).dump(-1, ' ', false, json::error_handler_t::replace));
+  }
+  std::vector<std::future<json>> responses;
+  for (auto& body : bodies) {
+    responses.push_back(openai::instance().postAsync("embeddings", body));
+  }
+  bool failed = false;
+  for (size_t batch = 0; batch < responses.size(); batch++) {
+    try {
+      auto response = responses[batch].get();
+      auto start = batch * batch_size;
+      auto end = std::min(inputs.size(), start + batch_size);
+      for (auto& item : response["data"]) {
+	auto index = start + item["index"].get<size_t>();
+	if (index < end) {
+	  vectors[index] = item["embedding"].get<std::vector<float>>();
+	}
+      }
+    } catch (const std::exception& e) {
+      failed = true;
     }
   }
-  query_result += "\n";
-  lines_printed++;
-  return 0;
+  if (failed) {
+    return {};
+  }
+  return vectors;
 }
 
-#include <iostream>
-#include <string>
-
-std::string removeEscapedCharacters(const std::string& s) {
-    std::string result = s;
-    std::size_t pos = result.find("\\");
-    while (pos != std::string::npos) {
-        if (result[pos+1] == 'n') { // Check if escaped newline
-            result.replace(pos, 2, " "); // Replace with single space
-        } else if (result[pos+1] == '"') { // Check if escaped quote
-            result.erase(pos, 1); // Remove backslash
-        }
-        pos = result.find("\\", pos+1); // Find next escaped character
+// Makes sure every table's description has an up-to-date embedding. Only
+// tables whose compact description changed are embedded again, and that
+// is only checked when the schema version does.
+static void updateEmbeddings(sqlite3* DB, TableEmbeddings& embeddings, const SchemaSnapshot& schema) {
+  if (!embeddings.loaded) {
+    loadEmbeddings(DB, embeddings);
+  }
+  if (embeddings.schema_version == schema.schema_version) {
+    return;
+  }
+  std::vector<std::string> names, descriptions;
+  for (size_t i = 0; i < schema.tables.size(); i++) {
+    auto& description = schema.compact.tables[i];
+    auto entry = embeddings.tables.find(schema.tables[i].name);
+    if (!description.empty() && (entry == embeddings.tables.end() || entry->second.description != description)) {
+      names.push_back(schema.tables[i].name);
+      descriptions.push_back(description);
     }
-    return result;
+  }
+  auto vectors = embed(descriptions);
+  if (vectors.size() != names.size()) {
+    // Try again on the next ask.
+    return;
+  }
+  for (size_t i = 0; i < names.size(); i++) {
+    embeddings.tables[names[i]] = { std::move(descriptions[i]), std::move(vectors[i]) };
+  }
+  embeddings.embedded += names.size();
+  saveEmbeddings(DB, embeddings, names);
+  embeddings.schema_version = schema.schema_version;
 }
 
+static double cosineSimilarity(const std::vector<float>& a, const std::vector<float>& b) {
+  double dot = 0, norm_a = 0, norm_b = 0;
+  for (size_t i = 0; i < std::min(a.size(), b.size()); i++) {
+    dot += a[i] * b[i];
+    norm_a += a[i] * a[i];
+    norm_b += b[i] * b[i];
+  }
+  return (norm_a > 0 && norm_b > 0) ? dot / std::sqrt(norm_a * norm_b) : 0;
+}
 
-std::string removeEscapedNewlines(const std::string& s) {
-    std::string result = s;
-    std::size_t pos = result.find("\\n");
-    while (pos != std::string::npos) {
-      result.replace(pos, 2, " ");
-        pos = result.find("\\n", pos);
+// For schemas with at least EMBEDDING_RETRIEVAL_MIN_TABLES tables, returns
+// the EMBEDDING_TOP_K tables whose descriptions are most similar to the
+// question, which are then the only ones sampled and shown to the model.
+// Returns nothing (meaning every table) for smaller schemas, or if the
+// embeddings can't be had.
+static std::set<std::string> retrieveTables(sqlite3* DB, TableEmbeddings& embeddings, const SchemaSnapshot& schema, const std::string& question) {
+  std::set<std::string> retrieved;
+  embeddings.retrieved = 0;
+#if EMBEDDING_RETRIEVAL_MIN_TABLES
+  if (schema.tables.size() < EMBEDDING_RETRIEVAL_MIN_TABLES) {
+    return retrieved;
+  }
+  updateEmbeddings(DB, embeddings, schema);
+  // Without every table's embedding, don't spend a request on the question's.
+  if (embeddings.schema_version != schema.schema_version) {
+    return retrieved;
+  }
+  auto question_vector = embed({ question });
+  if (question_vector.size() != 1) {
+    return retrieved;
+  }
+  std::vector<std::pair<double, std::string>> ranked;
+  for (auto& table : schema.tables) {
+    auto entry = embeddings.tables.find(table.name);
+    if (entry != embeddings.tables.end()) {
+      ranked.emplace_back(cosineSimilarity(question_vector[0], entry->second.vector), table.name);
     }
-    return result;
+  }
+  auto k = std::min<size_t>(EMBEDDING_TOP_K, ranked.size());
+  std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end(), std::greater<>());
+  for (size_t i = 0; i < k; i++) {
+    retrieved.insert(ranked[i].second);
+  }
+#endif
+  embeddings.retrieved = retrieved.size();
+  return retrieved;
 }
 
+// The tables to show the model: the candidates the question mentions by
+// name or by value, the tables those reference or are referenced by, and
+// the tables on the join paths between them (returned in joins), so that
+// the joins can be written. All the candidates (none meaning every table)
+// if it mentions none of them.
+static std::set<std::string> pruneSchema(const SchemaSnapshot& schema, const std::set<std::string>& candidates, const std::string& question,
+					 const json& matches, std::vector<size_t>& joins, PromptStats& stats) {
+  auto candidate = [&](const std::string& table) { return candidates.empty() || candidates.count(table) > 0; };
+  std::set<std::string> mentioned;
+  for (auto& table : mentionedTables(schema, question)) {
+    if (candidate(table)) {
+      mentioned.insert(table);
+    }
+  }
+  for (auto& match : matches) {
+    mentioned.insert(match["table"].get<std::string>());
+  }
+  stats.tables_mentioned = mentioned.size();
+  if (mentioned.empty()) {
+    return candidates;
+  }
+  auto shown = mentioned;
+  for (auto& key : schema.foreign_keys) {
+    auto& table = schema.tables[key.table].name;
+    auto& parent = schema.tables[key.parent].name;
+    if (mentioned.count(table) && candidate(parent)) {
+      shown.insert(parent);
+    }
+    if (mentioned.count(parent) && candidate(table)) {
+      shown.insert(table);
+    }
+  }
+#if JOIN_PATH_HINTS
+  // The joins matter more than the candidates: a path may go through any table.
+  joins = joinPaths(schema, mentioned);
+  addJoinedTables(schema, joins, shown);
+#endif
+  return shown;
+}
 
-nlohmann::json sampleSQLiteDistinct(sqlite3* DB, int N) {
-    nlohmann::json result;
-
-    // Query for all tables in the database
-    std::string tables_query = "SELECT name FROM sqlite_master WHERE type='table';";
-    sqlite3_stmt* stmt;
-    sqlite3_prepare_v2(DB, tables_query.c_str(), -1, &stmt, 0);
-
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        std::string table_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-
-        // Query for column names in current table
-        std::string columns_query = fmt::format("PRAGMA table_info({});", table_name);
-        sqlite3_stmt* column_stmt;
-        sqlite3_prepare_v2(DB, columns_query.c_str(), -1, &column_stmt, 0);
-
-        while (sqlite3_step(column_stmt) == SQLITE_ROW) {
-            std::string column_name = reinterpret_cast<const char*>(sqlite3_column_text(column_stmt, 1));
-
-	    // Only sample from text types.
-	    auto column_type = sqlite3_column_type(column_stmt, 1);
-	    if (column_type != SQLITE_TEXT) {
-	      continue;
-	    }
-	    
-            // Query for N random distinct values from current column
-            std::string values_query = fmt::format("SELECT DISTINCT {} FROM {} ORDER BY RANDOM() LIMIT {};", column_name, table_name, N);
-            sqlite3_stmt* values_stmt;
-            sqlite3_prepare_v2(DB, values_query.c_str(), -1, &values_stmt, 0);
-
-	    std::vector<std::string> column_values;
-	    while (sqlite3_step(values_stmt) == SQLITE_ROW) {
-	      const char* data = reinterpret_cast<const char*>(sqlite3_column_text(values_stmt, 0));
-	      if (data != nullptr) {
-		// Only include non-null, non-numeric data.
-		// To decide if something is numeric, we try to convert it to an int or a float; if this succeeds, we skip it.
-		// We also limit the size of any text fields we include.
-		try {
-		  auto f = std::stof(data);
-		} catch (...) {
-		  try {
-		    auto i = std::stoi(data);
-		  } catch (...) {
-		    // Now, only include text fields below a certain length. This is a magic number.
-		    std::string truncated_data(data, std::min<size_t>(10, std::strlen(data)));
-		    if (DEBUG) {
-		      std::cerr << "NON NUMERIC: " << truncated_data << std::endl;
-		    }
-		    column_values.push_back(truncated_data.c_str());
-		  }
-		}
-	      }
-	    }
-
-	    if (column_values.size() > 1) {
-	      result[table_name][column_name] = column_values;
-	    }
-            sqlite3_finalize(values_stmt);
-        }
-        sqlite3_finalize(column_stmt);
+// Asks the schema-linking model which of the candidate tables (all, if
+// none are given) a question needs, showing it only table and column
+// names. Returns the tables it names, or nothing if it fails.
+static std::set<std::string> linkSchema(const SchemaSnapshot& schema, const std::set<std::string>& candidates, const std::string& question) {
+  std::string tables;
+  for (auto& table : schema.tables) {
+    if (table.internal() || (!candidates.empty() && !candidates.count(table.name))) {
+      continue;
     }
-    sqlite3_finalize(stmt);
+    std::string columns;
+    for (auto& column : table.columns) {
+      columns += (columns.empty() ? "" : ", ") + column.name;
+    }
+    tables += fmt::format("{}({})\n", table.name, columns);
+  }
+  auto link_prompt = fmt::format("Given a database with the following tables and columns, list the tables needed to write a SQL query that answers this question: '{}'. Include the tables needed to join them. Produce a JSON object with the table names as a list in the field \"Tables\". Only produce output that can be parsed as JSON.\n\nTables:\n{}", question, tables);
 
-    return result;
+  std::set<std::string> linked;
+  try {
+    ai::aistream ai ({ .maxRetries = MAX_RETRIES_VALIDITY, .debug = DEBUG });
+    ai << SCHEMA_LINKING_MODEL;
+    ai << json({
+	{ "role", "assistant" },
+	  { "content", "You are a programming assistant who is an expert in relational databases. You ONLY respond with JSON objects." }
+      });
+    ai << json({
+	{ "role", "user" },
+	  { "content", link_prompt.c_str() }
+      });
+    ai << ai::validator([](const json& j) {
+      // Enforce list output
+      volatile auto list = j["Tables"].get<std::list<std::string>>();
+      return true;
+    });
+    json json_response;
+    ai >> json_response;
+    for (auto& name : json_response["Tables"]) {
+      // Ignore anything it made up.
+      if (auto table = schema.find(name.get<std::string>())) {
+	linked.insert(table->name);
+      }
+    }
+  } catch (const std::exception& e) {
+    return {};
+  }
+  return linked;
 }
 
-
 // Function to rephrase a query using ChatGPT
 std::list<std::string> rephraseQuery(ai::aistream& ai, const std::string& query, int n = 10)
 {
@@ -279,85 +2161,102 @@ std::list<std::string> rephraseQuery(ai::aistream& ai, const std::string& query,
 
 static bool translateQuery(ai::aistream& ai,
 			   sqlite3_context *ctx,
-			   int argc,
+			   [[maybe_unused]] int argc,
 			   const char * query,
 			   json& json_response,
-			   std::string& sql_translation)
+			   std::string& sql_translation,
+			   Execution& executed)
 {
   
   /* ---- build a query prompt to translate from natural language to SQL. ---- */
   // The prompt consists of all table names and schemas, plus any indexes, along with directions.
   
-  // Print all loaded database schemas
   sqlite3 *db = sqlite3_context_db_handle(ctx);
-  sqlite3_stmt *stmt;
+  auto& state = *static_cast<ConnectionState*>(sqlite3_user_data(ctx));
 
   // auto nl_to_sql = fmt::format("Given a database with the following tables, schemas, and indexes, write a SQL query in SQLite's SQL dialect that answers this question or produces the desired report: '{}'. Produce a JSON object with the SQL query as a field \"SQL\". Offer a list of suggestions as SQL commands to create indexes that would improve query performance in a field \"Indexing\". Do so only if those indexes are not already given in 'Existing indexes'. Only produce output that can be parsed as JSON.\n\nSchemas:\n", query);
   
-  auto nl_to_sql = fmt::format("Given a database with the following tables, schemas, indexes, and samples for each column, write a valid SQL query in SQLite's SQL dialect that answers this question or produces the desired report: '{}'. Produce a JSON object with the SQL query as a field \"SQL\". The produced query must only reference columns listed in the schemas. Offer a list of suggestions as SQL commands to create indexes that would improve query performance in a field \"Indexing\". Do so only if those indexes are not already given in 'Existing indexes'. Refer to the samples to form the query, taking into account format and capitalization. Only produce output that can be parsed as JSON.\n", query);
-  
-  sqlite3_prepare_v2(db, "SELECT name, sql FROM sqlite_master WHERE type='table' OR type='view'", -1, &stmt, NULL);
+  // The instructions don't mention the question itself, which comes last, so every prompt starts the same way.
+  auto nl_to_sql = std::make_shared<ai::prompt>();
+  nl_to_sql->append_ref("Given a database with the following tables, schemas, indexes, and samples for each column, write a valid SQL query in SQLite's SQL dialect that answers the question given at the end or produces the desired report. Produce a JSON object with the SQL query as a field \"SQL\". The produced query must only reference columns listed in the schemas. Use the row counts and indexed columns shown to keep the query efficient: prefer conditions on indexed columns, and avoid correlated subqueries over large tables. Offer a list of suggestions as SQL commands to create indexes that would improve query performance in a field \"Indexing\". Do so only if those indexes are not already given in 'Existing indexes'. Refer to the samples to form the query, taking into account format and capitalization. Only produce output that can be parsed as JSON.\n");
+  auto question = fmt::format(FMT_COMPILE("\nThe question or desired report: '{}'\n"), query);
 
-  auto total_tables = 0;
-
-  // Print the schema for each table.
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    const char *name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-    const char *sql = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-    // Strip any quote characters.
-    std::string sql_str(sql);
-    sql_str.erase(std::remove(sql_str.begin(), sql_str.end(), '\''), sql_str.end());
-    sql_str.erase(std::remove(sql_str.begin(), sql_str.end(), '\"'), sql_str.end());
-    sql_str.erase(std::remove(sql_str.begin(), sql_str.end(), '`'), sql_str.end());
-    nl_to_sql += fmt::format("Schema for {}: {}\n", name, sql_str.c_str());
-    total_tables++;
-  }
+  // The schema and index section only changes when the schema does.
+  auto snapshot = getSchemaSnapshot(db, state);
+  auto& schema = *snapshot;
 
   // Fail gracefully if no databases are present.
-  if (total_tables == 0) {
+  if (schema.tables.empty()) {
     std::cout << prompt.c_str() << "you need to load a table first." << std::endl;
-    sqlite3_finalize(stmt);
     return false;
   }
 
-  // Add indexes, if any.
-#if INCLUDE_INDEXES
-  auto printed_index_header = false;
-  sqlite3_prepare_v2(db, "SELECT type, name, tbl_name, sql FROM sqlite_master WHERE type='index'", -1, &stmt, NULL);
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    try {
-      const char *tbl_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-      const char *sql = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-      if (!printed_index_header && tbl_name && sql) {
-	nl_to_sql += "\n\nExisting indexes:\n";
-	printed_index_header = true;
-      }
-      nl_to_sql += fmt::format("Index for {}: {}\n", tbl_name, sql);
-    } catch (fmt::v9::format_error& fe) {
-      // Ignore indices where the query response is null, which could get us here.
+  state.prompt = {};
+
+  // In very large schemas, only consider the tables most like the question.
+  auto candidates = retrieveTables(db, state.embeddings, schema, query);
+
+  // In huge schemas, have a faster model pick the tables from their names first.
+  bool linked = false;
+  if (state.config.schema_linking_min_tables > 0 && schema.tables.size() >= static_cast<size_t>(state.config.schema_linking_min_tables)) {
+    auto tables = linkSchema(schema, candidates, query);
+    state.prompt.tables_linked = tables.size();
+    if (!tables.empty()) {
+      candidates = std::move(tables);
+      linked = true;
     }
   }
-#endif
-  
+
   // Randomly sample values from the database.
+  json profiles = json::object(), matches = json::array();
 #if INCLUDE_RANDOM_SAMPLES
-  auto sample_value_json = sampleSQLiteDistinct(db, 5); // magic number FIXME
-  nl_to_sql += fmt::format("\nSample values for columns: {}\n", sample_value_json.dump(-1, ' ', false, json::error_handler_t::replace));
+  profiles = sampleSQLiteDistinct(db, state, schema, candidates, query, 5, matches); // magic number FIXME
 #endif
+
+  std::vector<size_t> joins;
+  if (linked) {
+    // The linked tables are already the ones the question needs.
+#if JOIN_PATH_HINTS
+    joins = joinPaths(schema, candidates);
+    addJoinedTables(schema, joins, candidates);
+#endif
+  } else {
+#if SCHEMA_PRUNING
+    candidates = pruneSchema(schema, candidates, query, matches, joins, state.prompt);
+#endif
+  }
+
+  nl_to_sql->keep(snapshot);
+  auto& section = schemaSection(schema, state.config.schema_format, candidates);
+  state.prompt.schema_format = &section == &schema.raw ? "raw" : "compact";
+  state.prompt.budget = promptBudget(state.config.token_budget);
+  assemblePrompt(*nl_to_sql, schema, section,
+		 candidates, state.samples.relevant, estimateRowCounts(db, schema, state.samples, candidates), joins, profiles, matches, question, state.prompt.budget, state.prompt);
   
   /* ----  translate the natural language query to SQL and execute it (and request indexes) ---- */
   
   ai << json({
       { "role", "assistant" },
-	{ "content", "You are a programming assistant who is an expert in generating SQL queries from natural language. You ONLY respond with JSON objects." }
+	{ "content", translationInstructions }
     });
 
-  ai << json({
-      { "role", "user" },
-	{ "content", nl_to_sql.c_str() }
-    });
+  ai << ai::message("user", nl_to_sql);
   
-  ai << ai::validator([&](const json& j) {
+  // Kept for retries (see real_ask_command), so they mustn't refer to locals.
+#if STREAM_RESPONSES
+  // Runs the query while the rest of the response streams in; the
+  // validator then finds it has already run. Queries that write wait until
+  // the whole response has validated, since it may not.
+  ai << ai::on_field([&executed, db](const std::string& key, const json& value) {
+    if (key == "SQL" && value.is_string()) {
+      auto query = removeEscapedCharacters(removeEscapedNewlines(value.get<std::string>()));
+      if (readOnly(db, query)) {
+	executed.run(db, query);
+      }
+    }
+  });
+#endif
+  ai << ai::validator([&sql_translation, &executed, db](const json& j) {
     try {
       // Ensure we got a SQL response.
       sql_translation = j["SQL"].get<std::string>();
@@ -372,42 +2271,76 @@ static bool translateQuery(ai::aistream& ai,
     sql_translation = removeEscapedNewlines(sql_translation);
     sql_translation = removeEscapedCharacters(sql_translation);
     
-    // Send the query to the database.
-    auto rc = sqlite3_exec(db, sql_translation.c_str(), [](void*, int, char**, char**) {return 0;}, nullptr, nullptr);
-    if (rc != SQLITE_OK) {
+    // Send the query to the database (unless it ran as it streamed in).
+    executed.run(db, sql_translation);
+    if (executed.rc != SQLITE_OK) {
       if (DEBUG) {
-	std::cerr << fmt::format("{}Error executing SQL statement \"{}\":\n           {}\n", prompt.c_str(), sql_translation.c_str(), sqlite3_errmsg(db));
+	std::cerr << fmt::format("{}Error executing SQL statement \"{}\":\n           {}\n", prompt.c_str(), sql_translation.c_str(), executed.error);
       }
-      throw ai::exception(ai::exception_value::OTHER, fmt::format("The previous query (\"{}\") caused SQLite to fail with this error: {}.", std::string(sql_translation.c_str()), std::string(sqlite3_errmsg(db))));
+      throw ai::exception(ai::exception_value::OTHER, fmt::format("The previous query (\"{}\") caused SQLite to fail with this error: {}.", std::string(sql_translation.c_str()), executed.error));
       // sqlite3_finalize(stmt);
     }
-    return rc == SQLITE_OK;
+    return executed.rc == SQLITE_OK;
   });
 
-  json json_result;
   try {
-    ai >> json_result;
+    ai >> json_response;
   } catch (...) {
-    json_result = json({ {"SQL", ""}, {"Indexing", {} } });
+    json_response = json({ {"SQL", ""}, {"Indexing", {} } });
     return false;
   }
 
   return true;
 }
 
+#if TRANSLATE_QUERY_BACK_TO_NL
+// The translation of the final query back to natural language. It is
+// requested in a conversation of its own as soon as the query is accepted,
+// so it runs concurrently with printing the query's results. (Starting it
+// for every candidate would spend a request on each one a retry replaces.)
+struct BackTranslation {
+  std::unique_ptr<ai::aistream> stream;
+  std::future<json> result;
+
+  void start(const std::string& query) {
+    stream = std::make_unique<ai::aistream>(ai::aistream::params { .maxRetries = MAX_RETRIES_VALIDITY, .debug = DEBUG });
+    *stream << translationModel;
+    *stream << json({
+	{ "role", "assistant" },
+	{ "content", "You are a programming assistant who is an expert in translating SQL queries to natural language. You ONLY respond with JSON objects." }
+      });
+    auto translate_to_natural_language_query = fmt::format("Given the following SQL query, convert it into natural language: '{}'. Produce a JSON object with the translation as a field \"Translation\". Only produce output that can be parsed as JSON.\n", query);
+    *stream << json({
+	{ "role", "user" },
+	{ "content", translate_to_natural_language_query.c_str() }
+      });
+    *stream << ai::validator([](const json& json_result) {
+      try {
+	volatile auto translation = json_result["Translation"].get<std::string>();
+	return true;
+      } catch (std::exception& e) {
+	return false;
+      }
+    });
+    result = stream->async();
+  }
+};
+#endif
+
 static void real_ask_command(sqlite3_context *ctx, int argc, const char * query) { //  sqlite3_value **argv) {
 
   sqlite3 *db = sqlite3_context_db_handle(ctx);
   json json_result;
   std::string query_str (query);
   std::string sql_translation;
+  Execution executed;
   
   ai::aistream ai ({ .maxRetries = MAX_RETRIES_VALIDITY , .debug = DEBUG });
   // ai::aistream ai ({ .maxRetries = 3 });
 
   // ai << ai::config::GPT_3_5;
   // Switch to GPT 4
-  ai << ai::config::GPT_4_0;
+  ai << translationModel;
 
 #if RETRY_ON_EMPTY_RESULTS
   int retriesRemaining = MAX_RETRIES_ON_RESULTS;
@@ -415,26 +2348,22 @@ static void real_ask_command(sqlite3_context *ctx, int argc, const char * query)
   int retriesRemaining = 1;
 #endif
   
-  bool updatedQuery = false;
-  
+  bool r = translateQuery(ai, ctx, argc, query_str.c_str(), json_result, sql_translation, executed);
+  if (!r) {
+    std::cerr << prompt.c_str() << "Unfortunately, we were not able to successfully translate that query." << std::endl;
+    return;
+  }
   while (retriesRemaining) {
-    bool r = translateQuery(ai, ctx, argc, query_str.c_str(), json_result, sql_translation);
-    if (!r) {
-      std::cerr << prompt.c_str() << "Unfortunately, we were not able to successfully translate that query." << std::endl;
-      return;
-    }
-  
-    // Send the query to the database to count the number of lines.
-    lines_printed = 0;
-    query_result = "";
-    auto rc = sqlite3_exec(db, sql_translation.c_str(), count_em, nullptr, nullptr);
+    // Send the query to the database to count the number of lines (it
+    // has usually run already, while validating it).
+    executed.run(db, sql_translation);
 
     //std::cout << "Translated query: " << sql_translation << std::endl;
-    //std::cout << "Query result: " << query_result << std::endl;
+    //std::cout << "Query result: " << executed.result << std::endl;
     
-    if ((lines_printed > 0) && (query_result != "0\n")) {
+    if ((executed.lines > 0) && (executed.result != "0\n")) {
 #if RETRY_ON_TOO_MANY_RESULTS
-      if (lines_printed < LARGE_QUERY_THRESHOLD) {
+      if (executed.lines < LARGE_QUERY_THRESHOLD) {
 	// We got at least one result and not more than N - exit the retry loop.
 	break;
       }
@@ -444,22 +2373,46 @@ static void real_ask_command(sqlite3_context *ctx, int argc, const char * query)
     }
     // Retry if we got an empty set of results.
     retriesRemaining--;
+    if (!retriesRemaining) {
+      break;
+    }
 
-    if (!updatedQuery) {
-      if (lines_printed == 0) {
-	query_str += " The resulting SQL query should allow for fuzzy matches, including relaxing inequalities or making queries case-insensitive, in order to get the query to produce at least one result.";
-	updatedQuery = true;
-      }
-#if RETRY_ON_TOO_MANY_RESULTS
-      else if (lines_printed > LARGE_QUERY_THRESHOLD) {
-	query_str += fmt::format(" The resulting SQL query should probably be constrained, including sharpening inequalities, using INTERSECT or DISTINCT, to reduce the number of results.");
-	updatedQuery = true;
-      }
-#endif
+    // Only say what was wrong with the result: the rest of the
+    // conversation stays as it was, so each request starts with the
+    // previous one (which providers can cache) and adds just a few tokens.
+    std::string delta;
+    if (executed.lines == 0 || executed.result == "0\n") {
+      delta = "The query produced no results. Rewrite it to allow for fuzzy matches, including relaxing inequalities or making comparisons case-insensitive, so that it produces at least one result.";
+    } else {
+      delta = fmt::format("The query produced {} rows, too many to be a useful answer. Rewrite it to be more constrained, including sharpening inequalities, using INTERSECT or DISTINCT, to reduce the number of results.", executed.lines);
+    }
+    auto previous = sql_translation;
+    ai << json({
+	{ "role", "assistant" },
+	{ "content", ai.response() }
+      });
+    ai << json({
+	{ "role", "user" },
+	{ "content", delta }
+      });
+    // Parse into a candidate, so that giving up (the follow-ups didn't
+    // parse or validate) keeps both the last query that worked and its
+    // indexing suggestions.
+    json candidate;
+    try {
+      ai >> candidate;
+    } catch (...) {
+      sql_translation = previous;
+      break;
     }
+    json_result = std::move(candidate);
   }
+#if TRANSLATE_QUERY_BACK_TO_NL
+  BackTranslation back;
+  back.start(sql_translation);
+#endif
   // Actually print the results of the final query.
-  auto rc = sqlite3_exec(db, sql_translation.c_str(), print_em, nullptr, nullptr);
+  sqlite3_exec(db, sql_translation.c_str(), print_em, nullptr, nullptr);
   
   // should be cout FIXME
   std::cerr << fmt::format("{}translation to SQL:\n{}", prompt.c_str(), prefaceWithPrompt(sql_translation, prompt).c_str());
@@ -475,29 +2428,12 @@ static void real_ask_command(sqlite3_context *ctx, int argc, const char * query)
 
   /* ----  translate the SQL query back to natural language ---- */
 #if TRANSLATE_QUERY_BACK_TO_NL
-  ai.reset();
-  ai << json({
-      { "role", "assistant" },
-	{ "content", "You are a programming assistant who is an expert in translating SQL queries to natural language. You ONLY respond with JSON objects." }
-    });
-
-  auto translate_to_natural_language_query = fmt::format("Given the following SQL query, convert it into natural language: '{}'. Produce a JSON object with the translation as a field \"Translation\". Only produce output that can be parsed as JSON.\n", sql_translation);
-  ai << json({
-      { "role", "user" },
-      { "content", translate_to_natural_language_query.c_str() }
-    });
-  std::string translation;
-  ai << ai::validator([&](const json& json_result){
-    try {
-      translation = json_result["Translation"].get<std::string>();
-      return true;
-    } catch (std::exception& e) {
-      return false;
-    }
-  });
-  ai >> json_result;
-  //  auto translation = json_result["Translation"].get<std::string>();
-  std::cout << fmt::format("{}translation back to natural language:\n{}", prompt.c_str(), prefaceWithPrompt(translation, prompt).c_str());
+  try {
+    auto translation = back.result.get()["Translation"].get<std::string>();
+    std::cout << fmt::format("{}translation back to natural language:\n{}", prompt.c_str(), prefaceWithPrompt(translation, prompt).c_str());
+  } catch (...) {
+    // Leave it out.
+  }
 #endif
 
  
@@ -513,7 +2449,7 @@ static void real_ask_command(sqlite3_context *ctx, int argc, const char * query)
     i++;
   }
   std::cerr << "Trying " << values[0] << std::endl;
-  auto translated = translateQuery(ai, ctx, 1, values[0], json_result, sql_translation);
+  auto translated = translateQuery(ai, ctx, 1, values[0], json_result, sql_translation, executed);
   std::cout << "Done: translated = " << translated << std::endl;
   // Cleanup allocated values
   delete [] values;
@@ -539,6 +2475,112 @@ static void sqlwrite_command(sqlite3_context *ctx, int argc, sqlite3_value **arg
 }
 
 
+// Reports internal counters as a JSON object, e.g. "select sqlwrite_stats();".
+static void sqlwrite_stats_command(sqlite3_context *ctx, int, sqlite3_value **) {
+  auto& state = *static_cast<ConnectionState*>(sqlite3_user_data(ctx));
+  json stats = {
+    { "schema_cache", {
+	{ "hits", state.schema_cache.hits },
+	{ "misses", state.schema_cache.misses },
+	{ "schema_version", state.schemas.count("main") ? state.schemas.at("main").schema_version : -1 },
+	{ "schemas", [&]() {
+	    json versions = json::object();
+	    for (auto& [name, part] : state.schemas) {
+	      versions[name] = part.schema_version;
+	    }
+	    return versions;
+	  }() }
+      } },
+    // Estimated prompt tokens for the schema in each format.
+    { "schema", {
+	{ "format", state.config.schema_format },
+	{ "raw_tokens", state.schema ? countTokens(state.schema->raw.text()) : 0 },
+	{ "compact_tokens", state.schema ? countTokens(state.schema->compact.text()) : 0 },
+	{ "tokenizer", ai::tokenizer::forModel(translationModel).exact() ? ai::tokenizer::forModel(translationModel).encoding() : "estimate" }
+      } },
+    { "retrieval", {
+	{ "tables_embedded", state.embeddings.embedded },
+	{ "tables_retrieved", state.embeddings.retrieved },
+	{ "tables_mentioned", state.prompt.tables_mentioned },
+	{ "tables_linked", state.prompt.tables_linked }
+      } },
+    { "prompt", {
+	{ "tokens", state.prompt.tokens },
+	{ "budget", state.config.token_budget },
+	{ "effective_budget", state.prompt.budget },
+	{ "tables_omitted", state.prompt.tables_omitted },
+	{ "joins", state.prompt.joins },
+	{ "indexes_omitted", state.prompt.indexes_omitted },
+	{ "profiles_omitted", state.prompt.profiles_omitted },
+	{ "schema_format", state.prompt.schema_format }
+      } },
+    { "sample_cache", {
+	{ "hits", state.samples.hits },
+	{ "misses", state.samples.misses },
+	{ "cut_short", state.samples.cut_short },
+	{ "threads", state.samples.threads }
+      } }
+  };
+  auto str = stats.dump();
+  sqlite3_result_text(ctx, str.c_str(), -1, SQLITE_TRANSIENT);
+}
+
+
+// sqlwrite_config(key) returns a setting; sqlwrite_config(key, value) changes it.
+static void sqlwrite_config_command(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+  auto& state = *static_cast<ConnectionState*>(sqlite3_user_data(ctx));
+  if (argc < 1 || argc > 2) {
+    sqlite3_result_error(ctx, "sqlwrite_config() takes a setting name and, optionally, a new value.", -1);
+    return;
+  }
+  auto key = reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+  if (key && strcmp(key, "schema_format") == 0) {
+    if (argc == 2) {
+      auto value = reinterpret_cast<const char*>(sqlite3_value_text(argv[1]));
+      if (!value || (strcmp(value, "auto") != 0 && strcmp(value, "raw") != 0 && strcmp(value, "compact") != 0)) {
+	sqlite3_result_error(ctx, "schema_format must be 'auto', 'raw', or 'compact'.", -1);
+	return;
+      }
+      state.config.schema_format = value;
+    }
+    sqlite3_result_text(ctx, state.config.schema_format.c_str(), -1, SQLITE_TRANSIENT);
+    return;
+  }
+  if (key && strcmp(key, "token_budget") == 0) {
+    if (argc == 2) {
+      if (sqlite3_value_numeric_type(argv[1]) != SQLITE_INTEGER || sqlite3_value_int64(argv[1]) <= 0) {
+	sqlite3_result_error(ctx, "token_budget must be a positive integer.", -1);
+	return;
+      }
+      state.config.token_budget = sqlite3_value_int64(argv[1]);
+    }
+    sqlite3_result_int64(ctx, state.config.token_budget);
+    return;
+  }
+  if (key && strcmp(key, "schema_linking_min_tables") == 0) {
+    if (argc == 2) {
+      if (sqlite3_value_numeric_type(argv[1]) != SQLITE_INTEGER || sqlite3_value_int64(argv[1]) < 0) {
+	sqlite3_result_error(ctx, "schema_linking_min_tables must be a non-negative integer (0 to disable).", -1);
+	return;
+      }
+      state.config.schema_linking_min_tables = sqlite3_value_int64(argv[1]);
+    }
+    sqlite3_result_int64(ctx, state.config.schema_linking_min_tables);
+    return;
+  }
+  auto message = fmt::format("Unknown sqlwrite_config() setting: {}", key ? key : "NULL");
+  sqlite3_result_error(ctx, message.c_str(), -1);
+}
+
+
+static void releaseConnectionState(void* p) {
+  auto state = static_cast<ConnectionState*>(p);
+  if (--state->refcount == 0) {
+    delete state;
+  }
+}
+
+
 extern "C" int sqlite3_sqlwrite_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi)
 {
   openai::start();
@@ -546,16 +2588,34 @@ extern "C" int sqlite3_sqlwrite_init(sqlite3 *db, char **pzErrMsg, const sqlite3
     
   int rc;
 
-  rc = sqlite3_create_function(db, "ask", -1, SQLITE_UTF8, db, &ask_command, NULL, NULL);
+  // Every function holds a reference to the connection's state; SQLite
+  // releases it when the function is dropped (or if registration fails).
+  auto state = new ConnectionState;
+
+  state->refcount++;
+  rc = sqlite3_create_function_v2(db, "ask", -1, SQLITE_UTF8, state, &ask_command, NULL, NULL, releaseConnectionState);
   if (rc != SQLITE_OK) {
     *pzErrMsg = sqlite3_mprintf("Failed to create ask function: %s", sqlite3_errmsg(db));
     return rc;
   }
-  rc = sqlite3_create_function(db, "sqlwrite", -1, SQLITE_UTF8, db, &sqlwrite_command, NULL, NULL);
+  state->refcount++;
+  rc = sqlite3_create_function_v2(db, "sqlwrite", -1, SQLITE_UTF8, state, &sqlwrite_command, NULL, NULL, releaseConnectionState);
   if (rc != SQLITE_OK) {
     *pzErrMsg = sqlite3_mprintf("Failed to create sqlwrite function: %s", sqlite3_errmsg(db));
     return rc;
   }
+  state->refcount++;
+  rc = sqlite3_create_function_v2(db, "sqlwrite_stats", 0, SQLITE_UTF8, state, &sqlwrite_stats_command, NULL, NULL, releaseConnectionState);
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("Failed to create sqlwrite_stats function: %s", sqlite3_errmsg(db));
+    return rc;
+  }
+  state->refcount++;
+  rc = sqlite3_create_function_v2(db, "sqlwrite_config", -1, SQLITE_UTF8, state, &sqlwrite_config_command, NULL, NULL, releaseConnectionState);
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("Failed to create sqlwrite_config function: %s", sqlite3_errmsg(db));
+    return rc;
+  }
   const char* key = std::getenv("OPENAI_API_KEY");
   if (!key) {
     printf("To use SQLwrite, you must have an API key saved as the environment variable OPENAI_API_KEY.\n");
@@ -564,6 +2624,11 @@ extern "C" int sqlite3_sqlwrite_init(sqlite3 *db, char **pzErrMsg, const sqlite3
     *pzErrMsg = sqlite3_mprintf("OPENAI_API_KEY environment variable not set.\n");
     return SQLITE_ERROR;
   }
+#if PRECONNECT
+  // Once per process: connections are shared by every database connection.
+  static std::once_flag preconnected;
+  std::call_once(preconnected, []() { openai::instance().preconnect(); });
+#endif
   
   printf("SQLwrite extension successfully initialized.\nYou can now use natural language queries like \"select ask('show me all artists.');\".\nPlease report any issues to https://github.com/plasma-umass/sqlwrite/issues/new\n");
 
@@ -0,0 +1,205 @@
+#ifndef MOCK_SERVER_HPP_
+#define MOCK_SERVER_HPP_
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.hpp"
+
+/*
+
+  A stand-in for the OpenAI API: an HTTP/1.1 server on a loopback port,
+  answering each POST with whatever its handler returns, and recording
+  every request it gets.
+
+  Example usage:
+
+  mock_server server([](const mock_server::request& request) {
+    return mock_server::chat("{\"SQL\": \"SELECT 1;\", \"Indexing\": []}");
+  });
+  openai::instance().setBaseUrl(server.url());
+  ... // ask questions
+  auto sent = server.requests(); // what was sent, in order
+
+  A response that starts with "data:" is sent as a server-sent event
+  stream; anything else as JSON.
+
+ */
+
+class mock_server {
+public:
+  struct request {
+    std::string target; // as in the request line: a path, or a URL if sent to a proxy
+    std::string body;
+  };
+  using handler = std::function<std::string(const request&)>;
+
+  explicit mock_server(handler h)
+    : _handler (std::move(h))
+  {
+    _listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof address;
+    bind(_listener, reinterpret_cast<sockaddr*>(&address), length);
+    listen(_listener, 16);
+    getsockname(_listener, reinterpret_cast<sockaddr*>(&address), &length);
+    _port = ntohs(address.sin_port);
+    _acceptor = std::thread([this]() { accept_connections(); });
+  }
+
+  ~mock_server() {
+    _stopping = true;
+    shutdown(_listener, SHUT_RDWR);
+    close(_listener);
+    _acceptor.join();
+    std::vector<std::thread> connections;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      for (auto fd : _sockets) {
+	shutdown(fd, SHUT_RDWR);
+      }
+      connections.swap(_connections);
+    }
+    for (auto& connection : connections) {
+      connection.join();
+    }
+  }
+
+  // The base URL to give openai::OpenAI::setBaseUrl.
+  std::string url() const {
+    return "http://127.0.0.1:" + std::to_string(_port) + "/v1/";
+  }
+
+  // The same, as a proxy URL.
+  std::string proxy() const {
+    return "http://127.0.0.1:" + std::to_string(_port);
+  }
+
+  std::vector<request> requests() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _requests;
+  }
+
+  // A chat completion whose message is content.
+  static std::string chat(const std::string& content) {
+    return nlohmann::json({
+	{ "choices", { { { "message", { { "role", "assistant" }, { "content", content } } } } } },
+	{ "usage", { { "prompt_tokens", 1 }, { "completion_tokens", 1 }, { "total_tokens", 2 } } }
+      }).dump();
+  }
+
+  // The same, streamed in chunks of at most chunk bytes.
+  static std::string stream(const std::string& content, size_t chunk) {
+    std::string events;
+    for (size_t i = 0; i < content.size(); i += chunk) {
+      nlohmann::json delta = { { "choices", { { { "delta", { { "content", content.substr(i, chunk) } } } } } } };
+      events += "data: " + delta.dump() + "\n\n";
+    }
+    nlohmann::json usage = { { "choices", nlohmann::json::array() },
+			     { "usage", { { "prompt_tokens", 1 }, { "completion_tokens", 1 }, { "total_tokens", 2 } } } };
+    return events + "data: " + usage.dump() + "\n\ndata: [DONE]\n\n";
+  }
+
+private:
+  void accept_connections() {
+    while (!_stopping) {
+      auto fd = accept(_listener, nullptr, nullptr);
+      if (fd < 0) {
+	break;
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      _sockets.push_back(fd);
+      _connections.emplace_back([this, fd]() { serve(fd); });
+    }
+  }
+
+  // Answers requests on one (keep-alive) connection until the client closes it.
+  void serve(int fd) {
+    std::string buffer;
+    char chunk[4096];
+    while (true) {
+      size_t header_end;
+      while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+	auto n = recv(fd, chunk, sizeof chunk, 0);
+	if (n <= 0) {
+	  hang_up(fd);
+	  return;
+	}
+	buffer.append(chunk, n);
+      }
+      std::string headers = buffer.substr(0, header_end);
+      std::string lower(headers);
+      std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+      size_t content_length = 0;
+      auto found = lower.find("content-length:");
+      if (found != std::string::npos) {
+	content_length = std::stoul(headers.substr(found + 15));
+      }
+      if (lower.find("expect: 100-continue") != std::string::npos) {
+	send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+      }
+      buffer.erase(0, header_end + 4);
+      while (buffer.size() < content_length) {
+	auto n = recv(fd, chunk, sizeof chunk, 0);
+	if (n <= 0) {
+	  hang_up(fd);
+	  return;
+	}
+	buffer.append(chunk, n);
+      }
+      request r;
+      auto target_start = headers.find(' ') + 1;
+      r.target = headers.substr(target_start, headers.find(' ', target_start) - target_start);
+      r.body = buffer.substr(0, content_length);
+      buffer.erase(0, content_length);
+      {
+	std::lock_guard<std::mutex> lock(_mutex);
+	_requests.push_back(r);
+      }
+      auto body = _handler(r);
+      auto type = body.rfind("data:", 0) == 0 ? "text/event-stream" : "application/json";
+      send_all(fd, "HTTP/1.1 200 OK\r\nContent-Type: " + std::string(type) + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+    }
+  }
+
+  void hang_up(int fd) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sockets.erase(std::find(_sockets.begin(), _sockets.end(), fd));
+    close(fd);
+  }
+
+  static void send_all(int fd, const std::string& data) {
+    for (size_t sent = 0; sent < data.size(); ) {
+      auto n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+	return;
+      }
+      sent += n;
+    }
+  }
+
+  handler _handler;
+  int _listener = -1;
+  int _port = 0;
+  std::atomic<bool> _stopping { false };
+  std::thread _acceptor;
+  mutable std::mutex _mutex;
+  std::vector<int> _sockets;
+  std::vector<std::thread> _connections;
+  std::vector<request> _requests;
+};
+
+#endif
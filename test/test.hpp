@@ -0,0 +1,115 @@
+#ifndef TEST_HPP_
+#define TEST_HPP_
+
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+
+  A minimal test harness: each test/test_*.cpp file is a program of its
+  own, built and run by `make test`.
+
+  Example usage:
+
+  #include "test.hpp"
+
+  TEST(addition) {
+    CHECK(1 + 1 == 2);
+    CHECK_EQ(2 + 2, 4);
+  }
+
+  A failed check reports its file, line and expression and fails the
+  test, which goes on to its end; the program exits with status 1 if any
+  test failed.
+
+ */
+
+namespace test {
+
+  struct registry {
+    std::vector<std::pair<const char*, std::function<void()>>> tests;
+    int failures = 0;
+
+    static registry& instance() {
+      static registry r;
+      return r;
+    }
+  };
+
+  struct add {
+    add(const char* name, std::function<void()> f) {
+      registry::instance().tests.emplace_back(name, std::move(f));
+    }
+  };
+
+  inline void fail(const char* file, int line, const std::string& what) {
+    std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what.c_str());
+    registry::instance().failures++;
+  }
+
+  // Captures what is written to std::cout and std::cerr while it is alive.
+  class capture {
+  public:
+    capture()
+      : _out (std::cout.rdbuf(_out_text.rdbuf())),
+	_err (std::cerr.rdbuf(_err_text.rdbuf()))
+    {
+    }
+
+    ~capture() {
+      std::cout.rdbuf(_out);
+      std::cerr.rdbuf(_err);
+    }
+
+    std::string out() const { return _out_text.str(); }
+    std::string err() const { return _err_text.str(); }
+
+  private:
+    std::ostringstream _out_text, _err_text;
+    std::streambuf* _out;
+    std::streambuf* _err;
+  };
+
+}
+
+#define TEST_CONCAT_(a, b) a##b
+#define TEST_CONCAT(a, b) TEST_CONCAT_(a, b)
+
+#define TEST(name)							\
+  static void test_##name();						\
+  static test::add TEST_CONCAT(test_add_, name)(#name, test_##name);	\
+  static void test_##name()
+
+#define CHECK(expression)						\
+  do {									\
+    if (!(expression)) {						\
+      test::fail(__FILE__, __LINE__, #expression);			\
+    }									\
+  } while (0)
+
+#define CHECK_EQ(actual, expected)					\
+  do {									\
+    auto&& actual_ = (actual);						\
+    auto&& expected_ = (expected);					\
+    if (!(actual_ == expected_)) {					\
+      std::ostringstream what_;						\
+      what_ << #actual << " == " << #expected << " (got " << actual_ << ", expected " << expected_ << ")"; \
+      test::fail(__FILE__, __LINE__, what_.str());			\
+    }									\
+  } while (0)
+
+int main() {
+  auto& tests = test::registry::instance();
+  for (auto& [name, run] : tests.tests) {
+    auto before = tests.failures;
+    run();
+    std::fprintf(stderr, "%s %s\n", tests.failures == before ? "ok  " : "FAIL", name);
+  }
+  return tests.failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,86 @@
+// Tests of the Aho-Corasick automaton (aho_corasick.hpp).
+
+#include "aho_corasick.hpp"
+
+#include <tuple>
+
+#include "test.hpp"
+
+using match = std::tuple<size_t, size_t, size_t>; // id, start, end
+
+static std::vector<match> matches(const aho_corasick& ac, std::string_view text) {
+  std::vector<match> found;
+  ac.match(text, [&](size_t id, size_t start, size_t end) {
+    found.emplace_back(id, start, end);
+  });
+  std::sort(found.begin(), found.end());
+  return found;
+}
+
+static std::string str(const std::vector<match>& found) {
+  std::string s;
+  for (auto& [id, start, end] : found) {
+    s += "(" + std::to_string(id) + " " + std::to_string(start) + " " + std::to_string(end) + ")";
+  }
+  return s;
+}
+
+// Overlapping patterns, and patterns within patterns, are all found.
+TEST(finds_overlapping_patterns) {
+  aho_corasick ac;
+  ac.add("invoice", 1);
+  ac.add("invoice line", 2);
+  ac.add("line", 3);
+  ac.build();
+  CHECK_EQ(str(matches(ac, "total of each invoice line")), "(1 14 21)(2 14 26)(3 22 26)");
+}
+
+// Patterns that are suffixes of others are found through failure links.
+TEST(follows_failure_links) {
+  aho_corasick ac;
+  ac.set_whole_words(false);
+  ac.add("he", 1);
+  ac.add("she", 2);
+  ac.add("his", 3);
+  ac.add("hers", 4);
+  ac.build();
+  CHECK_EQ(str(matches(ac, "ushers")), "(1 2 4)(2 1 4)(4 2 6)");
+}
+
+TEST(ignores_ascii_case) {
+  aho_corasick ac;
+  ac.add("InvoiceLine", 1);
+  ac.build();
+  CHECK_EQ(str(matches(ac, "every INVOICELINE and invoiceline")), "(1 6 17)(1 22 33)");
+}
+
+// By default only whole words match; non-ASCII bytes count as letters.
+TEST(matches_whole_words) {
+  aho_corasick ac;
+  ac.add("art", 1);
+  ac.build();
+  CHECK_EQ(str(matches(ac, "art, the art, party, art_id, caf\xc3\xa9" "art")), "(1 0 3)(1 9 12)");
+  ac.set_whole_words(false);
+  CHECK_EQ(matches(ac, "party").size(), 1u);
+}
+
+// Several patterns may share an id (e.g., a table's name and its plural).
+TEST(reports_shared_ids) {
+  aho_corasick ac;
+  ac.add("genre", 7);
+  ac.add("genres", 7);
+  ac.build();
+  CHECK_EQ(str(matches(ac, "all genres")), "(7 4 10)");
+}
+
+// Nothing matches before build, or after clear.
+TEST(needs_building) {
+  aho_corasick ac;
+  ac.add("track", 1);
+  CHECK(matches(ac, "track").empty());
+  ac.build();
+  CHECK_EQ(matches(ac, "track").size(), 1u);
+  ac.clear();
+  CHECK(ac.empty());
+  CHECK(matches(ac, "track").empty());
+}
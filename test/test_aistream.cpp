@@ -0,0 +1,156 @@
+// Tests of streamed responses (aistream.hpp): splitting server-sent
+// events, finding the fields of a JSON object as it arrives, and both
+// together against a mock of the API.
+
+#include "aistream.hpp"
+
+#include "mock_server.hpp"
+#include "test.hpp"
+
+using json = nlohmann::json;
+
+// The events in text, fed in pieces of at most chunk bytes.
+static std::vector<std::string> events(const std::string& text, size_t chunk) {
+  ai::event_stream stream;
+  std::vector<std::string> found;
+  for (size_t i = 0; i < text.size(); i += chunk) {
+    stream.feed(std::string_view(text).substr(i, chunk), [&](std::string_view data) {
+      found.emplace_back(data);
+    });
+  }
+  return found;
+}
+
+// However the text is split, the same events come out.
+TEST(event_stream_splits_events) {
+  std::string text =
+    ": a comment\n"
+    "event: message\n"
+    "data: {\"a\": 1}\n"
+    "\n"
+    "data:{\"b\": 2}\r\n"
+    "\r\n"
+    "id: 7\n"
+    "data: first line\n"
+    "data: second line\n"
+    "\n"
+    "data: [DONE]\n"
+    "\n";
+  for (size_t chunk : { text.size(), size_t(1), size_t(2), size_t(7) }) {
+    auto found = events(text, chunk);
+    CHECK_EQ(found.size(), 4u);
+    if (found.size() == 4) {
+      CHECK_EQ(found[0], "{\"a\": 1}");
+      CHECK_EQ(found[1], "{\"b\": 2}");
+      CHECK_EQ(found[2], "first line\nsecond line");
+      CHECK_EQ(found[3], "[DONE]");
+    }
+  }
+}
+
+// An event isn't complete until the blank line after it.
+TEST(event_stream_waits_for_blank_line) {
+  CHECK(events("data: partial\n", 100).empty());
+  CHECK(events("data: partial", 100).empty());
+}
+
+// Each member of the object is reported once, as soon as its value ends,
+// however the text is split; strings may hold braces, brackets, commas,
+// and escaped quotes.
+TEST(json_fields_reports_each_member_once) {
+  std::string text =
+    "```json\n"
+    "{\"SQL\": \"SELECT '}', '[', ',' FROM t WHERE x = \\\"{\\\"\", "
+    "\"Indexing\": [\"CREATE INDEX a ON t(x);\", {\"nested\": [1, {\"deep\": true}]}], "
+    "\"n\": 3}\n"
+    "```\n"
+    "{\"after\": \"ignored\"}";
+  auto object = json::parse(text.substr(8, text.find("\n```\n") - 8));
+  for (size_t chunk : { text.size(), size_t(1), size_t(3) }) {
+    ai::json_fields fields;
+    json seen = json::object();
+    size_t sql_seen_at = 0, fed = 0;
+    for (size_t i = 0; i < text.size(); i += chunk) {
+      auto piece = std::string_view(text).substr(i, chunk);
+      fed += piece.size();
+      fields.feed(piece, [&](const std::string& key, const json& value) {
+	CHECK(!seen.contains(key));
+	seen[key] = value;
+	if (key == "SQL") {
+	  sql_seen_at = fed;
+	}
+      });
+    }
+    CHECK_EQ(seen, object);
+    if (chunk < text.size()) {
+      // Before the rest of the object arrived.
+      CHECK(sql_seen_at > 0 && sql_seen_at < text.find("Indexing"));
+    }
+  }
+}
+
+// Anything that isn't a member with a valid value is left out.
+TEST(json_fields_skips_invalid_values) {
+  ai::json_fields fields;
+  json seen = json::object();
+  fields.feed("{\"a\": nope, \"b\": 2}", [&](const std::string& key, const json& value) { seen[key] = value; });
+  CHECK_EQ(seen, json({ { "b", 2 } }));
+}
+
+// A streamed response: fields arrive before it is complete, and the
+// result is the same as it would have been without streaming.
+TEST(aistream_streams_fields) {
+  std::string content = "{\"SQL\": \"SELECT name FROM genre;\", \"Indexing\": [\"CREATE INDEX i ON genre(name);\"]}";
+  mock_server server([&](const mock_server::request&) { return mock_server::stream(content, 5); });
+  setenv("OPENAI_API_KEY", "test", 1);
+  openai::instance().setBaseUrl(server.url());
+  ai::aistream ai({ .maxRetries = 1 });
+  ai << ai::config::GPT_4_0;
+  ai << json({ { "role", "user" }, { "content", "which genres are there?" } });
+  std::vector<std::string> keys;
+  ai << ai::on_field([&](const std::string& key, const json&) { keys.push_back(key); });
+  json result;
+  ai >> result;
+  CHECK_EQ(result, json::parse(content));
+  CHECK_EQ(keys.size(), 2u);
+  if (keys.size() == 2) {
+    CHECK_EQ(keys[0], "SQL");
+    CHECK_EQ(keys[1], "Indexing");
+  }
+  auto requests = server.requests();
+  CHECK_EQ(requests.size(), 1u);
+  if (requests.size() == 1) {
+    auto request = json::parse(requests[0].body);
+    CHECK_EQ(request["stream"], true);
+  }
+}
+
+// A server that turns down stream_options is asked again without it, and
+// isn't sent it after that.
+TEST(aistream_retries_without_stream_options) {
+  std::string content = "{\"SQL\": \"SELECT name FROM genre;\", \"Indexing\": []}";
+  mock_server server([&](const mock_server::request& request) {
+    if (request.body.find("stream_options") != std::string::npos) {
+      return std::string("{\"error\": {\"message\": \"Unrecognized request argument supplied: stream_options\"}}");
+    }
+    return mock_server::stream(content, 5);
+  });
+  setenv("OPENAI_API_KEY", "test", 1);
+  openai::instance().setBaseUrl(server.url());
+  for (int i = 0; i < 2; i++) {
+    ai::aistream ai({ .maxRetries = 1 });
+    ai << ai::config::GPT_4_0;
+    ai << json({ { "role", "user" }, { "content", "which genres are there?" } });
+    ai << ai::on_field([](const std::string&, const json&) {});
+    json result;
+    ai >> result;
+    CHECK_EQ(result, json::parse(content));
+  }
+  auto requests = server.requests();
+  CHECK_EQ(requests.size(), 3u);
+  for (size_t i = 1; i < requests.size(); i++) {
+    auto request = json::parse(requests[i].body);
+    CHECK_EQ(request["stream"], true);
+    CHECK(!request.contains("stream_options"));
+  }
+}
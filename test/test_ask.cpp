@@ -0,0 +1,516 @@
+// Tests of ask() end to end, against a mock of the API.
+
+#define PRECONNECT 0
+#include "sqlwrite.cpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mock_server.hpp"
+#include "test.hpp"
+
+// A connection to filename with the extension loaded, talking to server.
+static sqlite3* openWithExtension(const mock_server& server, const char* filename) {
+  setenv("OPENAI_API_KEY", "test", 1);
+  sqlite3* db = nullptr;
+  sqlite3_open(filename, &db);
+  // Keep the greeting out of the test output.
+  fflush(stdout);
+  auto saved = dup(STDOUT_FILENO);
+  auto null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  char* error = nullptr;
+  sqlite3_sqlwrite_init(db, &error, nullptr);
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  close(null);
+  openai::instance().setBaseUrl(server.url());
+  return db;
+}
+
+static const char* genres =
+  "CREATE TABLE genre(id INTEGER PRIMARY KEY, name TEXT);"
+  "INSERT INTO genre(name) VALUES ('Rock'), ('Jazz'), ('Metal');";
+
+// An in-memory database with the extension loaded, talking to server.
+static sqlite3* openDatabase(const mock_server& server) {
+  auto db = openWithExtension(server, ":memory:");
+  sqlite3_exec(db, genres, nullptr, nullptr, nullptr);
+  return db;
+}
+
+// The messages of a chat request.
+static json messages(const mock_server::request& request) {
+  return json::parse(request.body)["messages"];
+}
+
+static bool isBackTranslation(const mock_server::request& request) {
+  return request.body.find("convert it into natural language") != std::string::npos;
+}
+
+// Asks a question whose first answer comes back empty and every retry's
+// answer is follow_up; returns what ask() printed (stdout, then stderr).
+static std::pair<std::string, std::string> askWithFollowUp(const std::string& follow_up) {
+  mock_server server([&](const mock_server::request& request) {
+    if (isBackTranslation(request)) {
+      return mock_server::chat("{\"Translation\": \"Genres named Blues.\"}");
+    }
+    if (messages(request).back()["content"].get<std::string>().find("produced no results") != std::string::npos) {
+      return mock_server::chat(follow_up);
+    }
+    return mock_server::chat("{\"SQL\": \"SELECT name FROM genre WHERE name = 'Blues';\", \"Indexing\": [\"CREATE INDEX kept ON genre(name);\"]}");
+  });
+  auto db = openDatabase(server);
+  int rc;
+  test::capture output;
+  rc = sqlite3_exec(db, "SELECT ask('which genres are called blues?');", nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  CHECK_EQ(rc, SQLITE_OK);
+  return { output.out(), output.err() };
+}
+
+// A retry that never produces a valid follow-up ends with
+// TOO_MANY_RETRIES; the answer is then the last candidate that did
+// validate, along with its own indexing suggestions.
+TEST(retry_that_gives_up_keeps_the_last_valid_candidate) {
+  for (auto follow_up : {
+      // Parses, but fails validation (the query doesn't run).
+      "{\"SQL\": \"SELECT * FROM no_such_table;\", \"Indexing\": [\"CREATE INDEX rejected ON genre(name);\"]}",
+      // Doesn't parse at all.
+      "Sorry, I can't do that." }) {
+    auto [out, err] = askWithFollowUp(follow_up);
+    CHECK(err.find("SELECT name FROM genre WHERE name = 'Blues';") != std::string::npos);
+    CHECK(err.find("no_such_table") == std::string::npos);
+    CHECK(out.find("CREATE INDEX kept") != std::string::npos);
+    CHECK(out.find("CREATE INDEX rejected") == std::string::npos);
+  }
+}
+
+// Streamed queries that write don't run before the whole response has
+// arrived and validated (here it never does: the indexing suggestions
+// aren't strings).
+TEST(runs_writes_only_once_the_response_validates) {
+  mock_server server([](const mock_server::request& request) {
+    if (isBackTranslation(request)) {
+      return mock_server::chat("{\"Translation\": \"Adds a genre.\"}");
+    }
+    return mock_server::stream("{\"SQL\": \"INSERT INTO genre(name) VALUES ('Polka');\", \"Indexing\": [1]}", 8);
+  });
+  auto db = openDatabase(server);
+  {
+    test::capture output;
+    sqlite3_exec(db, "SELECT ask('add a genre called polka');", nullptr, nullptr, nullptr);
+  }
+  auto polkas = queryInteger(db, "SELECT count(*) FROM genre WHERE name = 'Polka';");
+  sqlite3_close(db);
+  CHECK_EQ(polkas, 0);
+}
+
+// Each retry repeats the conversation so far, byte for byte, and adds
+// only the previous answer and a short note on what was wrong with it.
+TEST(retry_sends_only_a_delta) {
+  mock_server server([](const mock_server::request& request) {
+    if (isBackTranslation(request)) {
+      return mock_server::chat("{\"Translation\": \"Every genre.\"}");
+    }
+    if (messages(request).back()["content"].get<std::string>().find("produced no results") != std::string::npos) {
+      return mock_server::chat("{\"SQL\": \"SELECT name FROM genre;\", \"Indexing\": []}");
+    }
+    return mock_server::chat("{\"SQL\": \"SELECT name FROM genre WHERE name = 'Blues';\", \"Indexing\": []}");
+  });
+  auto db = openDatabase(server);
+  {
+    test::capture output;
+    sqlite3_exec(db, "SELECT ask('which genres are there?');", nullptr, nullptr, nullptr);
+  }
+  sqlite3_close(db);
+
+  std::vector<mock_server::request> translations;
+  for (auto& request : server.requests()) {
+    if (!isBackTranslation(request)) {
+      translations.push_back(request);
+    }
+  }
+  CHECK_EQ(translations.size(), 2u);
+  if (translations.size() == 2) {
+    auto first = messages(translations[0]);
+    auto second = messages(translations[1]);
+    CHECK_EQ(second.size(), first.size() + 2);
+    // The first request's body, up to the end of its messages, starts the second's.
+    auto prefix = translations[0].body.substr(0, translations[0].body.rfind("}]") + 1);
+    CHECK_EQ(translations[1].body.rfind(prefix, 0), 0u);
+    CHECK_EQ(second[first.size()]["role"], "assistant");
+    CHECK(second.back()["content"].get<std::string>().find("produced no results") != std::string::npos);
+    CHECK(second.back()["content"].get<std::string>().size() < 300);
+  }
+}
+
+// Only the query that ends up as the answer is translated back, not
+// the candidates a retry replaced.
+TEST(translates_back_only_the_final_query) {
+  mock_server server([](const mock_server::request& request) {
+    if (isBackTranslation(request)) {
+      return mock_server::chat("{\"Translation\": \"Every genre.\"}");
+    }
+    if (messages(request).back()["content"].get<std::string>().find("produced no results") != std::string::npos) {
+      return mock_server::chat("{\"SQL\": \"SELECT name FROM genre;\", \"Indexing\": []}");
+    }
+    return mock_server::chat("{\"SQL\": \"SELECT name FROM genre WHERE name = 'Blues';\", \"Indexing\": []}");
+  });
+  auto db = openDatabase(server);
+  std::string out;
+  {
+    test::capture output;
+    sqlite3_exec(db, "SELECT ask('which genres are there?');", nullptr, nullptr, nullptr);
+    out = output.out();
+  }
+  sqlite3_close(db);
+
+  std::vector<mock_server::request> back_translations;
+  for (auto& request : server.requests()) {
+    if (isBackTranslation(request)) {
+      back_translations.push_back(request);
+    }
+  }
+  CHECK_EQ(back_translations.size(), 1u);
+  if (back_translations.size() == 1) {
+    CHECK(back_translations[0].body.find("SELECT name FROM genre;") != std::string::npos);
+  }
+  CHECK(out.find("Every genre.") != std::string::npos);
+}
+
+// The first request for a translation, after asking question of db.
+static std::string translationPrompt(sqlite3* db, const mock_server& server, const std::string& question) {
+  {
+    test::capture output;
+    sqlite3_exec(db, fmt::format("SELECT ask({});", quoteString(question)).c_str(), nullptr, nullptr, nullptr);
+  }
+  for (auto& request : server.requests()) {
+    if (!isBackTranslation(request)) {
+      return messages(request).back()["content"].get<std::string>();
+    }
+  }
+  return "";
+}
+
+static std::string anySQL(const mock_server::request& request) {
+  if (isBackTranslation(request)) {
+    return mock_server::chat("{\"Translation\": \"Something.\"}");
+  }
+  return mock_server::chat("{\"SQL\": \"SELECT 1;\", \"Indexing\": []}");
+}
+
+// On a cold cache, a question naming a value of a table it doesn't
+// mention ("jazz" of genre) still finds it, through the foreign keys of
+// the tables it does mention.
+TEST(cold_cache_samples_tables_next_to_mentioned_ones) {
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  sqlite3_exec(db,
+	       // Too large to be sampled just for being small.
+	       "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 2000)"
+	       "  INSERT INTO genre(name) SELECT 'Style ' || i FROM n;"
+	       "CREATE TABLE artist(id INTEGER PRIMARY KEY, name TEXT);"
+	       "CREATE TABLE track(id INTEGER PRIMARY KEY, name TEXT, artist_id INTEGER REFERENCES artist(id), genre_id INTEGER REFERENCES genre(id));"
+	       "INSERT INTO artist(name) VALUES ('Miles Davis'), ('Motorhead');"
+	       "INSERT INTO track(name, artist_id, genre_id) VALUES ('So What', 1, 2), ('Ace of Spades', 2, 3);",
+	       nullptr, nullptr, nullptr);
+  auto prompt = translationPrompt(db, server, "which artists have jazz tracks?");
+  sqlite3_close(db);
+  CHECK(prompt.find("Jazz") != std::string::npos);
+}
+
+// On a cold cache, tiny tables are sampled whatever the question, so
+// their values tie it to them.
+TEST(cold_cache_samples_tiny_tables) {
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  sqlite3_exec(db,
+	       "CREATE TABLE mood(id INTEGER PRIMARY KEY, label TEXT);"
+	       "INSERT INTO mood(label) VALUES ('Mellow'), ('Angry'), ('Upbeat');",
+	       nullptr, nullptr, nullptr);
+  auto prompt = translationPrompt(db, server, "how many genres are mellow?");
+  sqlite3_close(db);
+  CHECK(prompt.find("Mellow") != std::string::npos);
+}
+
+static int countingHandler(void* calls) {
+  ++*static_cast<int*>(calls);
+  return 0;
+}
+
+// Sampling leaves the host's own progress handler in place.
+TEST(keeps_the_hosts_progress_handler) {
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  int calls = 0;
+  sqlite3_progress_handler(db, 1, countingHandler, &calls);
+  {
+    test::capture output;
+    sqlite3_exec(db, "SELECT ask('which genres are there?');", nullptr, nullptr, nullptr);
+  }
+  calls = 0;
+  sqlite3_exec(db, "SELECT count(*) FROM genre;", nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  CHECK(calls > 0);
+}
+
+// Schemas too small for the compact format's legend to pay for itself
+// are shown as their CREATE statements, unless a format is configured.
+TEST(small_schemas_are_shown_raw) {
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  auto prompt = translationPrompt(db, server, "which genres are there?");
+  CHECK(prompt.find("CREATE TABLE genre") != std::string::npos);
+  CHECK(prompt.find("Schema, as table(") == std::string::npos);
+  sqlite3_exec(db, "SELECT sqlwrite_config('schema_format', 'compact');", nullptr, nullptr, nullptr);
+  mock_server compact_server(anySQL);
+  openai::instance().setBaseUrl(compact_server.url());
+  prompt = translationPrompt(db, compact_server, "which genres are there?");
+  CHECK(prompt.find("Schema, as table(") != std::string::npos);
+  sqlite3_close(db);
+}
+
+// Larger schemas are shown compactly.
+TEST(larger_schemas_are_shown_compactly) {
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  for (auto table : { "artist", "album", "track", "customer", "invoice" }) {
+    sqlite3_exec(db, fmt::format("CREATE TABLE {}(id INTEGER PRIMARY KEY NOT NULL, name NVARCHAR(120) NOT NULL, created_at DATETIME NOT NULL DEFAULT CURRENT_TIMESTAMP, genre_id INTEGER NOT NULL REFERENCES genre(id) ON DELETE CASCADE);", table).c_str(),
+		 nullptr, nullptr, nullptr);
+  }
+  auto prompt = translationPrompt(db, server, "how many tracks are there?");
+  sqlite3_close(db);
+  CHECK(prompt.find("Schema, as table(") != std::string::npos);
+}
+
+static json statsOf(sqlite3* db) {
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "SELECT sqlwrite_stats();", -1, &stmt, nullptr);
+  sqlite3_step(stmt);
+  auto stats = json::parse(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+  sqlite3_finalize(stmt);
+  return stats;
+}
+
+// Without the tokenizer's ranks, token counts are estimates, so prompts
+// are kept well within the budget.
+TEST(estimated_token_counts_leave_a_margin) {
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  sqlite3_exec(db, "SELECT sqlwrite_config('token_budget', 1000);", nullptr, nullptr, nullptr);
+  translationPrompt(db, server, "which genres are there?");
+  auto stats = statsOf(db);
+  sqlite3_close(db);
+  auto exact = stats["schema"]["tokenizer"] != "estimate";
+  CHECK_EQ(stats["prompt"]["effective_budget"].get<size_t>(), exact ? 1000u : 800u);
+  CHECK(stats["prompt"]["tokens"].get<size_t>() <= stats["prompt"]["effective_budget"].get<size_t>());
+}
+
+// The budget holds the whole request: the system message and the chat
+// framing of each message, as well as room for the reply.
+TEST(budget_covers_the_whole_request) {
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  // More schema than fits.
+  for (int i = 0; i < 40; i++) {
+    sqlite3_exec(db, fmt::format("CREATE TABLE table_{0}(id INTEGER PRIMARY KEY, name_{0} TEXT, created_{0} DATETIME, total_{0} REAL);", i).c_str(), nullptr, nullptr, nullptr);
+  }
+  sqlite3_exec(db, "SELECT sqlwrite_config('token_budget', 1000);", nullptr, nullptr, nullptr);
+  translationPrompt(db, server, "what happened most recently?");
+  auto stats = statsOf(db);
+  sqlite3_close(db);
+  auto budget = stats["prompt"]["effective_budget"].get<size_t>();
+  CHECK(stats["prompt"]["tables_omitted"].get<size_t>() > 0);
+  auto requests = server.requests();
+  CHECK(!requests.empty());
+  if (!requests.empty()) {
+    size_t tokens = replyPrimingTokens + REPLY_TOKENS;
+    for (auto& message : messages(requests[0])) {
+      tokens += countTokens(message["content"].get<std::string>()) + messageOverheadTokens;
+    }
+    CHECK(tokens <= budget);
+  }
+}
+
+// The schema is read once, and again only after it changes; creating
+// SQLwrite's own tables on the first ask doesn't count as a change.
+TEST(schema_is_cached_until_it_changes) {
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  translationPrompt(db, server, "which genres are there?");
+  auto before = statsOf(db)["schema_cache"];
+  CHECK_EQ(before["misses"].get<int>(), 1);
+  translationPrompt(db, server, "how many genres are there?");
+  auto after = statsOf(db)["schema_cache"];
+  CHECK_EQ(after["misses"].get<int>(), 1);
+  CHECK(after["hits"].get<int>() > before["hits"].get<int>());
+  sqlite3_exec(db, "CREATE TABLE mood(id INTEGER PRIMARY KEY, label TEXT);", nullptr, nullptr, nullptr);
+  mock_server changed_server(anySQL);
+  openai::instance().setBaseUrl(changed_server.url());
+  auto prompt = translationPrompt(db, changed_server, "how many moods are there?");
+  auto changed = statsOf(db)["schema_cache"];
+  sqlite3_close(db);
+  CHECK_EQ(changed["misses"].get<int>(), 2);
+  CHECK(prompt.find("mood") != std::string::npos);
+}
+
+// Attached databases are part of the schema, each cached separately;
+// detaching one drops its part.
+TEST(attached_databases_are_cached_separately) {
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  sqlite3_exec(db,
+	       "ATTACH ':memory:' AS music;"
+	       "CREATE TABLE music.album(id INTEGER PRIMARY KEY, title TEXT);"
+	       "INSERT INTO music.album(title) VALUES ('Kind of Blue');",
+	       nullptr, nullptr, nullptr);
+  auto prompt = translationPrompt(db, server, "how many albums are there?");
+  CHECK(prompt.find("music.album") != std::string::npos);
+  auto before = statsOf(db)["schema_cache"];
+  CHECK(before["schemas"].contains("main") && before["schemas"].contains("music"));
+  sqlite3_exec(db, "CREATE TABLE music.label(id INTEGER PRIMARY KEY, name TEXT);", nullptr, nullptr, nullptr);
+  mock_server changed_server(anySQL);
+  openai::instance().setBaseUrl(changed_server.url());
+  prompt = translationPrompt(db, changed_server, "how many labels are there?");
+  CHECK(prompt.find("music.label") != std::string::npos);
+  auto after = statsOf(db)["schema_cache"];
+  CHECK_EQ(after["misses"].get<int>(), before["misses"].get<int>() + 1);
+  CHECK(after["schemas"]["music"] != before["schemas"]["music"]);
+  sqlite3_exec(db, "DETACH music;", nullptr, nullptr, nullptr);
+  mock_server detached_server(anySQL);
+  openai::instance().setBaseUrl(detached_server.url());
+  prompt = translationPrompt(db, detached_server, "how many genres are there?");
+  auto detached = statsOf(db)["schema_cache"]["schemas"];
+  sqlite3_close(db);
+  CHECK(!detached.contains("music"));
+  CHECK(prompt.find("music.album") == std::string::npos);
+}
+
+// Row counts are shown to two significant digits; a span of rowids is
+// only an upper bound (rowids can have gaps), so it is shown as one.
+TEST(rowid_spans_are_shown_as_upper_bounds) {
+  CHECK_EQ(approximateRows({ 17 }), "~17");
+  CHECK_EQ(approximateRows({ 280 }), "~280");
+  CHECK_EQ(approximateRows({ 3456 }), "~3.5K");
+  CHECK_EQ(approximateRows({ 9970 }), "~10K");
+  CHECK_EQ(approximateRows({ 119800000 }), "~120M");
+  CHECK_EQ(approximateRows({ 17, true }), "≤17");
+  CHECK_EQ(approximateRows({ 1100, true }), "≤1.1K");
+  CHECK_EQ(approximateRows({ 1249, true }), "≤1.3K");
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  // Shaped like test/test.db: rowid 1, then 1234 to 1249.
+  sqlite3_exec(db,
+	       "CREATE TABLE artist(id INTEGER PRIMARY KEY, name TEXT);"
+	       "INSERT INTO artist VALUES (1, 'name 0');"
+	       "WITH RECURSIVE n(i) AS (SELECT 1234 UNION ALL SELECT i + 1 FROM n WHERE i < 1249)"
+	       "  INSERT INTO artist SELECT i, 'name ' || (i - 1233) FROM n;",
+	       nullptr, nullptr, nullptr);
+  ConnectionState state;
+  auto schema = getSchemaSnapshot(db, state);
+  auto rows = estimateRowCounts(db, *schema, state.samples, {});
+  sqlite3_close(db);
+  CHECK_EQ(rows["artist"].rows, 1249);
+  CHECK(rows["artist"].upper_bound);
+}
+
+// Samples taken in this session are taken again after anything is
+// written, so that updates show up too.
+TEST(resamples_after_updates) {
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  auto prompt = translationPrompt(db, server, "which genres are there?");
+  CHECK(prompt.find("Rock") != std::string::npos);
+  sqlite3_exec(db, "UPDATE genre SET name = 'Blues' WHERE name = 'Rock';", nullptr, nullptr, nullptr);
+  mock_server updated_server(anySQL);
+  openai::instance().setBaseUrl(updated_server.url());
+  prompt = translationPrompt(db, updated_server, "which genres are there?");
+  sqlite3_close(db);
+  CHECK(prompt.find("Blues") != std::string::npos);
+  CHECK(prompt.find("Rock") == std::string::npos);
+}
+
+// Samples saved by an earlier session are taken again if rows were
+// deleted and inserted since, even if the row count is the same.
+TEST(resamples_tables_changed_between_sessions) {
+  char filename[] = "/tmp/sqlwrite_ask_XXXXXX";
+  close(mkstemp(filename));
+  mock_server server(anySQL);
+  auto db = openWithExtension(server, filename);
+  sqlite3_exec(db, genres, nullptr, nullptr, nullptr);
+  auto prompt = translationPrompt(db, server, "which genres are there?");
+  sqlite3_close(db);
+  CHECK(prompt.find("Rock") != std::string::npos);
+  sqlite3_open(filename, &db);
+  sqlite3_exec(db, "DELETE FROM genre WHERE name = 'Rock'; INSERT INTO genre(name) VALUES ('Blues');", nullptr, nullptr, nullptr);
+  sqlite3_close(db);
+  mock_server next_server(anySQL);
+  db = openWithExtension(next_server, filename);
+  prompt = translationPrompt(db, next_server, "which genres are there?");
+  sqlite3_close(db);
+  unlink(filename);
+  CHECK(prompt.find("Blues") != std::string::npos);
+}
+
+// Only SQLwrite's own tables are hidden, not users' tables with similar names.
+TEST(shows_user_tables_named_like_ours) {
+  mock_server server(anySQL);
+  auto db = openDatabase(server);
+  sqlite3_exec(db, "CREATE TABLE sqlwrite_notes(id INTEGER PRIMARY KEY, note TEXT);", nullptr, nullptr, nullptr);
+  auto prompt = translationPrompt(db, server, "how many notes are there?");
+  sqlite3_close(db);
+  CHECK(prompt.find("sqlwrite_notes") != std::string::npos);
+  CHECK(prompt.find("sqlwrite_values") == std::string::npos);
+  CHECK(prompt.find("sqlwrite_samples") == std::string::npos);
+}
+
+// When the tables can't be embedded, the question isn't either: its
+// embedding would have nothing to be compared with.
+TEST(skips_embedding_the_question_without_table_embeddings) {
+  mock_server server([](const mock_server::request& request) {
+    if (request.target.find("embeddings") != std::string::npos) {
+      return std::string("{\"error\": {\"message\": \"No embeddings here.\"}}");
+    }
+    return anySQL(request);
+  });
+  auto db = openDatabase(server);
+  for (int i = 0; i < EMBEDDING_RETRIEVAL_MIN_TABLES; i++) {
+    sqlite3_exec(db, fmt::format("CREATE TABLE t{}(id INTEGER PRIMARY KEY, name TEXT);", i).c_str(), nullptr, nullptr, nullptr);
+  }
+  {
+    test::capture output;
+    sqlite3_exec(db, "SELECT ask('how many genres are there?');", nullptr, nullptr, nullptr);
+  }
+  sqlite3_close(db);
+  auto requests = server.requests();
+  auto embeddings = std::count_if(requests.begin(), requests.end(), [](auto& request) { return request.target.find("embeddings") != std::string::npos; });
+  CHECK_EQ(embeddings, 1);
+}
+
+// Only indexes that hold every value of a column, in the order it
+// compares them, stand in for reading it.
+TEST(summarizes_only_from_indexes_in_column_order) {
+  CHECK_EQ(declaredCollation("CREATE TABLE t(\"a b\" TEXT COLLATE nocase, c DEFAULT 'x, y' CHECK (c COLLATE rtrim != ''), [d] /* , d COLLATE NOCASE */)", "A B"), "NOCASE");
+  CHECK_EQ(declaredCollation("CREATE TABLE t(\"a b\" TEXT COLLATE nocase, c DEFAULT 'x, y' CHECK (c COLLATE rtrim != ''), [d] /* , d COLLATE NOCASE */)", "c"), "BINARY");
+  CHECK_EQ(declaredCollation("CREATE TABLE t(\"a b\" TEXT COLLATE nocase, c DEFAULT 'x, y' CHECK (c COLLATE rtrim != ''), [d] /* , d COLLATE NOCASE */)", "d"), "BINARY");
+  sqlite3* db;
+  sqlite3_open(":memory:", &db);
+  sqlite3_exec(db,
+	       "CREATE TABLE track(id INTEGER PRIMARY KEY, name TEXT COLLATE NOCASE, title TEXT, kind TEXT);"
+	       "CREATE INDEX by_name ON track(name);"
+	       "CREATE INDEX by_title ON track(title COLLATE NOCASE);"
+	       "CREATE INDEX by_kind ON track(kind) WHERE kind IS NOT NULL;",
+	       nullptr, nullptr, nullptr);
+  SchemaSnapshot snapshot;
+  CHECK(introspectSchema(db, "main", "main", snapshot));
+  sqlite3_close(db);
+  CHECK_EQ(snapshot.tables.size(), 1u);
+  if (snapshot.tables.size() == 1) {
+    auto& track = snapshot.tables[0];
+    CHECK(isIndexed(track, "name"));
+    CHECK(!isIndexed(track, "title"));
+    CHECK(!isIndexed(track, "kind"));
+  }
+}
@@ -0,0 +1,111 @@
+// Tests of the request engine (openai.hpp).
+
+#define OPENAI_TIMEOUT 2
+
+#include "openai.hpp"
+
+#include <chrono>
+#include <condition_variable>
+
+#include "mock_server.hpp"
+#include "test.hpp"
+
+static const std::string request = R"({"model": "gpt-4", "messages": []})";
+
+// Requests from one thread are in flight at the same time: the server
+// only answers once it has all of them.
+TEST(runs_requests_concurrently) {
+  const size_t n = 4;
+  std::mutex mutex;
+  std::condition_variable arrived;
+  size_t waiting = 0;
+  mock_server server([&](const mock_server::request&) {
+    std::unique_lock<std::mutex> lock(mutex);
+    waiting++;
+    arrived.notify_all();
+    bool all = arrived.wait_for(lock, std::chrono::seconds(5), [&]() { return waiting >= n; });
+    return mock_server::chat(all ? "together" : "alone");
+  });
+  openai::OpenAI ai("test");
+  ai.setBaseUrl(server.url());
+  std::vector<std::future<openai::Json>> responses;
+  for (size_t i = 0; i < n; i++) {
+    responses.push_back(ai.postAsync("chat/completions", request));
+  }
+  for (auto& response : responses) {
+    auto answer = response.get();
+    CHECK_EQ(answer["choices"][0]["message"]["content"], "together");
+  }
+}
+
+// A stream gets the body of the response as it arrives, and then ends.
+TEST(streams_the_response_body) {
+  auto events = mock_server::stream("{\"SQL\": \"SELECT 1;\"}", 4);
+  mock_server server([&](const mock_server::request&) { return events; });
+  openai::OpenAI ai("test");
+  ai.setBaseUrl(server.url());
+  auto stream = std::make_shared<openai::BodyStream>();
+  auto response = ai.postAsync("chat/completions", request, "application/json", stream);
+  std::string body, part;
+  while (stream->next(part)) {
+    body += part;
+  }
+  CHECK_EQ(body, events);
+  // Server-sent events aren't JSON.
+  CHECK(response.get().is_null());
+}
+
+// Requests go through the proxy set on the client, if any.
+TEST(sends_requests_through_the_proxy) {
+  mock_server proxy([](const mock_server::request&) { return mock_server::chat("proxied"); });
+  openai::OpenAI ai("test");
+  ai.setBaseUrl("http://api.example.invalid/v1/");
+  ai.setProxy(proxy.proxy());
+  auto response = ai.postAsync("chat/completions", request).get();
+  CHECK_EQ(response["choices"][0]["message"]["content"], "proxied");
+  auto requests = proxy.requests();
+  CHECK_EQ(requests.size(), 1u);
+  if (requests.size() == 1) {
+    // A proxy is sent the whole URL.
+    CHECK_EQ(requests[0].target, "http://api.example.invalid/v1/chat/completions");
+  }
+}
+
+// A request that can't be sent fails its future, rather than hanging.
+TEST(reports_failed_requests) {
+  openai::OpenAI ai("test");
+  ai.setBaseUrl("http://127.0.0.1:1/v1/");
+  bool threw = false;
+  try {
+    ai.postAsync("chat/completions", request).get();
+  } catch (std::exception&) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+// A server that doesn't answer in time fails the request, rather than
+// leaving it waiting forever; other requests carry on meanwhile.
+TEST(gives_up_on_stalled_requests) {
+  mock_server server([](const mock_server::request& request) {
+    if (request.body.find("stall") != std::string::npos) {
+      std::this_thread::sleep_for(std::chrono::seconds(4));
+    }
+    return mock_server::chat("answered");
+  });
+  openai::OpenAI ai("test");
+  ai.setBaseUrl(server.url());
+  auto start = std::chrono::steady_clock::now();
+  const std::string stalling = R"({"model": "gpt-4", "messages": [], "user": "stall"})";
+  auto stalled = ai.postAsync("chat/completions", stalling);
+  auto answer = ai.postAsync("chat/completions", request).get();
+  CHECK_EQ(answer["choices"][0]["message"]["content"], "answered");
+  bool threw = false;
+  try {
+    stalled.get();
+  } catch (std::exception&) {
+    threw = true;
+  }
+  CHECK(threw);
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(4));
+}
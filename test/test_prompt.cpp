@@ -0,0 +1,68 @@
+// Tests of prompts (prompt.hpp).
+
+#include "prompt.hpp"
+
+#include "test.hpp"
+
+using json = nlohmann::json;
+
+// What json would write for text.
+static std::string dumped(const std::string& text) {
+  return json(text).dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+static std::string written(const ai::prompt& p) {
+  std::string out;
+  p.write_json(out);
+  return out;
+}
+
+// Escapes the way json does, including replacing invalid UTF-8 with U+FFFD.
+TEST(write_json_matches_json) {
+  for (std::string text : {
+      std::string("plain text"),
+      std::string("quotes \" and \\ backslashes"),
+      std::string("controls \n\r\t\b\f and \x01\x1f"),
+      std::string("caf\xc3\xa9, \xe2\x82\xac, \xf0\x9f\x8e\xb5"), // 2-, 3-, and 4-byte sequences
+      std::string("lone continuation \x80 byte"),
+      std::string("truncated \xe2\x82"),                          // at the end
+      std::string("truncated \xe2\x82 in the middle"),
+      std::string("overlong \xc0\xaf and \xe0\x80\xaf"),
+      std::string("surrogate \xed\xa0\x80"),
+      std::string("past U+10FFFF \xf4\x90\x80\x80"),
+      std::string("invalid lead \xf5\x80 and \xff"),
+      std::string("nul \0 byte", 10) }) {
+    ai::prompt p;
+    p.append(text);
+    CHECK_EQ(written(p), dumped(text));
+  }
+}
+
+// A prompt of many pieces, some copied and some referred to, writes as
+// one string.
+TEST(write_json_joins_pieces) {
+  std::string schema = "CREATE TABLE \"caf\xc3\xa9\"(x);\n";
+  ai::prompt p;
+  p.append("Schema:\n");
+  p.append_ref(schema);
+  p.format(FMT_COMPILE("Question: '{}'\n"), "why \xff?");
+  CHECK_EQ(p.str(), "Schema:\n" + schema + "Question: 'why \xff?'\n");
+  CHECK_EQ(written(p), dumped(p.str()));
+}
+
+// A request body is the same as json would write for the same messages.
+TEST(chat_request_matches_json) {
+  auto p = std::make_shared<ai::prompt>();
+  p->append("Translate \"this\" \xe2\x82");
+  std::list<ai::message> messages {
+    ai::message(json({ { "role", "assistant" }, { "content", "You only respond with JSON." } })),
+    ai::message("user", p)
+  };
+  auto body = ai::chatRequest("gpt-4", messages);
+  json expected = {
+    { "model", "gpt-4" },
+    { "messages", { { { "role", "assistant" }, { "content", "You only respond with JSON." } },
+		    { { "role", "user" }, { "content", p->str() } } } }
+  };
+  CHECK_EQ(json::parse(body), json::parse(expected.dump(-1, ' ', false, json::error_handler_t::replace)));
+}
@@ -0,0 +1,79 @@
+// Tests of the table sampler (sampler.hpp).
+
+#include "sampler.hpp"
+
+#include "test.hpp"
+
+static SchemaSnapshot::Table tableNamed(const std::string& name) {
+  SchemaSnapshot::Table table;
+  table.name = table.base_name = name;
+  table.type = "table";
+  return table;
+}
+
+static SamplingBudget plentyOfTime() {
+  return SamplingBudget(std::chrono::steady_clock::now() + std::chrono::hours(1));
+}
+
+// Rowids that mostly sit after a gap still give distinct samples, rather
+// than the row after the gap over and over.
+TEST(samples_past_rowid_gaps) {
+  sqlite3* db;
+  sqlite3_open(":memory:", &db);
+  // Shaped like test/test.db: rowid 1, then 1234 to 1249.
+  sqlite3_exec(db,
+	       "CREATE TABLE artist(id INTEGER PRIMARY KEY, name TEXT);"
+	       "INSERT INTO artist VALUES (1, 'name 0');"
+	       "WITH RECURSIVE n(i) AS (SELECT 1234 UNION ALL SELECT i + 1 FROM n WHERE i < 1249)"
+	       "  INSERT INTO artist SELECT i, 'name ' || (i - 1233) FROM n;",
+	       nullptr, nullptr, nullptr);
+  auto table = tableNamed("artist");
+  for (int attempt = 0; attempt < 20; attempt++) {
+    auto budget = plentyOfTime();
+    std::vector<ColumnProfile> profiles;
+    CHECK(sampleTable(db, table, nullptr, { "name" }, 5, budget, profiles));
+    CHECK_EQ(profiles[0].samples.size(), 5u);
+  }
+  sqlite3_close(db);
+}
+
+// A table with fewer rows than samples asked for is read in full, once.
+TEST(reads_small_tables_in_full) {
+  sqlite3* db;
+  sqlite3_open(":memory:", &db);
+  sqlite3_exec(db,
+	       "CREATE TABLE genre(id INTEGER PRIMARY KEY, name TEXT);"
+	       "INSERT INTO genre VALUES (3, 'Rock'), (10, 'Jazz'), (11, 'Metal');",
+	       nullptr, nullptr, nullptr);
+  auto table = tableNamed("genre");
+  auto budget = plentyOfTime();
+  std::vector<ColumnProfile> profiles;
+  CHECK(sampleTable(db, table, nullptr, { "name" }, 5, budget, profiles));
+  CHECK_EQ(profiles[0].samples.size(), 3u);
+  CHECK_EQ(profiles[0].rows, 3u);
+  sqlite3_close(db);
+}
+
+// Tables without a rowid are read from the start, with text lengths
+// counted from the values and BLOBs left out of the samples.
+TEST(samples_tables_without_rowid) {
+  sqlite3* db;
+  sqlite3_open(":memory:", &db);
+  sqlite3_exec(db,
+	       "CREATE TABLE attachment(name TEXT PRIMARY KEY, body BLOB) WITHOUT ROWID;"
+	       "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n WHERE i < 9)"
+	       "  INSERT INTO attachment SELECT 'file ' || i, zeroblob(100000) FROM n;",
+	       nullptr, nullptr, nullptr);
+  auto table = tableNamed("attachment");
+  auto budget = plentyOfTime();
+  std::vector<ColumnProfile> profiles;
+  CHECK(sampleTable(db, table, nullptr, { "name", "body" }, 5, budget, profiles));
+  auto name = profiles[0].summary();
+  CHECK_EQ(name["kind"], "text");
+  CHECK_EQ(name["avg_length"].get<double>(), 6.0);
+  CHECK_EQ(profiles[0].samples.size(), 5u);
+  auto body = profiles[1].summary();
+  CHECK_EQ(body["avg_length"].get<double>(), 0.0);
+  CHECK(!body.contains("samples"));
+  sqlite3_close(db);
+}
@@ -0,0 +1,43 @@
+// Tests that sampling keeps to its time budget (sqlwrite.cpp), made short here.
+
+#define SAMPLE_BUDGET_MS 20
+#define PRECONNECT 0
+#include "sqlwrite.cpp"
+
+#include <unistd.h>
+
+#include "test.hpp"
+
+// A table that takes far longer than the budget just to count (about
+// 400MB, one row per page).
+static void addLargeTable(sqlite3* db) {
+  sqlite3_exec(db,
+	       "CREATE TABLE attachment(id INTEGER PRIMARY KEY, name TEXT, body BLOB);"
+	       "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100000)"
+	       "  INSERT INTO attachment(name, body) SELECT 'file ' || i, zeroblob(3000) FROM n;",
+	       nullptr, nullptr, nullptr);
+}
+
+// A large table that has never been sampled is read within the budget,
+// even if the data hasn't changed since the last time we sampled.
+TEST(unchanged_data_keeps_to_the_budget) {
+  char filename[] = "/tmp/sqlwrite_sampling_budget_XXXXXX";
+  close(mkstemp(filename));
+  sqlite3* db;
+  sqlite3_open(filename, &db);
+  sqlite3_exec(db,
+	       "CREATE TABLE genre(id INTEGER PRIMARY KEY, name TEXT);"
+	       "INSERT INTO genre(name) VALUES ('Rock'), ('Jazz'), ('Metal');",
+	       nullptr, nullptr, nullptr);
+  addLargeTable(db);
+  ConnectionState state;
+  auto schema = getSchemaSnapshot(db, state);
+  json matches;
+  sampleSQLiteDistinct(db, state, *schema, { "genre" }, "which genres are there?", 5, matches);
+  auto start = std::chrono::steady_clock::now();
+  sampleSQLiteDistinct(db, state, *schema, {}, "how many attachments are there?", 5, matches);
+  auto sampling = std::chrono::steady_clock::now() - start;
+  sqlite3_close(db);
+  unlink(filename);
+  CHECK(sampling < std::chrono::milliseconds(4 * SAMPLE_BUDGET_MS));
+}
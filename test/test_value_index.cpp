@@ -0,0 +1,230 @@
+// Tests of the value index (value_index.hpp).
+
+#define VALUE_INDEX_ROWS_PER_ASK 100
+#define MAX_INDEXED_VALUES 50
+
+#include "sampler.hpp"
+#include "value_index.hpp"
+
+#include <unistd.h>
+
+#include "test.hpp"
+
+// A snapshot of the schema of db, as far as the value index needs it.
+static SchemaSnapshot schemaOf(sqlite3* db) {
+  SchemaSnapshot schema;
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "SELECT name, type FROM sqlite_master WHERE type IN ('table', 'view') AND name NOT LIKE 'sqlwrite%';", -1, &stmt, nullptr);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    SchemaSnapshot::Table table;
+    table.name = table.base_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    table.type = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+    schema.table_index[table.name] = schema.tables.size();
+    schema.tables.push_back(table);
+  }
+  sqlite3_finalize(stmt);
+  return schema;
+}
+
+// A cache entry saying that each column holds short text.
+static SampleCache::Entry textColumns(std::initializer_list<const char*> columns) {
+  SampleCache::Entry entry;
+  entry.columns = json::object();
+  for (auto column : columns) {
+    entry.columns[column] = { { "kind", "text" }, { "avg_length", 8.0 } };
+  }
+  return entry;
+}
+
+static SamplingBudget plentyOfTime() {
+  return SamplingBudget(std::chrono::steady_clock::now() + std::chrono::hours(1));
+}
+
+static size_t count(sqlite3* db, const std::string& query) {
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, nullptr);
+  size_t n = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+  sqlite3_finalize(stmt);
+  return n;
+}
+
+// 1000 events of 5 kinds, each for one of 200 users; "refund" only appears near the end.
+static sqlite3* eventDatabase(const char* filename) {
+  sqlite3* db;
+  sqlite3_open(filename, &db);
+  sqlite3_exec(db,
+	       "CREATE TABLE event(id INTEGER PRIMARY KEY, kind TEXT, user TEXT);"
+	       "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 1000)"
+	       "  INSERT INTO event(kind, user) SELECT CASE WHEN i > 990 THEN 'refund' ELSE 'kind ' || (i % 4) END, 'user ' || (i % 200) FROM n;",
+	       nullptr, nullptr, nullptr);
+  return db;
+}
+
+// Large tables are read a slice per call, but every value is indexed in the end.
+TEST(indexes_large_tables_a_slice_at_a_time) {
+  auto db = eventDatabase(":memory:");
+  auto schema = schemaOf(db);
+  SampleCache cache;
+  cache.tables["event"] = textColumns({ "kind" });
+  auto budget = plentyOfTime();
+  int calls = 0;
+  while (valuesPending(cache, "event") && calls < 100) {
+    updateValueIndex(db, schema, cache, { "event" }, budget);
+    calls++;
+  }
+  // Ten slices, and one to find there are no more rows.
+  CHECK_EQ(calls, 11);
+  CHECK(!cache.values_indexed["event"].failed);
+  // Each distinct value once.
+  CHECK_EQ(count(db, "SELECT count(*) FROM sqlwrite_values WHERE col = 'kind';"), 5u);
+  auto matches = matchValues(db, cache, "how many refund events were there?");
+  CHECK_EQ(matches.size(), 1u);
+  if (matches.size() == 1) {
+    CHECK_EQ(matches[0]["value"], "refund");
+    CHECK_EQ(matches[0]["column"], "kind");
+  }
+  sqlite3_close(db);
+}
+
+// A later session picks up where an earlier one stopped, without indexing anything twice.
+TEST(resumes_where_an_earlier_session_stopped) {
+  char filename[] = "/tmp/sqlwrite_value_index_XXXXXX";
+  close(mkstemp(filename));
+  auto db = eventDatabase(filename);
+  auto schema = schemaOf(db);
+  auto budget = plentyOfTime();
+  {
+    SampleCache cache;
+    cache.tables["event"] = textColumns({ "kind", "user" });
+    updateValueIndex(db, schema, cache, { "event" }, budget);
+    updateValueIndex(db, schema, cache, { "event" }, budget);
+    CHECK(valuesPending(cache, "event"));
+  }
+  SampleCache cache;
+  cache.tables["event"] = textColumns({ "kind", "user" });
+  loadValueIndex(db, cache);
+  CHECK(cache.values_available);
+  CHECK_EQ(cache.values_indexed["event"].next_rowid, 201);
+  while (valuesPending(cache, "event")) {
+    updateValueIndex(db, schema, cache, { "event" }, budget);
+  }
+  CHECK_EQ(count(db, "SELECT count(*) FROM sqlwrite_values WHERE col = 'kind';"), 5u);
+  CHECK_EQ(count(db, "SELECT count(*) FROM sqlwrite_values WHERE col = 'user' AND value != '';"), 0u);
+  // Over MAX_INDEXED_VALUES, so left out rather than cut off, in this session and the next.
+  CHECK(cache.values_indexed["event"].too_many.count("user"));
+  SampleCache reloaded;
+  loadValueIndex(db, reloaded);
+  CHECK(!valuesPending(reloaded, "event"));
+  CHECK(reloaded.values_indexed["event"].too_many.count("user"));
+  sqlite3_close(db);
+  unlink(filename);
+}
+
+// A table whose slice can't be written isn't tried again on every call.
+TEST(records_a_failed_build) {
+  char filename[] = "/tmp/sqlwrite_value_index_XXXXXX";
+  close(mkstemp(filename));
+  auto db = eventDatabase(filename);
+  auto schema = schemaOf(db);
+  auto budget = plentyOfTime();
+  SampleCache cache;
+  cache.tables["event"] = textColumns({ "kind" });
+  // Create the index, then have another connection hold the write lock.
+  sqlite3_exec(db, "CREATE VIRTUAL TABLE IF NOT EXISTS sqlwrite_values USING fts5(value, tbl UNINDEXED, col UNINDEXED, tokenize='trigram');", nullptr, nullptr, nullptr);
+  sqlite3* other;
+  sqlite3_open(filename, &other);
+  sqlite3_exec(other, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+  updateValueIndex(db, schema, cache, { "event" }, budget);
+  CHECK(cache.values_indexed["event"].failed);
+  CHECK(!valuesPending(cache, "event"));
+  sqlite3_exec(other, "COMMIT;", nullptr, nullptr, nullptr);
+  sqlite3_close(other);
+  // Once the table is resampled, it is started over.
+  cache.values_indexed.erase("event");
+  while (valuesPending(cache, "event")) {
+    updateValueIndex(db, schema, cache, { "event" }, budget);
+  }
+  CHECK_EQ(count(db, "SELECT count(*) FROM sqlwrite_values WHERE col = 'kind';"), 5u);
+  sqlite3_close(db);
+  unlink(filename);
+}
+
+// Once a table has changed, the values indexed before aren't matched,
+// even while they can't be replaced.
+TEST(hides_values_of_changed_tables) {
+  char filename[] = "/tmp/sqlwrite_value_index_XXXXXX";
+  close(mkstemp(filename));
+  auto db = eventDatabase(filename);
+  auto schema = schemaOf(db);
+  auto budget = plentyOfTime();
+  SampleCache cache;
+  cache.tables["event"] = textColumns({ "kind" });
+  while (valuesPending(cache, "event")) {
+    updateValueIndex(db, schema, cache, { "event" }, budget);
+  }
+  CHECK_EQ(matchValues(db, cache, "how many refund events were there?").size(), 1u);
+  // Resampling the changed table resets its progress.
+  sqlite3_exec(db, "UPDATE event SET kind = 'chargeback' WHERE kind = 'refund';", nullptr, nullptr, nullptr);
+  cache.values_indexed.erase("event");
+  CHECK(matchValues(db, cache, "how many refund events were there?").empty());
+  // Starting it over fails while another connection holds the write lock.
+  sqlite3* other;
+  sqlite3_open(filename, &other);
+  sqlite3_exec(other, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+  updateValueIndex(db, schema, cache, { "event" }, budget);
+  sqlite3_exec(other, "COMMIT;", nullptr, nullptr, nullptr);
+  sqlite3_close(other);
+  CHECK(cache.values_indexed["event"].failed);
+  CHECK(matchValues(db, cache, "how many refund events were there?").empty());
+  // Until the table is resampled again and indexed from the start.
+  cache.values_indexed.erase("event");
+  while (valuesPending(cache, "event")) {
+    updateValueIndex(db, schema, cache, { "event" }, budget);
+  }
+  CHECK(matchValues(db, cache, "how many refund events were there?").empty());
+  CHECK_EQ(matchValues(db, cache, "how many chargeback events were there?").size(), 1u);
+  sqlite3_close(db);
+  unlink(filename);
+}
+
+// Views are left to the tables they select from.
+TEST(skips_views) {
+  auto db = eventDatabase(":memory:");
+  sqlite3_exec(db, "CREATE VIEW refunds AS SELECT * FROM event WHERE kind = 'refund';", nullptr, nullptr, nullptr);
+  auto schema = schemaOf(db);
+  SampleCache cache;
+  cache.tables["refunds"] = textColumns({ "kind" });
+  auto budget = plentyOfTime();
+  updateValueIndex(db, schema, cache, { "refunds" }, budget);
+  CHECK(!valuesPending(cache, "refunds"));
+  CHECK_EQ(count(db, "SELECT count(*) FROM sqlwrite_values WHERE tbl = 'refunds' AND col != '';"), 0u);
+  sqlite3_close(db);
+}
+
+// Apostrophes within words don't start quoted literals.
+TEST(matches_quoted_literals_with_apostrophes) {
+  sqlite3* db;
+  sqlite3_open(":memory:", &db);
+  sqlite3_exec(db,
+	       "CREATE TABLE track(id INTEGER PRIMARY KEY, name TEXT);"
+	       "INSERT INTO track(name) VALUES ('Stop'), ('Now'), ('Don''t Stop Me Now'), ('Rock');",
+	       nullptr, nullptr, nullptr);
+  auto schema = schemaOf(db);
+  SampleCache cache;
+  cache.tables["track"] = textColumns({ "name" });
+  auto budget = plentyOfTime();
+  while (valuesPending(cache, "track")) {
+    updateValueIndex(db, schema, cache, { "track" }, budget);
+  }
+  auto matches = matchValues(db, cache, "is 'Don't Stop Me Now' on an album?");
+  CHECK(!matches.empty());
+  if (!matches.empty()) {
+    CHECK_EQ(matches[0]["value"], "Don't Stop Me Now");
+  }
+  matches = matchValues(db, cache, "which albums don't have \"Rock\" tracks?");
+  CHECK(!matches.empty());
+  if (!matches.empty()) {
+    CHECK_EQ(matches[0]["value"], "Rock");
+  }
+  sqlite3_close(db);
+}
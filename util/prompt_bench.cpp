@@ -0,0 +1,186 @@
+// Counts the heap allocations (and bytes, and time) it takes to build a
+// translation prompt for a synthetic schema and turn it into request
+// bodies: the old way, appending to a std::string, copying it into a json
+// message, and dumping a copy of the request for every attempt; and with
+// ai::prompt, referring to the schema's text, formatting the rest into an
+// arena, and writing the request body once. Checks that both send the same
+// request.
+//
+// Build from the repository root:
+//   clang++ -std=c++17 -O2 -DNDEBUG -I. -Ifmt/include util/prompt_bench.cpp fmt/src/format.cc -o prompt_bench
+// Usage:
+//   ./prompt_bench [tables (default 1000)] [attempts (default 3)]
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fmt/compile.h>
+#include <fmt/format.h>
+
+#include "json.hpp"
+#include "prompt.hpp"
+
+using json = nlohmann::json;
+
+static size_t allocations = 0;
+static size_t allocated_bytes = 0;
+
+void* operator new(size_t n) {
+  allocations++;
+  allocated_bytes += n;
+  if (auto p = std::malloc(n ? n : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+// What the prompt is built from; built before measuring, as the schema snapshot is cached.
+struct Schema {
+  std::string header;
+  std::vector<std::string> tables;
+  std::vector<long long> rows;
+  std::vector<std::array<std::string, 4>> joins; // table, column, parent, parent column
+  std::string index_header;
+  std::vector<std::string> indexes;
+  std::string profiles;
+};
+
+static const char* question = "which customers bought the most \"Rock\" tracks in 2023?";
+static const char* system_message = "You are a programming assistant who is an expert in generating SQL queries from natural language. You ONLY respond with JSON objects.";
+
+static Schema makeSchema(size_t tables) {
+  Schema schema;
+  schema.header = "Schema, as table(column type [PK] [FK referenced table.column] [indexed], ...):\n";
+  schema.index_header = "Existing indexes:\n";
+  json profiles = json::object();
+  for (size_t i = 0; i < tables; i++) {
+    schema.tables.push_back(fmt::format("Table{0}(Id INTEGER PK, Name TEXT, Created TEXT indexed, Amount REAL, Table{1}Id INTEGER FK Table{1}.Id indexed, Notes TEXT)\n", i, (i + 1) % tables));
+    schema.rows.push_back(static_cast<long long>(i * 37 % 100000));
+    schema.joins.push_back({ fmt::format("Table{}", i), fmt::format("Table{}Id", (i + 1) % tables), fmt::format("Table{}", (i + 1) % tables), "Id" });
+    schema.indexes.push_back(fmt::format("IFK_Table{0}Created ON Table{0}(Created)\n", i));
+    profiles[fmt::format("Table{}", i)] = { { "Name", fmt::format("text, one of [\"Café {0}\", \"O'Brien\\\\{0}\", \"tab\\there\"]", i) } };
+  }
+  schema.profiles = "\nColumn profiles: " + profiles.dump() + "\n";
+  return schema;
+}
+
+// The request bodies for each attempt, built as translateQuery and aistream used to.
+static size_t legacy(const Schema& schema, size_t attempts, std::string& last) {
+  auto prompt = fmt::format("Given a database with the following tables, answer this question: '{}'. Produce a JSON object with the SQL query as a field \"SQL\".\n", question);
+  std::vector<std::string> texts(schema.tables);
+  for (size_t i = 0; i < texts.size(); i++) {
+    texts[i].insert(texts[i].size() - 1, fmt::format(" -- ~{} rows", schema.rows[i]));
+  }
+  prompt += schema.header;
+  for (auto& text : texts) {
+    prompt += text;
+  }
+  prompt += "Join the tables the question is about on:\n";
+  for (auto& [table, column, parent, parent_column] : schema.joins) {
+    std::string condition;
+    condition += fmt::format("{}{}.{} = {}.{}", "", table, column, parent, parent_column);
+    prompt += condition + "\n";
+  }
+  prompt += schema.index_header;
+  for (auto& index : schema.indexes) {
+    prompt += index;
+  }
+  prompt += schema.profiles;
+
+  std::list<json> messages;
+  messages.push_back(json({ { "role", "assistant" }, { "content", system_message } }));
+  messages.push_back(json({ { "role", "user" }, { "content", prompt.c_str() } }));
+  json j;
+  j["model"] = "gpt-4";
+  j["messages"] = messages;
+  size_t sent = 0;
+  for (size_t attempt = 0; attempt < attempts; attempt++) {
+    // openai::chat().create took its json by value, then dumped it.
+    auto copy = [](json input) { return input.dump(); };
+    last = copy(j);
+    sent += last.size();
+  }
+  return sent;
+}
+
+// The same, built as translateQuery and aistream do now.
+static size_t rope(const Schema& schema, size_t attempts, std::string& last) {
+  auto prompt = std::make_shared<ai::prompt>();
+  prompt->format(FMT_COMPILE("Given a database with the following tables, answer this question: '{}'. Produce a JSON object with the SQL query as a field \"SQL\".\n"), question);
+  prompt->append_ref(schema.header);
+  for (size_t i = 0; i < schema.tables.size(); i++) {
+    prompt->append_ref(std::string_view(schema.tables[i]).substr(0, schema.tables[i].size() - 1));
+    prompt->format(FMT_COMPILE(" -- ~{} rows\n"), schema.rows[i]);
+  }
+  prompt->append_ref("Join the tables the question is about on:\n");
+  for (auto& [table, column, parent, parent_column] : schema.joins) {
+    fmt::memory_buffer condition;
+    fmt::format_to(std::back_inserter(condition), FMT_COMPILE("{}{}.{} = {}.{}"), "", table, column, parent, parent_column);
+    condition.push_back('\n');
+    prompt->append(std::string_view(condition.data(), condition.size()));
+  }
+  prompt->append_ref(schema.index_header);
+  for (auto& index : schema.indexes) {
+    prompt->append_ref(index);
+  }
+  prompt->append(schema.profiles);
+
+  std::list<ai::message> messages;
+  messages.push_back(json({ { "role", "assistant" }, { "content", system_message } }));
+  messages.push_back(ai::message("user", prompt));
+  // Written once, and sent as is on every attempt.
+  last = ai::chatRequest("gpt-4", messages);
+  return last.size() * attempts;
+}
+
+template <class F>
+static void measure(const char* name, F f, size_t repetitions) {
+  std::string body;
+  size_t sent = 0;
+  auto before = allocations;
+  auto before_bytes = allocated_bytes;
+  f(body);
+  auto count = allocations - before;
+  auto bytes = allocated_bytes - before_bytes;
+  double best = 1e30;
+  for (size_t r = 0; r < repetitions; r++) {
+    auto start = std::chrono::steady_clock::now();
+    sent = f(body);
+    best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::printf("%-8s %10zu allocations %12zu bytes allocated %10zu bytes sent %9.3f ms\n", name, count, bytes, sent, best);
+}
+
+int main(int argc, char* argv[]) {
+  size_t tables = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 1000;
+  size_t attempts = (argc > 2) ? std::strtoul(argv[2], nullptr, 10) : 3;
+  auto schema = makeSchema(tables);
+  std::printf("%zu tables, %zu attempts\n", tables, attempts);
+
+  std::string legacy_body, rope_body;
+  measure("string", [&](std::string& body) { return legacy(schema, attempts, body); }, 10);
+  legacy(schema, attempts, legacy_body);
+  measure("prompt", [&](std::string& body) { return rope(schema, attempts, body); }, 10);
+  rope(schema, attempts, rope_body);
+
+  if (json::parse(legacy_body) != json::parse(rope_body)) {
+    std::fprintf(stderr, "The request bodies differ.\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,347 @@
+#ifndef VALUE_INDEX_HPP_
+#define VALUE_INDEX_HPP_
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include <fmt/format.h>
+
+#include "json.hpp"
+#include "sampler.hpp"
+#include "schema.hpp"
+
+/*
+
+  The value index: the short text values of sampled tables, in an FTS5
+  table with the trigram tokenizer, so that the literals a question
+  mentions ("AC/DC", "Rock") can be traced to the columns holding them.
+
+  Example usage:
+
+  SamplingBudget budget(std::chrono::steady_clock::now() + std::chrono::seconds(1));
+  loadValueIndex(db, cache);
+  updateValueIndex(db, schema, cache, { "Genre" }, budget);
+  auto matches = matchValues(db, cache, "how many rock tracks are there?");
+  // [{ "table": "Genre", "column": "Name", "value": "Rock" }, ...]
+
+  Like sampler.hpp, include this after SQLITE_EXTENSION_INIT1 in a
+  loadable extension.
+
+ */
+
+#if !defined(INDEX_VALUES)
+// Keep short text values in the sqlwrite_values full-text index, to find the
+// literals a question refers to.
+#define INDEX_VALUES 1
+#endif
+#if !defined(MAX_INDEXED_VALUES)
+// Columns with more distinct values than this are left out of the index,
+// rather than indexed in part.
+#define MAX_INDEXED_VALUES 10000
+#endif
+#if !defined(VALUE_INDEX_ROWS_PER_ASK)
+// Rows of each table read into the index per ask; larger tables are
+// indexed a slice at a time, over several asks.
+#define VALUE_INDEX_ROWS_PER_ASK 100000
+#endif
+#if !defined(MAX_MATCHED_VALUES)
+// Matching values shown to the model.
+#define MAX_MATCHED_VALUES 20
+#endif
+
+// Reads how far an earlier session got. Each table has a marker row with
+// an empty column name, whose value is the rowid to resume from (empty
+// once the table is done); each column left out for having too many
+// values has a row with an empty value.
+inline void loadValueIndex(sqlite3* DB, SampleCache& cache) {
+#if INDEX_VALUES
+  auto load_query = fmt::format("SELECT rowid, tbl, col, value FROM {} WHERE col = '' OR value = '';", valueIndexTable);
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(DB, load_query.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+    cache.values_available = true;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto tbl = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+      auto col = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+      auto value = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+      if (!tbl || !col || !value) {
+	continue;
+      }
+      auto& progress = cache.values_indexed[tbl];
+      if (*col) {
+	progress.too_many.insert(col);
+      } else {
+	progress.marker = sqlite3_column_int64(stmt, 0);
+	progress.done = !*value;
+	std::from_chars(value, value + strlen(value), progress.next_rowid);
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+#endif
+}
+
+// Whether the value index still has to read (some of) a table.
+inline bool valuesPending(const SampleCache& cache, const std::string& table) {
+  auto progress = cache.values_indexed.find(table);
+  return progress == cache.values_indexed.end() || !(progress->second.done || progress->second.failed);
+}
+
+// Adds the next slice of each table's rows to the value index: the
+// distinct short values of their text columns, in an FTS5 table with the
+// trigram tokenizer so that any part of a value can be looked up. Tables
+// are read in rowid order, at most VALUE_INDEX_ROWS_PER_ASK rows and only
+// until the budget runs out, so every ask makes some progress however
+// large they are; tables with no progress recorded (see valuesPending)
+// are started over. Views are left out, since their values come from
+// tables that are indexed themselves, and tables without a rowid are only
+// read up to the first slice.
+//
+// Writing a slice that fails (e.g., because another connection holds the
+// write lock) is not retried until the table is resampled. Does nothing if
+// the database is read-only or SQLite lacks FTS5.
+inline void updateValueIndex(sqlite3* DB, const SchemaSnapshot& schema, SampleCache& cache, const std::vector<std::string>& tables, SamplingBudget& budget) {
+#if INDEX_VALUES
+  if (tables.empty() || sqlite3_db_readonly(DB, "main") != 0) {
+    return;
+  }
+  auto create_query = fmt::format("CREATE VIRTUAL TABLE IF NOT EXISTS {} USING fts5(value, tbl UNINDEXED, col UNINDEXED, tokenize='trigram');", valueIndexTable);
+  if (sqlite3_exec(DB, create_query.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK) {
+    return;
+  }
+  cache.values_available = true;
+  sqlite3_stmt* stmt;
+  for (auto& table : tables) {
+    auto found = schema.find(table);
+    auto cached = cache.tables.find(table);
+    if (budget.expired()) {
+      break;
+    }
+    if (!found || cached == cache.tables.end() || !valuesPending(cache, table)) {
+      continue;
+    }
+    auto fresh = !cache.values_indexed.count(table);
+    auto& progress = cache.values_indexed[table];
+    if (found->type != "table") {
+      progress.done = true;
+      continue;
+    }
+    auto table_str = quoteString(table);
+    if (!fresh && !progress.resumed) {
+      // Continuing where an earlier session left off: note what it indexed.
+      auto seen_query = fmt::format("SELECT col, value FROM {} WHERE tbl = {} AND col != '' AND value != '';", valueIndexTable, table_str);
+      sqlite3_prepare_v2(DB, seen_query.c_str(), -1, &stmt, nullptr);
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+	auto value = std::string_view(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)), sqlite3_column_bytes(stmt, 1));
+	progress.seen[reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0))].insert(std::hash<std::string_view>{}(value));
+      }
+      sqlite3_finalize(stmt);
+    }
+    progress.resumed = true;
+
+    // The text columns short enough to be worth indexing.
+    std::vector<std::string> columns;
+    std::string column_list;
+    for (auto& [column, summary] : cached->second.columns.items()) {
+      if (summary["kind"] == "text" && summary["avg_length"].get<double>() <= samplePrefixBytes && !progress.too_many.count(column)) {
+	columns.push_back(column);
+	column_list += fmt::format(", CASE WHEN typeof({0}) = 'text' AND length({0}) <= {1} THEN {0} END", quoteIdentifier(column), samplePrefixBytes);
+      }
+    }
+    auto slice_query = fmt::format("SELECT rowid{} FROM {} WHERE rowid >= ? ORDER BY rowid;", column_list, found->quoted());
+    bool has_rowid = sqlite3_prepare_v2(DB, slice_query.c_str(), -1, &stmt, nullptr) == SQLITE_OK;
+    if (has_rowid) {
+      sqlite3_bind_int64(stmt, 1, progress.next_rowid);
+    } else {
+      sqlite3_finalize(stmt);
+      slice_query = fmt::format("SELECT NULL{} FROM {};", column_list, found->quoted());
+      sqlite3_prepare_v2(DB, slice_query.c_str(), -1, &stmt, nullptr);
+    }
+    std::vector<std::pair<std::string, std::string>> added; // (column, value)
+    std::set<std::string> too_many;
+    auto next_rowid = progress.next_rowid;
+    int rows = 0, rc = SQLITE_ROW;
+    while (rows < VALUE_INDEX_ROWS_PER_ASK && (rows % 256 != 0 || !budget.expired()) && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      rows++;
+      auto rowid = sqlite3_column_int64(stmt, 0);
+      if (rowid == std::numeric_limits<sqlite3_int64>::max()) {
+	rc = SQLITE_DONE;
+	break;
+      }
+      next_rowid = rowid + 1;
+      for (size_t i = 0; i < columns.size(); i++) {
+	if (sqlite3_column_type(stmt, i + 1) != SQLITE_TEXT || too_many.count(columns[i])) {
+	  continue;
+	}
+	std::string value(reinterpret_cast<const char*>(sqlite3_column_text(stmt, i + 1)), sqlite3_column_bytes(stmt, i + 1));
+	auto& seen = progress.seen[columns[i]];
+	if (!seen.insert(std::hash<std::string_view>{}(value)).second) {
+	  continue;
+	}
+	if (seen.size() > MAX_INDEXED_VALUES) {
+	  too_many.insert(columns[i]);
+	  seen.clear();
+	} else {
+	  added.emplace_back(columns[i], std::move(value));
+	}
+      }
+    }
+    sqlite3_finalize(stmt);
+    bool done = rc == SQLITE_DONE || (!has_rowid && rc == SQLITE_ROW);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+      // Couldn't read the table; try again once it is resampled.
+      progress.failed = true;
+      progress.stale = fresh;
+      continue;
+    }
+
+    // Write the slice, the columns it found to have too many values, and how far we got.
+    sqlite3_exec(DB, "SAVEPOINT sqlwrite_values;", nullptr, nullptr, nullptr);
+    rc = SQLITE_OK;
+    if (fresh) {
+      auto delete_query = fmt::format("DELETE FROM {} WHERE tbl = {};", valueIndexTable, table_str);
+      rc = sqlite3_exec(DB, delete_query.c_str(), nullptr, nullptr, nullptr);
+    }
+    for (auto& column : too_many) {
+      auto drop_query = fmt::format("DELETE FROM {0} WHERE tbl = {1} AND col = {2}; INSERT INTO {0}(value, tbl, col) VALUES ('', {1}, {2});",
+				    valueIndexTable, table_str, quoteString(column));
+      if (rc == SQLITE_OK) {
+	rc = sqlite3_exec(DB, drop_query.c_str(), nullptr, nullptr, nullptr);
+      }
+    }
+    auto insert_query = fmt::format("INSERT INTO {}(value, tbl, col) VALUES (?, {}, ?);", valueIndexTable, table_str);
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_prepare_v2(DB, insert_query.c_str(), -1, &stmt, nullptr);
+      for (auto it = added.begin(); rc == SQLITE_OK && it != added.end(); it++) {
+	if (too_many.count(it->first)) {
+	  continue;
+	}
+	sqlite3_bind_text(stmt, 1, it->second.c_str(), -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, it->first.c_str(), -1, SQLITE_STATIC);
+	rc = (sqlite3_step(stmt) == SQLITE_DONE) ? SQLITE_OK : SQLITE_ERROR;
+	sqlite3_reset(stmt);
+      }
+      sqlite3_finalize(stmt);
+    }
+    auto resume_from = done ? std::string() : std::to_string(next_rowid);
+    if (rc == SQLITE_OK && (fresh || progress.marker < 0)) {
+      auto marker_query = fmt::format("INSERT INTO {}(value, tbl, col) VALUES ({}, {}, '');", valueIndexTable, quoteString(resume_from), table_str);
+      rc = sqlite3_exec(DB, marker_query.c_str(), nullptr, nullptr, nullptr);
+      progress.marker = sqlite3_last_insert_rowid(DB);
+    } else if (rc == SQLITE_OK) {
+      auto marker_query = fmt::format("UPDATE {} SET value = {} WHERE rowid = {};", valueIndexTable, quoteString(resume_from), progress.marker);
+      rc = sqlite3_exec(DB, marker_query.c_str(), nullptr, nullptr, nullptr);
+    }
+    if (rc != SQLITE_OK) {
+      sqlite3_exec(DB, "ROLLBACK TO sqlwrite_values;", nullptr, nullptr, nullptr);
+      progress.failed = true;
+      progress.stale = fresh;
+      progress.seen.clear();
+    } else {
+      progress.next_rowid = next_rowid;
+      progress.done = done;
+      progress.too_many.insert(too_many.begin(), too_many.end());
+      if (done) {
+	progress.seen.clear();
+      }
+    }
+    sqlite3_exec(DB, "RELEASE sqlwrite_values;", nullptr, nullptr, nullptr);
+  }
+#endif
+}
+
+// Looks up the words and quoted phrases of a question in the value index,
+// returning the values that contain them as [{ table, column, value }].
+// Tables whose progress was reset (because their data changed) are left
+// out, as are tables that couldn't be started over: their rows in the index
+// are stale until updateValueIndex replaces them.
+inline json matchValues(sqlite3* DB, const SampleCache& cache, const std::string& question) {
+  json matches = json::array();
+#if INDEX_VALUES
+  if (!cache.values_available) {
+    return matches;
+  }
+  std::set<std::string> terms;
+  // Quotes open and close only at word boundaries, so that the
+  // apostrophes of "don't" and "O'Brien" are taken as part of the word.
+  auto boundary = [&](size_t i) { return i >= question.size() || !std::isalnum(static_cast<unsigned char>(question[i])); };
+  size_t start = 0;
+  for (size_t i = 0; i <= question.size(); i++) {
+    unsigned char c = i < question.size() ? question[i] : ' ';
+    auto end = i;
+    if ((c == '\'' || c == '"') && (i == 0 || boundary(i - 1))) {
+      while ((end = question.find(c, end + 1)) != std::string::npos && !boundary(end + 1)) {
+      }
+    }
+    if (end != i && end != std::string::npos) {
+      // A quoted literal, taken as a whole.
+      terms.insert(question.substr(i + 1, end - i - 1));
+      i = end;
+      start = i + 1;
+    } else if (c == '\'' && i > start && !boundary(i + 1)) {
+      // An apostrophe within a word.
+      continue;
+    } else if (!std::isalnum(c)) {
+      auto word = question.substr(start, i - start);
+      std::string lower(word);
+      std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+      if (!questionStopwords.count(lower)) {
+	terms.insert(word);
+      }
+      start = i + 1;
+    }
+  }
+  // Trigrams can't match anything shorter.
+  std::string expression, exact;
+  for (auto& term : terms) {
+    if (term.size() >= 3) {
+      std::string lower(term);
+      std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+      exact += fmt::format("{}{}", exact.empty() ? "" : ", ", quoteString(lower));
+      expression += expression.empty() ? "\"" : " OR \"";
+      for (auto c : term) {
+	expression += c;
+	if (c == '"') {
+	  expression += c;
+	}
+      }
+      expression += '"';
+    }
+  }
+  if (expression.empty()) {
+    return matches;
+  }
+  // Values equal to a term first, then the shortest values containing one.
+  auto match_query = fmt::format("SELECT tbl, col, value FROM {0} WHERE {0} MATCH ? AND col != '' ORDER BY lower(value) IN ({1}) DESC, length(value), rank LIMIT {2};",
+				 valueIndexTable, exact, MAX_MATCHED_VALUES);
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(DB, match_query.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+    sqlite3_bind_text(stmt, 1, expression.c_str(), -1, SQLITE_TRANSIENT);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto tbl = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+      auto progress = cache.values_indexed.find(tbl);
+      if (progress == cache.values_indexed.end() || progress->second.stale) {
+	continue;
+      }
+      matches.push_back({
+	  { "table", tbl },
+	  { "column", reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)) },
+	  { "value", reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)) }
+	});
+    }
+  }
+  sqlite3_finalize(stmt);
+#endif
+  return matches;
+}
+
+#endif